@@ -0,0 +1,813 @@
+/*
+Copyright (c) 2015, Frank Hunleth
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * \file bench.c
+ * Throughput and latency benchmark for the raspijpgs server.
+ *
+ * The benchmark starts a raspijpgs server with the synthetic frame source
+ * for every combination of frame size, frame rate, framing and number of
+ * datagram subscribers that it's asked to try. It reads the server's output
+ * and subscribes to it like a client would. Synthetic frames have the time
+ * that they were made in a comment, so the latency of each frame can be
+ * measured from when it was made to when the last byte of it arrived.
+ *
+ * Each run prints one line of JSON to stdout so that results can be saved
+ * and compared between releases.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <err.h>
+#include <poll.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#define MAX_LIST_ITEMS          16
+#define MAX_SUBSCRIBERS         256
+#define READ_BUFFER_SIZE        262144
+#define PENDING_FRAMES          1024 // Frames seen on stdout but not completely read yet
+#define STARTUP_TIMEOUT_US      5000000
+#define WARMUP_US               250000
+#define SHUTDOWN_TIMEOUT_MS     5000
+#define HEARTBEAT_INTERVAL_US   1000000
+#define SUBSCRIBER_RCVBUF       4194304
+
+// Synthetic frames are SOI, a JFIF APP0 segment and then this comment. The
+// comment text starts at a fixed offset from the start of the frame.
+#define FRAME_MARKER            "raspijpgs synthetic frame "
+#define FRAME_MARKER_LEN        (sizeof(FRAME_MARKER) - 1)
+#define FRAME_MARKER_OFFSET     24
+#define FRAME_MARKER_MAX_LEN    (FRAME_MARKER_LEN + 40)
+
+struct bench_options
+{
+    const char *server;
+    double duration;
+
+    int sizes[MAX_LIST_ITEMS];
+    int size_count;
+    double fps[MAX_LIST_ITEMS];
+    int fps_count;
+    char *framings[MAX_LIST_ITEMS];
+    int framing_count;
+    int subscribers[MAX_LIST_ITEMS];
+    int subscribers_count;
+};
+
+// Latencies and amounts for one kind of sink
+struct bench_sink
+{
+    int64_t *latencies;
+    size_t latency_count;
+    size_t latency_alloc;
+    unsigned long frames;
+    unsigned long long bytes;
+};
+
+// Tracks where frames end in a byte stream. A frame is complete once
+// everything up to its end has been read.
+struct pending_frame
+{
+    unsigned long long end;
+    int64_t made_us;
+};
+
+struct stream_scanner
+{
+    char buffer[FRAME_MARKER_MAX_LEN + READ_BUFFER_SIZE];
+    size_t len;
+    unsigned long long base;  // Stream offset of buffer[0]
+    unsigned long long total; // Bytes read so far
+
+    struct pending_frame pending[PENDING_FRAMES];
+    unsigned int pending_head;
+    unsigned int pending_count;
+};
+
+struct bench_run
+{
+    int frame_size;
+    double fps;
+    const char *framing;
+    int subscriber_count;
+
+    pid_t pid;
+    int stdin_fd;
+    int stdout_fd;
+    int inotify_fd;
+    int subscriber_fds[MAX_SUBSCRIBERS];
+
+    // 'latest' framing
+    const uint32_t *latest;
+    size_t latest_mapped_size;
+    uint32_t latest_generation;
+    int latest_polling;
+
+    int64_t start_us;
+    int64_t end_us;
+
+    struct stream_scanner scanner;
+    struct bench_sink output;
+    struct bench_sink subscriber;
+};
+
+static char work_dir[] = "/tmp/raspijpgs-bench-XXXXXX";
+
+static int64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "raspijpgs-bench [options]\n"
+            "  --server <path>        raspijpgs binary to benchmark (default ./raspijpgs-host)\n"
+            "  --duration <seconds>   How long to measure each run (default 2)\n"
+            "  --sizes <list>         Frame sizes in bytes (default 16384,65536,131072)\n"
+            "  --fps <list>           Frame rates (default 30,120)\n"
+            "  --framings <list>      Framings (default cat,mime,http,header,replace,latest)\n"
+            "  --subscribers <list>   Datagram subscriber counts (default 0,1,8)\n"
+            "\n"
+            "Lists are comma separated. One JSON object is printed per run.\n");
+    exit(EXIT_FAILURE);
+}
+
+static int constrain_subscribers(int count)
+{
+    if (count < 0)
+        return 0;
+    else if (count > MAX_SUBSCRIBERS)
+        return MAX_SUBSCRIBERS;
+    else
+        return count;
+}
+
+static char *next_item(char **list)
+{
+    return strsep(list, ",");
+}
+
+static void parse_args(struct bench_options *options, int argc, char *argv[])
+{
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (i + 1 >= argc)
+            usage();
+        char *key = argv[i];
+        char *list = argv[++i];
+        char *item;
+        if (strcmp(key, "--server") == 0) {
+            options->server = list;
+        } else if (strcmp(key, "--duration") == 0) {
+            options->duration = strtod(list, 0);
+        } else if (strcmp(key, "--sizes") == 0) {
+            options->size_count = 0;
+            while ((item = next_item(&list)) && options->size_count < MAX_LIST_ITEMS)
+                options->sizes[options->size_count++] = strtol(item, 0, 0);
+        } else if (strcmp(key, "--fps") == 0) {
+            options->fps_count = 0;
+            while ((item = next_item(&list)) && options->fps_count < MAX_LIST_ITEMS)
+                options->fps[options->fps_count++] = strtod(item, 0);
+        } else if (strcmp(key, "--framings") == 0) {
+            options->framing_count = 0;
+            while ((item = next_item(&list)) && options->framing_count < MAX_LIST_ITEMS)
+                options->framings[options->framing_count++] = item;
+        } else if (strcmp(key, "--subscribers") == 0) {
+            options->subscribers_count = 0;
+            while ((item = next_item(&list)) && options->subscribers_count < MAX_LIST_ITEMS)
+                options->subscribers[options->subscribers_count++] = constrain_subscribers(strtol(item, 0, 0));
+        } else {
+            usage();
+        }
+    }
+
+    if (options->duration <= 0 || !options->size_count || !options->fps_count ||
+            !options->framing_count || !options->subscribers_count)
+        usage();
+}
+
+static void sink_record(struct bench_sink *sink, int64_t latency_us)
+{
+    if (sink->latency_count == sink->latency_alloc) {
+        sink->latency_alloc = sink->latency_alloc ? 2 * sink->latency_alloc : 1024;
+        sink->latencies = (int64_t *) realloc(sink->latencies, sink->latency_alloc * sizeof(int64_t));
+        if (!sink->latencies)
+            err(EXIT_FAILURE, "realloc");
+    }
+    sink->latencies[sink->latency_count++] = latency_us;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int64_t sink_percentile(struct bench_sink *sink, int percent)
+{
+    if (sink->latency_count == 0)
+        return -1;
+    qsort(sink->latencies, sink->latency_count, sizeof(int64_t), compare_int64);
+    size_t ix = (sink->latency_count * percent) / 100;
+    if (ix >= sink->latency_count)
+        ix = sink->latency_count - 1;
+    return sink->latencies[ix];
+}
+
+// Parse the time from a frame marker. Returns 1 if found, 0 if the marker
+// isn't complete yet, and -1 if it's not a marker after all.
+static int parse_marker(const char *p, size_t len, int64_t *made_us)
+{
+    const char *start = p;
+    const char *end = p + len;
+    p += FRAME_MARKER_LEN;
+    while (p < end && *p >= '0' && *p <= '9')
+        p++;
+    if (end - p < 4)
+        return (size_t) (p - start) < FRAME_MARKER_MAX_LEN ? 0 : -1;
+    if (memcmp(p, " at ", 4) != 0)
+        return -1;
+    p += 4;
+
+    int64_t value = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        value = value * 10 + (*p++ - '0');
+    if (p == end)
+        return 0;
+    *made_us = value;
+    return 1;
+}
+
+static int in_window(const struct bench_run *run, int64_t made_us, int64_t now)
+{
+    return made_us >= run->start_us && now <= run->end_us;
+}
+
+static void record_frame(struct bench_run *run, struct bench_sink *sink, int64_t made_us, size_t len)
+{
+    int64_t now = monotonic_us();
+    if (!in_window(run, made_us, now))
+        return;
+    sink->frames++;
+    sink->bytes += len;
+    sink_record(sink, now - made_us);
+}
+
+static void scanner_complete_frames(struct bench_run *run)
+{
+    struct stream_scanner *s = &run->scanner;
+    while (s->pending_count) {
+        struct pending_frame *f = &s->pending[s->pending_head];
+        if (f->end > s->total)
+            break;
+        record_frame(run, &run->output, f->made_us, 0);
+        s->pending_head = (s->pending_head + 1) % PENDING_FRAMES;
+        s->pending_count--;
+    }
+}
+
+// Find frames in what the server wrote to stdout. Frame markers can be split
+// between reads, so the end of the buffer is kept around for the next time.
+static void scanner_add(struct bench_run *run, const char *data, size_t len)
+{
+    struct stream_scanner *s = &run->scanner;
+    memcpy(&s->buffer[s->len], data, len);
+    s->len += len;
+    s->total += len;
+
+    int64_t now = monotonic_us();
+    if (now >= run->start_us && now <= run->end_us)
+        run->output.bytes += len;
+
+    size_t pos = 0;
+    size_t keep_from = s->len > FRAME_MARKER_MAX_LEN ? s->len - FRAME_MARKER_MAX_LEN : 0;
+    for (;;) {
+        char *marker = (char *) memmem(&s->buffer[pos], s->len - pos, FRAME_MARKER, FRAME_MARKER_LEN);
+        if (!marker)
+            break;
+
+        size_t offset = marker - s->buffer;
+        int64_t made_us;
+        int rc = parse_marker(marker, s->len - offset, &made_us);
+        if (rc == 0) {
+            keep_from = offset;
+            break;
+        }
+        if (rc > 0 && s->pending_count < PENDING_FRAMES) {
+            struct pending_frame *f = &s->pending[(s->pending_head + s->pending_count) % PENDING_FRAMES];
+            f->end = s->base + offset - FRAME_MARKER_OFFSET + run->frame_size;
+            f->made_us = made_us;
+            s->pending_count++;
+        }
+        pos = offset + FRAME_MARKER_LEN;
+        if (keep_from < pos)
+            keep_from = pos;
+    }
+    if (keep_from > s->len)
+        keep_from = s->len;
+
+    memmove(s->buffer, &s->buffer[keep_from], s->len - keep_from);
+    s->len -= keep_from;
+    s->base += keep_from;
+
+    // Frames that are smaller than the frame size that was asked for (e.g.,
+    // the size is too small to pad) are counted when their marker shows up.
+    scanner_complete_frames(run);
+}
+
+static void service_stdout(struct bench_run *run)
+{
+    char buffer[READ_BUFFER_SIZE];
+    ssize_t amount = read(run->stdout_fd, buffer, sizeof(buffer));
+    if (amount < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            err(EXIT_FAILURE, "read from server");
+        return;
+    }
+    if (amount == 0) {
+        close(run->stdout_fd);
+        run->stdout_fd = -1;
+        return;
+    }
+    scanner_add(run, buffer, amount);
+}
+
+static void service_subscriber(struct bench_run *run, int fd)
+{
+    static char buffer[4 * 1024 * 1024];
+    ssize_t amount = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (amount <= 0)
+        return;
+
+    char *marker = (char *) memmem(buffer, amount < 256 ? amount : 256, FRAME_MARKER, FRAME_MARKER_LEN);
+    int64_t made_us;
+    if (marker && parse_marker(marker, amount - (marker - buffer), &made_us) > 0)
+        record_frame(run, &run->subscriber, made_us, amount);
+}
+
+static void service_replace(struct bench_run *run)
+{
+    char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t amount = read(run->inotify_fd, events, sizeof(events));
+    if (amount <= 0)
+        return;
+
+    // Only the rename to the output file matters. Any number of renames
+    // can be reported at once, but only the latest file can be read.
+    char path[256];
+    snprintf(path, sizeof(path), "%s/latest.jpg", work_dir);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    char buffer[256];
+    ssize_t len = read(fd, buffer, sizeof(buffer));
+    struct stat st;
+    if (len > 0 && fstat(fd, &st) == 0) {
+        char *marker = (char *) memmem(buffer, len, FRAME_MARKER, FRAME_MARKER_LEN);
+        int64_t made_us;
+        if (marker && parse_marker(marker, len - (marker - buffer), &made_us) > 0)
+            record_frame(run, &run->output, made_us, st.st_size);
+    }
+    close(fd);
+}
+
+// 'latest' framing has no notifications, so check the file like a reader
+// would. The layout is struct latest_file in raspijpgs.c.
+#define LATEST_MAGIC       0x5453544c
+#define LATEST_DATA_OFFSET 4096
+
+static void service_latest(struct bench_run *run)
+{
+    if (!run->latest) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/latest.jpg", work_dir);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > LATEST_DATA_OFFSET) {
+            void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr != MAP_FAILED) {
+                run->latest = (const uint32_t *) addr;
+                run->latest_mapped_size = st.st_size;
+            }
+        }
+        close(fd);
+        if (!run->latest)
+            return;
+    }
+
+    // Words are magic, slot_size, generation, reserved and then two slots of
+    // generation, len and a 64-bit capture time.
+    const uint32_t *header = run->latest;
+    if (header[0] != LATEST_MAGIC)
+        return;
+    uint32_t generation = __atomic_load_n(&header[2], __ATOMIC_ACQUIRE);
+    if (generation == 0 || generation == run->latest_generation)
+        return;
+
+    uint32_t slot_size = __atomic_load_n(&header[1], __ATOMIC_ACQUIRE);
+    size_t offset = LATEST_DATA_OFFSET + (generation & 1) * (size_t) slot_size;
+    if (offset + slot_size > run->latest_mapped_size) {
+        // The server grew the file
+        munmap((void *) run->latest, run->latest_mapped_size);
+        run->latest = 0;
+        return;
+    }
+
+    const uint32_t *slot = &header[4 + (generation & 1) * 4];
+    if (__atomic_load_n(&slot[0], __ATOMIC_ACQUIRE) != generation)
+        return;
+    uint32_t len = slot[1];
+    char buffer[256];
+    memcpy(buffer, (const char *) header + offset, sizeof(buffer));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot[0], __ATOMIC_RELAXED) != generation)
+        return;
+
+    run->latest_generation = generation;
+    char *marker = (char *) memmem(buffer, sizeof(buffer), FRAME_MARKER, FRAME_MARKER_LEN);
+    int64_t made_us;
+    if (marker && parse_marker(marker, sizeof(buffer) - (marker - buffer), &made_us) > 0)
+        record_frame(run, &run->output, made_us, len);
+}
+
+struct cpu_usage
+{
+    double user;
+    double sys;
+    double total; // More precise than user + sys when schedstat is available
+};
+
+static void cpu_time(pid_t pid, struct cpu_usage *usage)
+{
+    char path[64];
+    char line[1024];
+    memset(usage, 0, sizeof(*usage));
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        if (fgets(line, sizeof(line), fp)) {
+            // utime and stime are the 12th and 13th fields after the command name
+            char *p = strrchr(line, ')');
+            unsigned long utime, stime;
+            if (p && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2) {
+                long ticks = sysconf(_SC_CLK_TCK);
+                usage->user = (double) utime / ticks;
+                usage->sys = (double) stime / ticks;
+            }
+        }
+        fclose(fp);
+    }
+    usage->total = usage->user + usage->sys;
+
+    // Clock ticks are too coarse for short runs, so use the scheduler's
+    // nanosecond count of time on the CPU if possible.
+    snprintf(path, sizeof(path), "/proc/%d/schedstat", (int) pid);
+    fp = fopen(path, "r");
+    if (fp) {
+        unsigned long long ns;
+        if (fscanf(fp, "%llu", &ns) == 1)
+            usage->total = ns / 1e9;
+        fclose(fp);
+    }
+}
+
+static void start_server(const struct bench_options *options, struct bench_run *run)
+{
+    int in_pipe[2];
+    int out_pipe[2];
+    if (pipe2(in_pipe, O_CLOEXEC) < 0 || pipe2(out_pipe, O_CLOEXEC) < 0)
+        err(EXIT_FAILURE, "pipe2");
+
+    char size_str[32], fps_str[32], socket_path[256], lock_path[256], output_path[256];
+    sprintf(size_str, "%d", run->frame_size);
+    sprintf(fps_str, "%g", run->fps);
+    snprintf(socket_path, sizeof(socket_path), "%s/socket", work_dir);
+    snprintf(lock_path, sizeof(lock_path), "%s/lock", work_dir);
+    if (strcmp(run->framing, "replace") == 0 || strcmp(run->framing, "latest") == 0)
+        snprintf(output_path, sizeof(output_path), "%s/latest.jpg", work_dir);
+    else
+        strcpy(output_path, "-");
+
+    run->pid = fork();
+    if (run->pid < 0)
+        err(EXIT_FAILURE, "fork");
+    if (run->pid == 0) {
+        dup2(in_pipe[0], STDIN_FILENO);
+        dup2(out_pipe[1], STDOUT_FILENO);
+        execl(options->server, options->server,
+              "--server",
+              "--source", "synthetic",
+              "--width", "64",
+              "--synthetic_size", size_str,
+              "--fps", fps_str,
+              "--framing", run->framing,
+              "--output", output_path,
+              "--socket", socket_path,
+              "--lockfile", lock_path,
+              "--http_port", "0",
+              (char *) 0);
+        err(EXIT_FAILURE, "Can't run %s", options->server);
+    }
+
+    close(in_pipe[0]);
+    close(out_pipe[1]);
+    run->stdin_fd = in_pipe[1];
+    run->stdout_fd = out_pipe[0];
+    if (fcntl(run->stdout_fd, F_SETFL, O_NONBLOCK) < 0)
+        err(EXIT_FAILURE, "fcntl");
+
+    // The http framing waits for a request before sending anything
+    if (strcmp(run->framing, "http") == 0) {
+        const char *request = "GET /video HTTP/1.1\r\n\r\n";
+        if (write(run->stdin_fd, request, strlen(request)) < 0)
+            err(EXIT_FAILURE, "write to server");
+    }
+
+    // Wait for the server's socket to show up before subscribing
+    int64_t give_up_us = monotonic_us() + STARTUP_TIMEOUT_US;
+    struct stat st;
+    while (stat(socket_path, &st) < 0) {
+        if (monotonic_us() > give_up_us)
+            errx(EXIT_FAILURE, "%s didn't start", options->server);
+        if (waitpid(run->pid, 0, WNOHANG) == run->pid)
+            errx(EXIT_FAILURE, "%s exited on startup", options->server);
+        usleep(10000);
+    }
+}
+
+static void subscribe(struct bench_run *run, int ix, const char *message)
+{
+    struct sockaddr_un server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_UNIX;
+    snprintf(server_addr.sun_path, sizeof(server_addr.sun_path), "%s/socket", work_dir);
+
+    // Failures are ignored here since the subscriber will just show up as
+    // not getting frames.
+    sendto(run->subscriber_fds[ix], message, strlen(message), MSG_DONTWAIT,
+           (struct sockaddr *) &server_addr, sizeof(server_addr));
+}
+
+static void start_subscribers(struct bench_run *run)
+{
+    int i;
+    for (i = 0; i < run->subscriber_count; i++) {
+        int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            err(EXIT_FAILURE, "socket");
+
+        int rcvbuf = SUBSCRIBER_RCVBUF;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/sub.%d", work_dir, i);
+        unlink(addr.sun_path);
+        if (bind(fd, (const struct sockaddr *) &addr, sizeof(addr)) < 0)
+            err(EXIT_FAILURE, "Can't bind %s", addr.sun_path);
+
+        run->subscriber_fds[i] = fd;
+        subscribe(run, i, "transport=socket");
+    }
+}
+
+static void stop_subscribers(struct bench_run *run)
+{
+    int i;
+    for (i = 0; i < run->subscriber_count; i++) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/sub.%d", work_dir, i);
+        close(run->subscriber_fds[i]);
+        unlink(path);
+    }
+}
+
+// Read everything until the window ends. Returns the server's CPU time used
+// during the window.
+static void measure(struct bench_run *run, struct cpu_usage *used)
+{
+    struct pollfd fds[MAX_SUBSCRIBERS + 2];
+    int64_t next_heartbeat_us = monotonic_us() + HEARTBEAT_INTERVAL_US;
+    struct cpu_usage start;
+    int started = 0;
+
+    for (;;) {
+        int64_t now = monotonic_us();
+        if (!started && now >= run->start_us) {
+            cpu_time(run->pid, &start);
+            started = 1;
+        }
+        if (now >= run->end_us)
+            break;
+
+        if (now >= next_heartbeat_us) {
+            int i;
+            for (i = 0; i < run->subscriber_count; i++)
+                subscribe(run, i, "");
+            next_heartbeat_us = now + HEARTBEAT_INTERVAL_US;
+        }
+
+        fds[0].fd = run->stdout_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = run->inotify_fd;
+        fds[1].events = POLLIN;
+        int i;
+        for (i = 0; i < run->subscriber_count; i++) {
+            fds[i + 2].fd = run->subscriber_fds[i];
+            fds[i + 2].events = POLLIN;
+        }
+        if (poll(fds, run->subscriber_count + 2, run->latest_polling ? 1 : 10) < 0) {
+            if (errno != EINTR)
+                err(EXIT_FAILURE, "poll");
+            continue;
+        }
+        if (fds[0].revents)
+            service_stdout(run);
+        if (fds[1].revents)
+            service_replace(run);
+        if (run->latest_polling)
+            service_latest(run);
+        for (i = 0; i < run->subscriber_count; i++) {
+            if (fds[i + 2].revents)
+                service_subscriber(run, run->subscriber_fds[i]);
+        }
+    }
+
+    struct cpu_usage end;
+    cpu_time(run->pid, &end);
+    used->user = end.user - start.user;
+    used->sys = end.sys - start.sys;
+    used->total = end.total - start.total;
+}
+
+static void stop_server(struct bench_run *run)
+{
+    kill(run->pid, SIGTERM);
+
+    // Keep reading so that the server isn't stuck writing to a full pipe
+    int64_t give_up_us = monotonic_us() + SHUTDOWN_TIMEOUT_MS * 1000;
+    while (run->stdout_fd >= 0 && monotonic_us() < give_up_us) {
+        struct pollfd fd = {run->stdout_fd, POLLIN, 0};
+        if (poll(&fd, 1, 100) > 0)
+            service_stdout(run);
+    }
+    if (run->stdout_fd >= 0)
+        close(run->stdout_fd);
+    close(run->stdin_fd);
+
+    int status;
+    if (waitpid(run->pid, &status, 0) < 0)
+        err(EXIT_FAILURE, "waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        warnx("Server exited abnormally for framing=%s size=%d fps=%g subscribers=%d",
+              run->framing, run->frame_size, run->fps, run->subscriber_count);
+}
+
+static void print_sink(const char *prefix, struct bench_sink *sink, double duration)
+{
+    printf(", \"%s_frames\": %lu, \"%s_fps\": %.2f, \"%s_mb_per_s\": %.3f, \"%s_p50_us\": %lld, \"%s_p99_us\": %lld",
+           prefix, sink->frames,
+           prefix, sink->frames / duration,
+           prefix, sink->bytes / duration / 1000000.0,
+           prefix, (long long) sink_percentile(sink, 50),
+           prefix, (long long) sink_percentile(sink, 99));
+}
+
+static void run_one(const struct bench_options *options, int frame_size, double fps, const char *framing, int subscriber_count)
+{
+    struct bench_run *run = (struct bench_run *) calloc(1, sizeof(struct bench_run));
+    if (!run)
+        err(EXIT_FAILURE, "calloc");
+    run->frame_size = frame_size;
+    run->fps = fps;
+    run->framing = framing;
+    run->subscriber_count = subscriber_count;
+    run->inotify_fd = -1;
+
+    if (strcmp(framing, "replace") == 0) {
+        run->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (run->inotify_fd < 0 || inotify_add_watch(run->inotify_fd, work_dir, IN_MOVED_TO) < 0)
+            err(EXIT_FAILURE, "inotify");
+    }
+
+    run->latest_polling = strcmp(framing, "latest") == 0;
+
+    start_server(options, run);
+    start_subscribers(run);
+
+    run->start_us = monotonic_us() + WARMUP_US;
+    run->end_us = run->start_us + (int64_t) (options->duration * 1000000);
+
+    struct cpu_usage used;
+    measure(run, &used);
+    stop_server(run);
+    stop_subscribers(run);
+    if (run->inotify_fd >= 0)
+        close(run->inotify_fd);
+    if (run->latest)
+        munmap((void *) run->latest, run->latest_mapped_size);
+
+    // Datagram subscribers get frames from the server's socket only
+    printf("{\"framing\": \"%s\", \"frame_size\": %d, \"fps\": %g, \"subscribers\": %d, \"duration_s\": %.3f, \"expected_frames\": %.0f",
+           framing, frame_size, fps, subscriber_count, options->duration, fps * options->duration);
+    print_sink("out", &run->output, options->duration);
+    print_sink("sub", &run->subscriber, options->duration);
+    printf(", \"cpu_user_s\": %.3f, \"cpu_sys_s\": %.3f, \"cpu_s\": %.4f, \"cpu_percent\": %.2f}\n",
+           used.user, used.sys, used.total, 100.0 * used.total / options->duration);
+    fflush(stdout);
+
+    free(run->output.latencies);
+    free(run->subscriber.latencies);
+    free(run);
+}
+
+static void cleanup()
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/latest.jpg", work_dir);
+    unlink(path);
+    rmdir(work_dir);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_options options;
+    memset(&options, 0, sizeof(options));
+    options.server = "./raspijpgs-host";
+    options.duration = 2;
+
+    static char default_sizes[] = "16384,65536,131072";
+    static char default_fps[] = "30,120";
+    static char default_framings[] = "cat,mime,http,header,replace,latest";
+    static char default_subscribers[] = "0,1,8";
+    char *defaults[] = {"bench",
+                        "--sizes", default_sizes,
+                        "--fps", default_fps,
+                        "--framings", default_framings,
+                        "--subscribers", default_subscribers};
+    parse_args(&options, sizeof(defaults) / sizeof(defaults[0]), defaults);
+    parse_args(&options, argc, argv);
+
+    if (!mkdtemp(work_dir))
+        err(EXIT_FAILURE, "mkdtemp");
+    atexit(cleanup);
+
+    // Don't die if the server goes away while writing to it
+    signal(SIGPIPE, SIG_IGN);
+
+    int s, f, m, n;
+    for (m = 0; m < options.framing_count; m++)
+        for (s = 0; s < options.size_count; s++)
+            for (f = 0; f < options.fps_count; f++)
+                for (n = 0; n < options.subscribers_count; n++)
+                    run_one(&options, options.sizes[s], options.fps[f], options.framings[m], options.subscribers[n]);
+
+    exit(EXIT_SUCCESS);
+}
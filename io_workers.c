@@ -0,0 +1,501 @@
+/*
+Copyright (c) 2015, Frank Hunleth
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * \file io_workers.c
+ * A small pool of threads that write frames to sinks so that the main loop
+ * only has to capture and assemble them. A sink is either a datagram client
+ * or a file descriptor. Each sink belongs to one thread, so its frames are
+ * written in order.
+ *
+ * Every thread has two single producer, single consumer rings. The main
+ * thread queues jobs on one and the worker returns them on the other once
+ * they're written. Reference counts are only touched by the main thread, so
+ * frames, including ones holding encoder buffers, are given back when the
+ * main thread reaps the results.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "raspijpgs.h"
+
+#define IO_MAX_THREADS      8
+#define IO_QUEUE_SIZE       256 // Jobs in flight per thread (power of 2)
+#define IO_SINK_PENDING     8   // Most jobs a datagram sink can have waiting for room
+#define IO_RETRY_MS         2   // How often to retry sinks whose sockets were full
+
+struct io_job
+{
+    struct io_sink *sink;
+    struct jpeg_frame *frame;
+    const char *trailer;
+    size_t header_len;
+    char header[IO_HEADER_MAX];
+};
+
+struct io_done
+{
+    struct io_sink *sink;
+    struct jpeg_frame *frame;
+    enum io_result result;
+    size_t bytes;
+};
+
+struct io_sink
+{
+    int fd;
+    struct sockaddr_un addr;
+    int is_datagram;
+    struct io_worker *worker;
+
+    // Main thread only
+    int backlog;                // Most jobs in flight before dropping
+    int outstanding;            // Submitted and not reaped yet
+    io_done_fn done;            // 0 once closed
+    void *owner;
+
+    // Worker only. Datagram jobs that are waiting for room in the client's
+    // socket. The rings' slots can't be held since they're reused.
+    struct io_job pending[IO_SINK_PENDING];
+    int pending_head;
+    int pending_count;
+
+    int closed;                 // Atomic
+};
+
+struct io_worker
+{
+    pthread_t thread;
+    int eventfd;
+    int stopping;               // Atomic
+
+    // Main -> worker. head is written by the main thread and tail by the
+    // worker.
+    struct io_job jobs[IO_QUEUE_SIZE];
+    uint32_t jobs_head;
+    uint32_t jobs_tail;
+
+    // Worker -> main. There can't be more results than jobs in flight, so
+    // this never fills.
+    struct io_done results[IO_QUEUE_SIZE];
+    uint32_t results_head;
+    uint32_t results_tail;
+
+    // Worker only
+    struct io_sink *backlogged[IO_QUEUE_SIZE];
+    int backlogged_count;
+
+    // Main thread only
+    int outstanding;
+    int wake;
+    unsigned long jobs_submitted;
+    unsigned long full_drops;   // The thread had too much in flight
+    int max_depth;
+
+    unsigned long retries;      // Atomic
+};
+
+struct io_workers_state
+{
+    struct io_worker workers[IO_MAX_THREADS];
+    int count;
+    int next;                   // For spreading sinks over the threads
+};
+
+static struct io_workers_state state = {0};
+
+static void result_push(struct io_worker *w, struct io_sink *sink, struct jpeg_frame *frame,
+                        enum io_result result, size_t bytes)
+{
+    struct io_done *d = &w->results[w->results_head % IO_QUEUE_SIZE];
+    d->sink = sink;
+    d->frame = frame;
+    d->result = result;
+    d->bytes = bytes;
+    __atomic_store_n(&w->results_head, w->results_head + 1, __ATOMIC_RELEASE);
+}
+
+static int job_iov(const struct io_job *job, struct iovec *iov)
+{
+    int iovcnt = 0;
+    if (job->header_len) {
+        iov[iovcnt].iov_base = (void *) job->header;
+        iov[iovcnt++].iov_len = job->header_len;
+    }
+    iovcnt += frame_iov(job->frame, &iov[iovcnt]);
+    if (job->trailer) {
+        iov[iovcnt].iov_base = (void *) job->trailer;
+        iov[iovcnt++].iov_len = strlen(job->trailer);
+    }
+    return iovcnt;
+}
+
+// Send a job to a datagram client without blocking. Returns 0 if the
+// client's socket is full.
+static int datagram_send(const struct io_job *job, enum io_result *result, size_t *bytes)
+{
+    struct iovec iov[FRAME_MAX_SEGMENTS + 2];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *) &job->sink->addr;
+    msg.msg_namelen = sizeof(struct sockaddr_un);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = job_iov(job, iov);
+    ssize_t count = sendmsg(job->sink->fd, &msg, MSG_DONTWAIT);
+    *bytes = 0;
+    if (count >= 0) {
+        *result = io_result_sent;
+        *bytes = count;
+        return 1;
+    }
+
+    switch (errno) {
+    case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+    case EWOULDBLOCK:
+#endif
+    case EINTR:
+        return 0;
+    case ECONNREFUSED:
+    case ENOENT:
+        *result = io_result_gone;
+        return 1;
+    case EMSGSIZE:
+        *result = io_result_oversize;
+        return 1;
+    default:
+        *result = io_result_error;
+        return 1;
+    }
+}
+
+// Write a job to a file descriptor. This waits for it to be writable since
+// only this thread is held up. Closing the sink doesn't cut this short so
+// that a frame is never left half written.
+static void stream_write(const struct io_job *job, enum io_result *result, size_t *bytes)
+{
+    struct iovec iov[FRAME_MAX_SEGMENTS + 2];
+    struct iovec *next = iov;
+    int iovcnt = job_iov(job, iov);
+    *result = io_result_sent;
+    *bytes = 0;
+    while (iovcnt > 0) {
+        ssize_t count = writev(job->sink->fd, next, iovcnt);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = {job->sink->fd, POLLOUT, 0};
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            *result = io_result_error;
+            return;
+        }
+        *bytes += count;
+        while (iovcnt > 0 && (size_t) count >= next->iov_len) {
+            count -= next->iov_len;
+            next++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            next->iov_base = (char *) next->iov_base + count;
+            next->iov_len -= count;
+        }
+    }
+}
+
+static void pending_push(struct io_worker *w, struct io_sink *sink, const struct io_job *job)
+{
+    if (sink->pending_count == 0)
+        w->backlogged[w->backlogged_count++] = sink;
+    sink->pending[(sink->pending_head + sink->pending_count) % IO_SINK_PENDING] = *job;
+    sink->pending_count++;
+}
+
+// Send what the backlogged sinks have waiting. The main thread can free a
+// sink as soon as its last job is returned, so the sink is taken off the
+// list first and isn't touched after that.
+static void pending_retry(struct io_worker *w)
+{
+    int i;
+    for (i = w->backlogged_count - 1; i >= 0; i--) {
+        struct io_sink *sink = w->backlogged[i];
+        int closed = __atomic_load_n(&sink->closed, __ATOMIC_ACQUIRE);
+        while (sink->pending_count) {
+            struct io_job *job = &sink->pending[sink->pending_head];
+            enum io_result result = io_result_closed;
+            size_t bytes = 0;
+            if (!closed) {
+                __atomic_add_fetch(&w->retries, 1, __ATOMIC_RELAXED);
+                if (!datagram_send(job, &result, &bytes))
+                    break;
+            }
+            struct jpeg_frame *frame = job->frame;
+            sink->pending_head = (sink->pending_head + 1) % IO_SINK_PENDING;
+            int last = --sink->pending_count == 0;
+            if (last)
+                w->backlogged[i] = w->backlogged[--w->backlogged_count];
+            result_push(w, sink, frame, result, bytes);
+            if (last)
+                break;
+        }
+    }
+}
+
+// The sink can't be freed until this job is returned, so everything about
+// it is read before result_push(). Jobs for closed datagram sinks are given
+// back unsent, but file descriptor sinks write everything they were given.
+static void job_run(struct io_worker *w, const struct io_job *job)
+{
+    struct io_sink *sink = job->sink;
+    int is_datagram = sink->is_datagram;
+    int has_pending = sink->pending_count > 0;
+    int closed = __atomic_load_n(&sink->closed, __ATOMIC_ACQUIRE);
+    enum io_result result = io_result_closed;
+    size_t bytes = 0;
+    if (is_datagram) {
+        // Keep frames in order behind anything that's waiting
+        if (has_pending || (!closed && !datagram_send(job, &result, &bytes))) {
+            pending_push(w, sink, job);
+            return;
+        }
+    } else {
+        stream_write(job, &result, &bytes);
+    }
+    result_push(w, sink, job->frame, result, bytes);
+}
+
+static void *io_worker_thread(void *arg)
+{
+    struct io_worker *w = (struct io_worker *) arg;
+    for (;;) {
+        uint32_t head = __atomic_load_n(&w->jobs_head, __ATOMIC_ACQUIRE);
+        while (w->jobs_tail != head) {
+            job_run(w, &w->jobs[w->jobs_tail % IO_QUEUE_SIZE]);
+            __atomic_store_n(&w->jobs_tail, w->jobs_tail + 1, __ATOMIC_RELEASE);
+        }
+        pending_retry(w);
+
+        if (__atomic_load_n(&w->stopping, __ATOMIC_ACQUIRE) &&
+                w->backlogged_count == 0 &&
+                __atomic_load_n(&w->jobs_head, __ATOMIC_ACQUIRE) == w->jobs_tail)
+            break;
+
+        struct pollfd pfd = {w->eventfd, POLLIN, 0};
+        if (poll(&pfd, 1, w->backlogged_count ? IO_RETRY_MS : -1) > 0) {
+            uint64_t value;
+            if (read(w->eventfd, &value, sizeof(value)) < 0 && errno != EAGAIN && errno != EINTR)
+                err(EXIT_FAILURE, "read from I/O thread eventfd");
+        }
+    }
+    return 0;
+}
+
+void io_workers_start(int threads)
+{
+    state.count = constrain(0, threads, IO_MAX_THREADS);
+    state.next = 0;
+
+    // Leave signals to the main thread
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int i;
+    for (i = 0; i < state.count; i++) {
+        struct io_worker *w = &state.workers[i];
+        memset(w, 0, sizeof(*w));
+        w->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->eventfd < 0)
+            err(EXIT_FAILURE, "eventfd");
+        int rc = pthread_create(&w->thread, 0, io_worker_thread, w);
+        if (rc != 0)
+            errx(EXIT_FAILURE, "Can't start I/O thread: %s", strerror(rc));
+    }
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+}
+
+int io_workers_enabled()
+{
+    return state.count > 0;
+}
+
+struct io_sink *io_sink_open(int fd, const struct sockaddr_un *addr, int backlog, io_done_fn done, void *owner)
+{
+    struct io_sink *sink = (struct io_sink *) calloc(1, sizeof(struct io_sink));
+    if (!sink)
+        err(EXIT_FAILURE, "calloc");
+    sink->fd = fd;
+    if (addr) {
+        sink->addr = *addr;
+        sink->is_datagram = 1;
+        backlog = constrain(1, backlog, IO_SINK_PENDING);
+    }
+    sink->backlog = constrain(1, backlog, IO_QUEUE_SIZE);
+    sink->done = done;
+    sink->owner = owner;
+    sink->worker = &state.workers[state.next];
+    state.next = (state.next + 1) % state.count;
+    return sink;
+}
+
+int io_sink_submit(struct io_sink *sink, struct jpeg_frame *frame, const void *header, size_t header_len,
+                   const char *trailer)
+{
+    struct io_worker *w = sink->worker;
+    if (sink->outstanding >= sink->backlog)
+        return 0;
+    if (w->outstanding >= IO_QUEUE_SIZE) {
+        w->full_drops++;
+        return 0;
+    }
+
+    struct io_job *job = &w->jobs[w->jobs_head % IO_QUEUE_SIZE];
+    job->sink = sink;
+    job->frame = frame_ref(frame);
+    job->trailer = trailer;
+    job->header_len = header_len;
+    memcpy(job->header, header, header_len);
+    __atomic_store_n(&w->jobs_head, w->jobs_head + 1, __ATOMIC_RELEASE);
+
+    sink->outstanding++;
+    w->outstanding++;
+    if (w->outstanding > w->max_depth)
+        w->max_depth = w->outstanding;
+    w->jobs_submitted++;
+    w->wake = 1;
+    return 1;
+}
+
+int io_sink_backlog(const struct io_sink *sink)
+{
+    return sink->outstanding;
+}
+
+// The sink is freed once its last job has been reaped
+void io_sink_close(struct io_sink *sink)
+{
+    sink->done = 0;
+    sink->owner = 0;
+    if (sink->outstanding == 0) {
+        free(sink);
+        return;
+    }
+    __atomic_store_n(&sink->closed, 1, __ATOMIC_RELEASE);
+}
+
+// Tell the threads that got jobs since the last call. This is one eventfd
+// write per thread no matter how many sinks got the frame.
+void io_workers_wake()
+{
+    int i;
+    for (i = 0; i < state.count; i++) {
+        struct io_worker *w = &state.workers[i];
+        if (!w->wake)
+            continue;
+        w->wake = 0;
+        uint64_t one = 1;
+        if (write(w->eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            err(EXIT_FAILURE, "write to I/O thread eventfd");
+    }
+}
+
+int io_workers_reap()
+{
+    int outstanding = 0;
+    int i;
+    for (i = 0; i < state.count; i++) {
+        struct io_worker *w = &state.workers[i];
+        uint32_t head = __atomic_load_n(&w->results_head, __ATOMIC_ACQUIRE);
+        while (w->results_tail != head) {
+            struct io_done d = w->results[w->results_tail % IO_QUEUE_SIZE];
+            __atomic_store_n(&w->results_tail, w->results_tail + 1, __ATOMIC_RELEASE);
+
+            struct io_sink *sink = d.sink;
+            frame_unref(d.frame);
+            sink->outstanding--;
+            w->outstanding--;
+
+            // done() can close the sink, and that frees it if nothing else
+            // is in flight.
+            if (sink->done)
+                sink->done(sink->owner, d.result, d.bytes);
+            else if (sink->outstanding == 0)
+                free(sink);
+        }
+        outstanding += w->outstanding;
+    }
+    return outstanding;
+}
+
+// Sinks should be closed first. Datagram jobs that are still waiting are
+// given back without being sent, but jobs for file descriptors are written
+// before the threads exit.
+void io_workers_stop()
+{
+    int i;
+    for (i = 0; i < state.count; i++) {
+        struct io_worker *w = &state.workers[i];
+        __atomic_store_n(&w->stopping, 1, __ATOMIC_RELEASE);
+        w->wake = 1;
+    }
+    io_workers_wake();
+    for (i = 0; i < state.count; i++) {
+        pthread_join(state.workers[i].thread, 0);
+        close(state.workers[i].eventfd);
+    }
+    io_workers_reap();
+    state.count = 0;
+}
+
+void io_workers_print_stats(FILE *fp)
+{
+    int i;
+    for (i = 0; i < state.count; i++) {
+        const struct io_worker *w = &state.workers[i];
+        fprintf(fp, "I/O thread %d: %lu jobs, %d in flight (max %d), %lu retries, %lu dropped when full\n",
+                i,
+                w->jobs_submitted,
+                w->outstanding,
+                w->max_depth,
+                __atomic_load_n(&w->retries, __ATOMIC_RELAXED),
+                w->full_drops);
+    }
+}
@@ -0,0 +1,128 @@
+/*
+Copyright (c) 2015, Frank Hunleth
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * \file motion.c
+ * Motion detection by differencing small grayscale images. Each image is
+ * compared with the one before it in 8x8 blocks. The score is the
+ * percentage of blocks whose pixels changed by more than a threshold on
+ * average. The differencing uses NEON on the Pi and plain C elsewhere.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "raspijpgs.h"
+
+#define MOTION_BLOCK            8
+#define MOTION_BLOCKS_WIDE      (MOTION_WIDTH / MOTION_BLOCK)
+#define MOTION_BLOCKS_HIGH      (MOTION_HEIGHT / MOTION_BLOCK)
+#define MOTION_PIXEL_THRESHOLD  12 // Average change for a block to count (0-255)
+
+struct motion_state
+{
+    uint8_t previous[MOTION_WIDTH * MOTION_HEIGHT];
+    int have_previous;
+};
+
+static struct motion_state state = {{0}, 0};
+
+// Sum the absolute differences of each block in a row of blocks
+static void block_row_sad(const uint8_t *luma, int stride, const uint8_t *previous, uint32_t *sads)
+{
+#ifdef __ARM_NEON
+    // 16 pixels at a time is two blocks side by side
+    int x;
+    for (x = 0; x < MOTION_WIDTH; x += 2 * MOTION_BLOCK) {
+        uint16x8_t acc = vdupq_n_u16(0);
+        int y;
+        for (y = 0; y < MOTION_BLOCK; y++) {
+            uint8x16_t diff = vabdq_u8(vld1q_u8(&luma[y * stride + x]),
+                                       vld1q_u8(&previous[y * MOTION_WIDTH + x]));
+            acc = vpadalq_u8(acc, diff);
+        }
+
+        // Lanes 0-3 have the left block and 4-7 have the right one
+        uint64x2_t sums = vpaddlq_u32(vpaddlq_u16(acc));
+        sads[x / MOTION_BLOCK] = (uint32_t) vgetq_lane_u64(sums, 0);
+        sads[x / MOTION_BLOCK + 1] = (uint32_t) vgetq_lane_u64(sums, 1);
+    }
+#else
+    int bx;
+    for (bx = 0; bx < MOTION_BLOCKS_WIDE; bx++) {
+        uint32_t sad = 0;
+        int y;
+        for (y = 0; y < MOTION_BLOCK; y++) {
+            const uint8_t *a = &luma[y * stride + bx * MOTION_BLOCK];
+            const uint8_t *b = &previous[y * MOTION_WIDTH + bx * MOTION_BLOCK];
+            int x;
+            for (x = 0; x < MOTION_BLOCK; x++)
+                sad += abs(a[x] - b[x]);
+        }
+        sads[bx] = sad;
+    }
+#endif
+}
+
+double motion_score(const uint8_t *luma, int stride)
+{
+    int changed = 0;
+    int by;
+    for (by = 0; by < MOTION_BLOCKS_HIGH; by++) {
+        const uint8_t *rows = &luma[by * MOTION_BLOCK * stride];
+        uint8_t *previous_rows = &state.previous[by * MOTION_BLOCK * MOTION_WIDTH];
+        if (state.have_previous) {
+            uint32_t sads[MOTION_BLOCKS_WIDE];
+            block_row_sad(rows, stride, previous_rows, sads);
+
+            int bx;
+            for (bx = 0; bx < MOTION_BLOCKS_WIDE; bx++) {
+                if (sads[bx] > MOTION_PIXEL_THRESHOLD * MOTION_BLOCK * MOTION_BLOCK)
+                    changed++;
+            }
+        }
+
+        // This image is what the next one gets compared with
+        int y;
+        for (y = 0; y < MOTION_BLOCK; y++)
+            memcpy(&previous_rows[y * MOTION_WIDTH], &rows[y * stride], MOTION_WIDTH);
+    }
+
+    if (!state.have_previous) {
+        state.have_previous = 1;
+        return 0;
+    }
+    return 100.0 * changed / (MOTION_BLOCKS_WIDE * MOTION_BLOCKS_HIGH);
+}
+
+void motion_reset()
+{
+    state.have_previous = 0;
+}
@@ -36,9 +36,10 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *
  * Raspijpgs is a Unix commandline-friendly MJPEG streaming program with parts
  * copied from RaspiMJPEG, RaspiVid, and RaspiStill. It can be run as either
- * a client or server. The server connects to the Pi Camera via the MMAL
- * interface. It can either record video itself or send it to clients. All
- * interprocess communication is done via Unix Domain sockets.
+ * a client or server. The server gets frames from a frame source, normally
+ * the Pi Camera via the MMAL interface (see source_mmal.c). It can either
+ * record video itself or send it to clients. All interprocess communication
+ * is done via Unix Domain sockets.
  *
  * For usage and examples, see README.md
  */
@@ -55,67 +56,280 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <err.h>
 #include <ctype.h>
 #include <poll.h>
+#include <errno.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
+#include <netinet/in.h>
 #include <arpa/inet.h> // for ntohl
 
-#include "bcm_host.h"
-#include "interface/vcos/vcos.h"
-#include "interface/mmal/mmal.h"
-#include "interface/mmal/mmal_buffer.h"
-#include "interface/mmal/util/mmal_util.h"
-#include "interface/mmal/util/mmal_util_params.h"
-#include "interface/mmal/util/mmal_default_components.h"
-#include "interface/mmal/util/mmal_connection.h"
-#include "interface/mmal/mmal_parameters_camera.h"
-
-#define MAX_CLIENTS                 8
+#include "raspijpgs.h"
+
 #define MAX_DATA_BUFFER_SIZE        131072
+#define FRAME_POOL_MIN_SHIFT        14 // Smallest frame buffer is 16 KB
+#define FRAME_POOL_CLASSES          12 // Largest pooled frame buffer is 32 MB
+#define FRAME_POOL_MAX_FREE         8  // Free buffers kept per size class
 #define MAX_REQUEST_BUFFER_SIZE     4096
-
-#define UNUSED(expr) do { (void)(expr); } while (0)
-
-// Environment config keys
-#define RASPIJPGS_WIDTH             "RASPIJPGS_WIDTH"
-#define RASPIJPGS_HEIGHT            "RASPIJPGS_HEIGHT"
-#define RASPIJPGS_FPS		    "RASPIJPGS_FPS"
-#define RASPIJPGS_ANNOTATION        "RASPIJPGS_ANNOTATION"
-#define RASPIJPGS_ANNO_BACKGROUND   "RASPIJPGS_ANNO_BACKGROUND"
-#define RASPIJPGS_SHARPNESS         "RASPIJPGS_SHARPNESS"
-#define RASPIJPGS_CONTRAST          "RASPIJPGS_CONTRAST"
-#define RASPIJPGS_BRIGHTNESS        "RASPIJPGS_BRIGHTNESS"
-#define RASPIJPGS_SATURATION        "RASPIJPGS_SATURATION"
-#define RASPIJPGS_ISO               "RASPIJPGS_ISO"
-#define RASPIJPGS_VSTAB             "RASPIJPGS_VSTAB"
-#define RASPIJPGS_EV                "RASPIJPGS_EV"
-#define RASPIJPGS_EXPOSURE          "RASPIJPGS_EXPOSURE"
-#define RASPIJPGS_AWB               "RASPIJPGS_AWB"
-#define RASPIJPGS_IMXFX             "RASPIJPGS_IMXFX"
-#define RASPIJPGS_COLFX             "RASPIJPGS_COLFX"
-#define RASPIJPGS_SENSOR_MODE       "RASPIJPGS_SENSOR_MODE"
-#define RASPIJPGS_METERING          "RASPIJPGS_METERING"
-#define RASPIJPGS_ROTATION          "RASPIJPGS_ROTATION"
-#define RASPIJPGS_HFLIP             "RASPIJPGS_HFLIP"
-#define RASPIJPGS_VFLIP             "RASPIJPGS_VFLIP"
-#define RASPIJPGS_ROI               "RASPIJPGS_ROI"
-#define RASPIJPGS_SHUTTER           "RASPIJPGS_SHUTTER"
-#define RASPIJPGS_QUALITY           "RASPIJPGS_QUALITY"
-#define RASPIJPGS_RESTART_INTERVAL  "RASPIJPGS_RESTART_INTERVAL"
-#define RASPIJPGS_SOCKET            "RASPIJPGS_SOCKET"
-#define RASPIJPGS_OUTPUT            "RASPIJPGS_OUTPUT"
-#define RASPIJPGS_COUNT             "RASPIJPGS_COUNT"
-#define RASPIJPGS_LOCKFILE          "RASPIJPGS_LOCKFILE"
+#define MAX_HTTP_REQUEST_SIZE       1024
+#define SUBSCRIBER_QUEUE_SIZE       4  // Frames queued for a slow client before dropping
+#define OUTPUT_MAX_IOV              64 // Queued frames written per writev
+#define CONFIG_HASH_SIZE            256 // Power of 2 and more than twice the number of options
+#define SERVER_TIMEOUT_US           2000000
+#define HEARTBEAT_INTERVAL_US       1000000 // How often clients renew their lease
+#define LATENCY_SUB_BUCKETS         4  // Latency histogram buckets per power of 2
+#define LATENCY_BUCKETS             160 // Enough for 2^40 us
+#define FPS_INTERVAL_US             1000000 // How often the current frame rate is updated
+
+// Flags in the packet framing header
+#define PACKET_FLAG_KEYFRAME        1  // Decoding can start here
+#define PACKET_FLAG_CONFIG          2  // Includes the H.264 SPS and PPS
+
+// H.264 NAL unit types
+#define H264_NAL_SLICE              1
+#define H264_NAL_IDR_SLICE          5
+#define H264_NAL_SPS                7
+#define H264_NAL_PPS                8
 
 // Globals
 
-enum config_context {
-    config_context_parse_cmdline,
-    config_context_file,
-    config_context_server_start,
-    config_context_client_request
+struct frame_pool
+{
+    struct jpeg_frame *free_list[FRAME_POOL_CLASSES];
+    int free_count[FRAME_POOL_CLASSES];
+
+    // Statistics
+    unsigned long gets;
+    unsigned long hits;
+    unsigned long allocations;
+    size_t bytes;           // Allocated, whether in use or free
+    size_t peak_bytes;
+};
+
+// Where each frame spends its time. Each stage has a histogram of how long
+// frames took in microseconds. Buckets are logarithmic so that recording a
+// value is cheap enough to always do it.
+enum latency_stage {
+    latency_stage_sensor,   // Capture to out of the encoder
+    latency_stage_handoff,  // Out of the encoder to the main loop
+    latency_stage_assembly, // Main loop to a whole JPEG
+    latency_stage_fanout,   // Whole JPEG to sent to clients
+    latency_stage_output,   // Writing to --output
+    latency_stage_total,    // Capture to done
+    latency_stage_count
+};
+
+struct latency_histogram
+{
+    uint32_t buckets[LATENCY_BUCKETS];
+    unsigned long count;
+    uint64_t sum_us;
+    int64_t max_us;
+};
+
+// What happened to the frames. Drops are counted per frame and sink, so a
+// frame that two slow clients miss counts twice.
+struct server_stats
+{
+    unsigned long dropped_oversize;     // Too big for a datagram or the frame ring
+    unsigned long dropped_slow_client;  // Pushed out of a full subscriber queue
+    unsigned long dropped_pipe_full;    // Not completely written to --output
+    unsigned long dropped_error;        // Sending to a subscriber failed
+    unsigned long http_skipped;         // Browser was still busy with the last one
+
+    unsigned long long bytes_socket;
+    unsigned long long bytes_shm;
+    unsigned long long bytes_http;
+    unsigned long long bytes_output;
+
+    // Gaps in frames from changing the source's size or frame rate
+    unsigned long reconfigurations;
+    int64_t reconfig_last_gap_us;
+    int64_t reconfig_max_gap_us;
+};
+
+enum http_client_mode {
+    http_client_reading_request,
+    http_client_responding,          // Sending one response and then closing
+    http_client_waiting_for_snapshot,
+    http_client_streaming
+};
+
+// Local clients can receive frames through a ring in shared memory rather
+// than one datagram per frame. The server is the only writer. Frames are
+// written contiguously into data[] at increasing byte positions (modulo
+// data_size) and described by a slot indexed by sequence number. Positions
+// and sequence numbers are free running 32-bit counters, so compare them
+// by subtracting.
+#define FRAME_RING_MAGIC            0x4752504a // "JPRG"
+#define FRAME_RING_SLOTS            64
+
+struct frame_ring_slot
+{
+    uint32_t seq;   // 0 while the slot is being updated
+    uint32_t pos;
+    uint32_t len;
+    int64_t pts_us; // When the frame was captured
+};
+
+struct frame_ring
+{
+    uint32_t magic;
+    uint32_t data_size;     // power of 2
+    uint32_t head_seq;      // Sequence number of the newest frame (0 = none)
+    uint32_t reclaim_pos;   // Data before this position may be overwritten
+    struct frame_ring_slot slots[FRAME_RING_SLOTS];
+    char data[];
+};
+
+// Typed copy of an option's value. Entries are indexed by the option's
+// position in opts[].
+struct config_entry
+{
+    char *str;
+    int64_t i;
+    double d;
+    int changed;    // A client request changed the value
+    int sent;       // A client request set the value
+};
+
+// Frames with their framing that are waiting for --output to be writable
+struct output_chunk
+{
+    char *data;
+    size_t len;
+};
+
+// 'latest' framing keeps the newest frame in a memory-mapped file (ideally on
+// tmpfs) rather than replacing a file for every frame. There are two slots so
+// that a frame can be written while readers copy the previous one. To read,
+// load generation, copy the frame from slots[generation & 1] and then check
+// that the slot's generation still matches. Slots are at
+// LATEST_DATA_OFFSET + index * slot_size. When slot_size grows, the file is
+// made bigger, so remap if it's past what you mapped.
+#define LATEST_MAGIC                0x5453544c // "LTST"
+#define LATEST_DATA_OFFSET          4096
+#define LATEST_INITIAL_SLOT_SIZE    (256 * 1024)
+
+struct latest_slot
+{
+    uint32_t generation;    // 0 while the slot is being written
+    uint32_t len;
+    int64_t pts_us;         // When the frame was captured
+};
+
+struct latest_file
+{
+    uint32_t magic;
+    uint32_t slot_size;
+    uint32_t generation;    // Generation of the newest frame (0 = none)
+    uint32_t reserved;
+    struct latest_slot slots[2];
+};
+
+// Spaces frames out to a maximum rate by when they were captured rather than
+// by counting, so that the rate holds when the source's rate changes.
+struct frame_pacer
+{
+    int64_t interval_us;    // 0 = every frame
+    int64_t next_us;
+};
+
+// Everything that the server keeps per stream. Each stream has its own frame
+// ring since clients map the whole ring.
+struct stream
+{
+    struct stream_config config;
+    struct frame_pacer pacer; // For the stream's fps cap
+    struct frame_pacer idle_pacer; // For --motion_idle_fps
+
+    // Shared memory frame ring
+    int ring_fd;
+    struct frame_ring *ring;
+    size_t ring_mapped_size;
+    uint32_t ring_write_pos;
+
+    struct jpeg_frame *latest_frame; // For HTTP snapshots
+
+    // Statistics
+    unsigned long frames;
+    unsigned long long bytes;
+    unsigned long skipped;  // Dropped to stay under the fps cap
+    double current_fps;
+    int64_t fps_interval_start_us;
+    unsigned long fps_interval_frames;
+};
+
+// Clients that have contacted the server. They're kept in an array for
+// iterating and in a hash table keyed by socket path for lookups. A client
+// stays subscribed as long as it sends something (even an empty packet)
+// before its lease runs out.
+struct subscriber
+{
+    struct sockaddr_un addr;
+    int stream;
+    int ring_eventfd;        // Signalled on new frames if using the ring; otherwise -1
+    int index;               // Index in state.subscribers
+    struct subscriber *hash_next;
+    int64_t lease_expires_us;
+
+    // Frames waiting for the client's socket to have room. When full, the
+    // oldest frame is dropped to make room for the newest.
+    struct jpeg_frame *queue[SUBSCRIBER_QUEUE_SIZE];
+    int queue_head;
+    int queue_count;
+    struct io_sink *sink;     // Used instead of the queue with --io_threads
+
+    struct frame_pacer pacer; // For the client's max_fps
+    int motion_events;        // Send the client motion scores
+
+    unsigned long frames_sent;
+    unsigned long frames_dropped;
+    unsigned long frames_skipped;  // Over max_fps
+};
+
+// Motion detection from the images that the source passes to deliver_luma()
+struct motion_tracker
+{
+    double threshold;       // Percent of the image (0 = off)
+    int64_t hold_us;        // Motion lasts this long after the last change
+    int gate;               // Only distribute frames while there's motion
+    double idle_fps;
+
+    int active;
+    int64_t last_motion_us;
+    double score;
+
+    // Statistics
+    unsigned long images;
+    unsigned long events;
+    unsigned long gated;
+};
+
+struct http_client
+{
+    int fd; // -1 once closed. Closed clients are reaped by the server loop.
+    enum http_client_mode mode;
+    int stream;
+
+    char request[MAX_HTTP_REQUEST_SIZE];
+    int request_ix;
+
+    // Pending output is sent as header, then frame, then trailer. Partial
+    // sends pick up where they left off when the socket is writable again.
+    char *out_header;
+    size_t out_header_len;
+    struct jpeg_frame *out_frame;
+    const char *out_trailer;
+    size_t out_trailer_len;
+    size_t out_sent;
 };
 
 struct raspijpgs_state
@@ -126,6 +340,14 @@ struct raspijpgs_state
     char *sendlist;
     int count;
 
+    // Option values and lookup tables
+    struct config_entry *config;
+    struct config_entry *camera_config[MAX_CAMERAS]; // Cameras 1 and up (str = 0 if not set)
+    int config_camera;  // Camera whose settings config_*() returns
+    int config_ready;   // Sets after startup go to config rather than the environment
+    uint8_t config_by_name[CONFIG_HASH_SIZE]; // opts[] index + 1 by long_option
+    uint8_t config_by_key[CONFIG_HASH_SIZE];  // opts[] index + 1 by env_key
+
     // Commandline options to only run in client or server mode
     int user_wants_server;
     int user_wants_client;
@@ -136,57 +358,106 @@ struct raspijpgs_state
     // Communication
     int socket_fd;
     char *socket_buffer;
-    int socket_buffer_ix;
+    size_t socket_buffer_size;
     char *stdin_buffer;
     int stdin_buffer_ix;
 
     struct sockaddr_un server_addr;
-    struct sockaddr_un client_addrs[MAX_CLIENTS];
+    struct sockaddr_un client_addr;
+    struct subscriber **subscribers;
+    int subscriber_count;
+    int subscriber_alloc;
+    struct subscriber **subscriber_buckets;
+    unsigned int subscriber_bucket_count; // Power of 2
+    int subscribers_backlogged;           // Number with frames queued
+    int64_t lease_us;
+    int64_t next_lease_check_us;
+    struct subscriber *requesting_subscriber;
+    char *transport;
+
+    // Streams
+    struct stream streams[MAX_STREAMS];
+    int stream_count;
+    int camera_main_stream[MAX_CAMERAS];   // Sized by each camera's --width and --height
+    int camera_count;
+    char *stream_name;  // The stream that we want
+    double max_fps;     // The most frames per second that we want (0 = all)
+    int output_stream;  // The stream that goes to --output on the server
+    int record_stream;  // The stream that goes to --record (-1 = none)
+    int motion_events;  // Client wants motion scores
+    struct motion_tracker motion;
+
+    // Client's view of the shared memory frame ring
+    struct frame_ring *ring;
+    size_t ring_mapped_size;
+    uint32_t ring_next_seq;
+    int ring_eventfd;
+    int64_t last_frame_us;
 
     // Output
     int no_output;
     int output_fd;
     char *output_filename;
     char *output_tmp_filename;
+    struct latest_file *latest;     // For 'latest' framing
+    int output_fd_flags;            // To restore when done
+    struct output_chunk *output_queue;
+    int output_queue_size;
+    int output_queue_head;
+    int output_queue_count;
+    size_t output_queue_offset;     // Bytes of the head chunk already written
+    int output_queue_started;       // Part of the head's frame has been written
+    int output_queue_peak;
+    struct io_sink *output_sink;    // With --io_threads
+    size_t latest_mapped_size;
     char *framing;
     int http_ready_for_images;
 
-    // MMAL resources
-    MMAL_COMPONENT_T *camera;
-    MMAL_COMPONENT_T *jpegencoder;
-    MMAL_COMPONENT_T *resizer;
-    MMAL_CONNECTION_T *con_cam_res;
-    MMAL_CONNECTION_T *con_res_jpeg;
-    MMAL_POOL_T *pool_jpegencoder;
-
-    // MMAL callback -> main loop
-    int mmal_callback_pipe[2];
+    // Built-in HTTP server
+    int http_listen_fd;
+    struct http_client **http_clients;
+    int http_client_count;
+    int http_client_alloc;
+
+    // Frame source
+    const struct frame_source *source;
+    int source_fd;
+    int64_t last_source_us;
+    int64_t last_delivery_us;       // Arrival of the source's last frame
+    int64_t reconfig_started_us;    // Waiting for a frame captured after this (0 = not)
+    int64_t reconfig_gap_start_us;
+
+    // Frames
+    struct frame_pool frame_pool;
+    struct latency_histogram latency[latency_stage_count];
+    struct server_stats stats;
+    volatile sig_atomic_t stats_requested;
+    int stats_pending; // Client is waiting for a stats reply
 };
 
 static struct raspijpgs_state state = {0};
 
-struct raspi_config_opt
-{
-    const char *long_option;
-    const char *short_option;
-    const char *env_key;
-    const char *help;
-
-    const char *default_value;
+static struct raspi_config_opt opts[];
 
-    // Record the value (called as options are set)
-    // Set replace=0 to only set the value if it hasn't been set already.
-    void (*set)(const struct raspi_config_opt *, const char *value, enum config_context context);
+static const struct frame_source *sources[] = {
+#ifndef RASPIJPGS_NO_MMAL
+    &mmal_source,
+#endif
+    &synthetic_source,
+    &replay_source,
+    0
+};
 
-    // Apply the option (called on every option)
-    void (*apply)(const struct raspi_config_opt *, enum config_context context);
+static const char *latency_stage_names[latency_stage_count] = {
+    "sensor", "handoff", "assembly", "fanout", "output", "total"
 };
-static struct raspi_config_opt opts[];
 
 static const char *http_ok_response = "HTTP/1.1 200 OK\r\n" \
                                       "Server: raspijpgs\r\n";
 static const char *http_500_response = "HTTP/1.1 500 Internal Server Error\r\n";
 static const char *http_404_response = "HTTP/1.1 404 Not Found\r\n";
+static const char *http_close_response = "Connection: close\r\n" \
+                                         "\r\n";
 static const char *http_index_html_response = "Content-Type: text/html; charset=UTF-8\r\n" \
                                               "Connection: close\r\n" \
                                               "\r\n" \
@@ -204,11 +475,34 @@ static const char *mime_header = "MIME-Version: 1.0\r\n" \
 static const char *mime_boundary = "\r\n--jpegboundary\r\n";
 static const char *mime_multipart_header_format = "Content-Type: image/jpeg\r\n" \
                                                   "Content-Length: %d\r\n\r\n";
+static const char *http_snapshot_header_format = "Content-Type: image/jpeg\r\n" \
+                                                 "Content-Length: %d\r\n" \
+                                                 "Cache-Control: no-cache\r\n" \
+                                                 "Connection: close\r\n" \
+                                                 "\r\n";
 
-static void default_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
+static void config_update(const struct raspi_config_opt *opt, int camera, const char *value);
+static const struct raspi_config_opt *find_camera_opt(const char *name, int *camera);
+
+// RASPIJPGS_CONTRAST -> RASPIJPGS_CAMERA1_CONTRAST
+static void camera_env_key(char *key, size_t size, int camera, const char *env_key)
+{
+    snprintf(key, size, "RASPIJPGS_CAMERA%d_%s", camera, env_key + strlen("RASPIJPGS_"));
+}
+
+static void setting_set(const struct raspi_config_opt *opt, int camera, const char *value, enum config_context context)
 {
-    if (!opt->env_key)
+    if (state.config_ready) {
+        config_update(opt, camera, value);
         return;
+    }
+
+    char camera_key[64];
+    const char *env_key = opt->env_key;
+    if (camera) {
+        camera_env_key(camera_key, sizeof(camera_key), camera, opt->env_key);
+        env_key = camera_key;
+    }
 
     // setenv's 3rd parameter is whether to replace a value if it already
     // exists. Sets are done in the order of Environment, commandline, file.
@@ -217,14 +511,20 @@ static void default_set(const struct raspi_config_opt *opt, const char *value, e
     int replace = (context != config_context_file);
 
     if (value) {
-        if (setenv(opt->env_key, value, replace) < 0)
-            err(EXIT_FAILURE, "Error setting %s to %s", opt->env_key, opt->default_value);
+        if (setenv(env_key, value, replace) < 0)
+            err(EXIT_FAILURE, "Error setting %s to %s", env_key, opt->default_value);
     } else {
-        if (replace && (unsetenv(opt->env_key) < 0))
-            err(EXIT_FAILURE, "Error unsetting %s", opt->env_key);
+        if (replace && (unsetenv(env_key) < 0))
+            err(EXIT_FAILURE, "Error unsetting %s", env_key);
     }
 }
 
+static void default_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
+{
+    if (opt->env_key)
+        setting_set(opt, 0, value, context);
+}
+
 static void setstring(char **left, const char *right)
 {
     if (*left)
@@ -232,7 +532,7 @@ static void setstring(char **left, const char *right)
     *left = strdup(right);
 }
 
-static int constrain(int minimum, int value, int maximum)
+int constrain(int minimum, int value, int maximum)
 {
     if (value < minimum)
         return minimum;
@@ -242,6 +542,35 @@ static int constrain(int minimum, int value, int maximum)
         return value;
 }
 
+int64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void pacer_init(struct frame_pacer *pacer, double fps)
+{
+    pacer->interval_us = fps > 0 ? (int64_t) (1000000.0 / fps) : 0;
+    pacer->next_us = 0;
+}
+
+// Returns 0 if a frame captured at this time would go over the rate. A
+// quarter interval of slack absorbs jitter in the source's timing.
+static int pacer_due(struct frame_pacer *pacer, int64_t capture_us)
+{
+    if (!pacer->interval_us)
+        return 1;
+    if (capture_us < pacer->next_us - pacer->interval_us / 4)
+        return 0;
+
+    // Don't try to catch up after a gap
+    pacer->next_us += pacer->interval_us;
+    if (pacer->next_us < capture_us)
+        pacer->next_us = capture_us + pacer->interval_us;
+    return 1;
+}
+
 static void config_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
 {
     UNUSED(opt); UNUSED(context);
@@ -252,6 +581,7 @@ static void framing_set(const struct raspi_config_opt *opt, const char *value, e
     UNUSED(opt); UNUSED(context);
     setstring(&state.framing, value);
 }
+static void stats_set(const struct raspi_config_opt *opt, const char *value, enum config_context context);
 static void send_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
 {
     UNUSED(opt);
@@ -264,15 +594,16 @@ static void send_set(const struct raspi_config_opt *opt, const char *value, enum
     // Send lists are intended to look like config files for ease of parsing
     const char *equals = strchr(value, '=');
     char *key = equals ? strndup(value, equals - value) : strdup(value);
-    const struct raspi_config_opt *o;
-    for (o = opts; o->long_option; o++) {
-        if (strcmp(key, o->long_option) == 0)
-            break;
-    }
-    if (!o->long_option)
+    int camera;
+    const struct raspi_config_opt *o = find_camera_opt(key, &camera);
+    if (!o)
         errx(EXIT_FAILURE, "Unexpected key '%s' used in --send. Check help", key);
     free(key);
 
+    // Wait around for the answer
+    if (o->set == stats_set)
+        state.stats_pending = 1;
+
     if (state.sendlist) {
         char *old_sendlist = state.sendlist;
         if (asprintf(&state.sendlist, "%s\n%s", old_sendlist, value) < 0)
@@ -281,310 +612,243 @@ static void send_set(const struct raspi_config_opt *opt, const char *value, enum
     } else
         state.sendlist = strdup(value);
 }
-static void quit_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
-{
-    UNUSED(opt); UNUSED(value); UNUSED(context);
-    state.count = 0;
-}
-static void server_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
-{
-    UNUSED(opt); UNUSED(value); UNUSED(context);
-    state.user_wants_server = 1;
-}
-static void client_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
+static void ring_attach_subscriber(struct subscriber *sub);
+static void transport_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
 {
-    UNUSED(opt); UNUSED(value); UNUSED(context);
-    state.user_wants_client = 1;
-}
-
-static void help(const struct raspi_config_opt *opt, const char *value, enum config_context context);
+    UNUSED(opt);
 
-static void width_apply(const struct raspi_config_opt *opt, enum config_context context) { UNUSED(opt); }
-static void height_apply(const struct raspi_config_opt *opt, enum config_context context) { UNUSED(opt); }
-static void annotation_apply(const struct raspi_config_opt *opt, enum config_context context) { UNUSED(opt); }
-static void anno_background_apply(const struct raspi_config_opt *opt, enum config_context context) { UNUSED(opt); }
-static void rational_param_apply(int mmal_param, const struct raspi_config_opt *opt, enum config_context context)
-{
-    unsigned int value = strtoul(getenv(opt->env_key), 0, 0);
-    if (value > 100) {
-        if (context == config_context_server_start)
-            errx(EXIT_FAILURE, "%s must be between 0 and 100", opt->long_option);
-        else
+    if (strcmp(value, "socket") != 0 && strcmp(value, "shm") != 0) {
+        if (context == config_context_client_request)
             return;
+        errx(EXIT_FAILURE, "Unknown transport '%s'. Use socket or shm", value);
     }
-    MMAL_RATIONAL_T mmal_value = {value, 100};
-    MMAL_STATUS_T status = mmal_port_parameter_set_rational(state.camera->control, mmal_param, mmal_value);
-    if(status != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
-}
-
-static void sharpness_apply(const struct raspi_config_opt *opt, enum config_context context)
-{
-    rational_param_apply(MMAL_PARAMETER_SHARPNESS, opt, context);
-}
-static void contrast_apply(const struct raspi_config_opt *opt, enum config_context context)
-{
-    rational_param_apply(MMAL_PARAMETER_CONTRAST, opt, context);
-}
-static void brightness_apply(const struct raspi_config_opt *opt, enum config_context context)
-{
-    rational_param_apply(MMAL_PARAMETER_BRIGHTNESS, opt, context);
-}
-static void saturation_apply(const struct raspi_config_opt *opt, enum config_context context)
-{
-    rational_param_apply(MMAL_PARAMETER_SATURATION, opt, context);
-}
 
-static void ISO_apply(const struct raspi_config_opt *opt, enum config_context context)
-{
-    UNUSED(context);
-    unsigned int value = strtoul(getenv(opt->env_key), 0, 0);
-    MMAL_STATUS_T status = mmal_port_parameter_set_uint32(state.camera->control, MMAL_PARAMETER_ISO, value);
-    if(status != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+    // When a client asks for shm, hand it the frame ring if we have one.
+    if (context == config_context_client_request) {
+        if (state.requesting_subscriber && strcmp(value, "shm") == 0)
+            ring_attach_subscriber(state.requesting_subscriber);
+        return;
+    }
+    setstring(&state.transport, value);
 }
-static void vstab_apply(const struct raspi_config_opt *opt, enum config_context context)
+static void max_fps_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
 {
-    UNUSED(context);
-    unsigned int value = (strcmp(getenv(opt->env_key), "on") == 0);
-    MMAL_STATUS_T status = mmal_port_parameter_set_uint32(state.camera->control, MMAL_PARAMETER_VIDEO_STABILISATION, value);
-    if(status != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+    UNUSED(opt);
+    double fps = strtod(value, 0);
+    if (context == config_context_client_request) {
+        if (state.requesting_subscriber)
+            pacer_init(&state.requesting_subscriber->pacer, fps);
+        return;
+    }
+    state.max_fps = fps;
 }
-static void ev_apply(const struct raspi_config_opt *opt, enum config_context context)
+static int find_stream(const char *name);
+static void stream_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
 {
-    // TODO
     UNUSED(opt);
-    UNUSED(context);
-}
-static void exposure_apply(const struct raspi_config_opt *opt, enum config_context context)
-{
-    MMAL_PARAM_EXPOSUREMODE_T mode;
-    const char *str = getenv(opt->env_key);
-    if(strcmp(str, "off") == 0) mode = MMAL_PARAM_EXPOSUREMODE_OFF;
-    else if(strcmp(str, "auto") == 0) mode = MMAL_PARAM_EXPOSUREMODE_AUTO;
-    else if(strcmp(str, "night") == 0) mode = MMAL_PARAM_EXPOSUREMODE_NIGHT;
-    else if(strcmp(str, "nightpreview") == 0) mode = MMAL_PARAM_EXPOSUREMODE_NIGHTPREVIEW;
-    else if(strcmp(str, "backlight") == 0) mode = MMAL_PARAM_EXPOSUREMODE_BACKLIGHT;
-    else if(strcmp(str, "spotlight") == 0) mode = MMAL_PARAM_EXPOSUREMODE_SPOTLIGHT;
-    else if(strcmp(str, "sports") == 0) mode = MMAL_PARAM_EXPOSUREMODE_SPORTS;
-    else if(strcmp(str, "snow") == 0) mode = MMAL_PARAM_EXPOSUREMODE_SNOW;
-    else if(strcmp(str, "beach") == 0) mode = MMAL_PARAM_EXPOSUREMODE_BEACH;
-    else if(strcmp(str, "verylong") == 0) mode = MMAL_PARAM_EXPOSUREMODE_VERYLONG;
-    else if(strcmp(str, "fixedfps") == 0) mode = MMAL_PARAM_EXPOSUREMODE_FIXEDFPS;
-    else if(strcmp(str, "antishake") == 0) mode = MMAL_PARAM_EXPOSUREMODE_ANTISHAKE;
-    else if(strcmp(str, "fireworks") == 0) mode = MMAL_PARAM_EXPOSUREMODE_FIREWORKS;
-    else {
-        if (context == config_context_server_start)
-            errx(EXIT_FAILURE, "Invalid %s", opt->long_option);
-        else
-            return;
-    }
 
-    MMAL_PARAMETER_EXPOSUREMODE_T param = {{MMAL_PARAMETER_EXPOSURE_MODE,sizeof(param)}, mode};
-    if (mmal_port_parameter_set(state.camera->control, &param.hdr) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
-}
-static void awb_apply(const struct raspi_config_opt *opt, enum config_context context)
-{
-    MMAL_PARAM_AWBMODE_T awb_mode;
-    const char *str = getenv(opt->env_key);
-    if(strcmp(str, "off") == 0) awb_mode = MMAL_PARAM_AWBMODE_OFF;
-    else if(strcmp(str, "auto") == 0) awb_mode = MMAL_PARAM_AWBMODE_AUTO;
-    else if(strcmp(str, "sun") == 0) awb_mode = MMAL_PARAM_AWBMODE_SUNLIGHT;
-    else if(strcmp(str, "cloudy") == 0) awb_mode = MMAL_PARAM_AWBMODE_CLOUDY;
-    else if(strcmp(str, "shade") == 0) awb_mode = MMAL_PARAM_AWBMODE_SHADE;
-    else if(strcmp(str, "tungsten") == 0) awb_mode = MMAL_PARAM_AWBMODE_TUNGSTEN;
-    else if(strcmp(str, "fluorescent") == 0) awb_mode = MMAL_PARAM_AWBMODE_FLUORESCENT;
-    else if(strcmp(str, "incandescent") == 0) awb_mode = MMAL_PARAM_AWBMODE_INCANDESCENT;
-    else if(strcmp(str, "flash") == 0) awb_mode = MMAL_PARAM_AWBMODE_FLASH;
-    else if(strcmp(str, "horizon") == 0) awb_mode = MMAL_PARAM_AWBMODE_HORIZON;
-    else {
-        if (context == config_context_server_start)
-            errx(EXIT_FAILURE, "Invalid %s", opt->long_option);
-        else
-            return;
-    }
-    MMAL_PARAMETER_AWBMODE_T param = {{MMAL_PARAMETER_AWB_MODE,sizeof(param)}, awb_mode};
-    if (mmal_port_parameter_set(state.camera->control, &param.hdr) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
-}
-static void imxfx_apply(const struct raspi_config_opt *opt, enum config_context context)
-{
-    MMAL_PARAM_IMAGEFX_T imageFX;
-    const char *str = getenv(opt->env_key);
-    if(strcmp(str, "none") == 0) imageFX = MMAL_PARAM_IMAGEFX_NONE;
-    else if(strcmp(str, "negative") == 0) imageFX = MMAL_PARAM_IMAGEFX_NEGATIVE;
-    else if(strcmp(str, "solarise") == 0) imageFX = MMAL_PARAM_IMAGEFX_SOLARIZE;
-    else if(strcmp(str, "solarize") == 0) imageFX = MMAL_PARAM_IMAGEFX_SOLARIZE;
-    else if(strcmp(str, "sketch") == 0) imageFX = MMAL_PARAM_IMAGEFX_SKETCH;
-    else if(strcmp(str, "denoise") == 0) imageFX = MMAL_PARAM_IMAGEFX_DENOISE;
-    else if(strcmp(str, "emboss") == 0) imageFX = MMAL_PARAM_IMAGEFX_EMBOSS;
-    else if(strcmp(str, "oilpaint") == 0) imageFX = MMAL_PARAM_IMAGEFX_OILPAINT;
-    else if(strcmp(str, "hatch") == 0) imageFX = MMAL_PARAM_IMAGEFX_HATCH;
-    else if(strcmp(str, "gpen") == 0) imageFX = MMAL_PARAM_IMAGEFX_GPEN;
-    else if(strcmp(str, "pastel") == 0) imageFX = MMAL_PARAM_IMAGEFX_PASTEL;
-    else if(strcmp(str, "watercolour") == 0) imageFX = MMAL_PARAM_IMAGEFX_WATERCOLOUR;
-    else if(strcmp(str, "watercolor") == 0) imageFX = MMAL_PARAM_IMAGEFX_WATERCOLOUR;
-    else if(strcmp(str, "film") == 0) imageFX = MMAL_PARAM_IMAGEFX_FILM;
-    else if(strcmp(str, "blur") == 0) imageFX = MMAL_PARAM_IMAGEFX_BLUR;
-    else if(strcmp(str, "saturation") == 0) imageFX = MMAL_PARAM_IMAGEFX_SATURATION;
-    else if(strcmp(str, "colourswap") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURSWAP;
-    else if(strcmp(str, "colorswap") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURSWAP;
-    else if(strcmp(str, "washedout") == 0) imageFX = MMAL_PARAM_IMAGEFX_WASHEDOUT;
-    else if(strcmp(str, "posterise") == 0) imageFX = MMAL_PARAM_IMAGEFX_POSTERISE;
-    else if(strcmp(str, "posterize") == 0) imageFX = MMAL_PARAM_IMAGEFX_POSTERISE;
-    else if(strcmp(str, "colourpoint") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURPOINT;
-    else if(strcmp(str, "colorpoint") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURPOINT;
-    else if(strcmp(str, "colourbalance") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURBALANCE;
-    else if(strcmp(str, "colorbalance") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURBALANCE;
-    else if(strcmp(str, "cartoon") == 0) imageFX = MMAL_PARAM_IMAGEFX_CARTOON;
-    else {
-        if (context == config_context_server_start)
-            errx(EXIT_FAILURE, "Invalid %s", opt->long_option);
-        else
+    if (context == config_context_client_request) {
+        int stream = find_stream(value);
+        if (stream < 0) {
+            warnx("Ignoring request for unknown stream '%s'", value);
             return;
-    }
-    MMAL_PARAMETER_IMAGEFX_T param = {{MMAL_PARAMETER_IMAGE_EFFECT,sizeof(param)}, imageFX};
-    if (mmal_port_parameter_set(state.camera->control, &param.hdr) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
-}
-static void colfx_apply(const struct raspi_config_opt *opt, enum config_context context)
-{
-    // Color effect is specified as u:v. Anything else means off.
-    MMAL_PARAMETER_COLOURFX_T param = {{MMAL_PARAMETER_COLOUR_EFFECT,sizeof(param)}, 0, 0, 0};
-    const char *str = getenv(opt->env_key);
-    if (sscanf(str, "%d:%d", &param.u, &param.v) == 2 &&
-            param.u < 256 &&
-            param.v < 256)
-        param.enable = 1;
-    else
-        param.enable = 0;
-    if (mmal_port_parameter_set(state.camera->control, &param.hdr) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
-}
-static void metering_apply(const struct raspi_config_opt *opt, enum config_context context)
-{
-    MMAL_PARAM_EXPOSUREMETERINGMODE_T m_mode;
-    const char *str = getenv(opt->env_key);
-    if(strcmp(str, "average") == 0) m_mode = MMAL_PARAM_EXPOSUREMETERINGMODE_AVERAGE;
-    else if(strcmp(str, "spot") == 0) m_mode = MMAL_PARAM_EXPOSUREMETERINGMODE_SPOT;
-    else if(strcmp(str, "backlit") == 0) m_mode = MMAL_PARAM_EXPOSUREMETERINGMODE_BACKLIT;
-    else if(strcmp(str, "matrix") == 0) m_mode = MMAL_PARAM_EXPOSUREMETERINGMODE_MATRIX;
-    else {
-        if (context == config_context_server_start)
-            errx(EXIT_FAILURE, "Invalid %s", opt->long_option);
-        else
+        }
+
+        // Requests on stdin change what goes to --output
+        struct subscriber *sub = state.requesting_subscriber;
+        if (!sub) {
+            state.output_stream = stream;
             return;
+        }
+
+        // Clients on a frame ring need the new stream's ring
+        if (sub->stream != stream) {
+            sub->stream = stream;
+            if (sub->ring_eventfd >= 0) {
+                close(sub->ring_eventfd);
+                sub->ring_eventfd = -1;
+                ring_attach_subscriber(sub);
+            }
+        }
+        return;
     }
-    MMAL_PARAMETER_EXPOSUREMETERINGMODE_T param = {{MMAL_PARAMETER_EXP_METERING_MODE,sizeof(param)}, m_mode};
-    if (mmal_port_parameter_set(state.camera->control, &param.hdr) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+    setstring(&state.stream_name, value);
 }
-static void rotation_apply(const struct raspi_config_opt *opt, enum config_context context)
+static void quit_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
 {
-    UNUSED(context);
-    int value = strtol(getenv(opt->env_key), NULL, 0);
-    if (mmal_port_parameter_set_int32(state.camera->output[0], MMAL_PARAMETER_ROTATION, value) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+    UNUSED(opt); UNUSED(value); UNUSED(context);
+    state.count = 0;
 }
-static void flip_apply(const struct raspi_config_opt *opt, enum config_context context)
+static void write_stats(FILE *fp);
+static void stats_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
 {
-    UNUSED(context);
+    UNUSED(opt); UNUSED(value);
+
+    if (context != config_context_client_request)
+        return;
+
+    // Reply to whoever asked. Requests on stdin get the report on stderr
+    // since stdout may have frames on it.
+    if (!state.requesting_subscriber) {
+        write_stats(stderr);
+        return;
+    }
 
-    MMAL_PARAMETER_MIRROR_T mirror = {{MMAL_PARAMETER_MIRROR, sizeof(MMAL_PARAMETER_MIRROR_T)}, MMAL_PARAM_MIRROR_NONE};
-    if (strcmp(getenv(RASPIJPGS_HFLIP), "on") == 0)
-        mirror.value = MMAL_PARAM_MIRROR_HORIZONTAL;
-    if (strcmp(getenv(RASPIJPGS_VFLIP), "on") == 0)
-        mirror.value = (mirror.value == MMAL_PARAM_MIRROR_HORIZONTAL ? MMAL_PARAM_MIRROR_BOTH : MMAL_PARAM_MIRROR_VERTICAL);
+    char *report;
+    size_t report_len;
+    FILE *fp = open_memstream(&report, &report_len);
+    if (!fp)
+        err(EXIT_FAILURE, "open_memstream");
+    fprintf(fp, "stats\n");
+    write_stats(fp);
+    fclose(fp);
 
-    if (mmal_port_parameter_set(state.camera->output[0], &mirror.hdr) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+    if (sendto(state.socket_fd, report, report_len, MSG_DONTWAIT,
+               (const struct sockaddr *) &state.requesting_subscriber->addr,
+               sizeof(struct sockaddr_un)) < 0)
+        warn("Can't send stats to %s", state.requesting_subscriber->addr.sun_path);
+    free(report);
 }
-static void sensor_mode_apply(const struct raspi_config_opt *opt, enum config_context context)
+static void trigger_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
 {
-    // TODO
-    UNUSED(opt);
-    UNUSED(context);
+    UNUSED(opt); UNUSED(value);
+
+    if (context == config_context_client_request && !recorder_trigger())
+        warnx("Ignoring trigger since event recording isn't on. Set --record and --post_event");
 }
-static void roi_apply(const struct raspi_config_opt *opt, enum config_context context)
+static void motion_events_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
 {
-    // TODO
     UNUSED(opt);
-    UNUSED(context);
+    int on = strcmp(value, "on") == 0;
+    if (context == config_context_client_request) {
+        if (state.requesting_subscriber)
+            state.requesting_subscriber->motion_events = on;
+        return;
+    }
+    state.motion_events = on;
 }
-static void shutter_apply(const struct raspi_config_opt *opt, enum config_context context)
+static void server_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
 {
-    UNUSED(context);
-    int value = strtoul(getenv(opt->env_key), NULL, 0);
-    if (mmal_port_parameter_set_uint32(state.camera->control, MMAL_PARAMETER_SHUTTER_SPEED, value) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+    UNUSED(opt); UNUSED(value); UNUSED(context);
+    state.user_wants_server = 1;
 }
-static void quality_apply(const struct raspi_config_opt *opt, enum config_context context)
+static void client_set(const struct raspi_config_opt *opt, const char *value, enum config_context context)
 {
-    UNUSED(context);
-    int value = strtoul(getenv(opt->env_key), NULL, 0);
-    value = constrain(0, value, 100);
-    if (mmal_port_parameter_set_uint32(state.jpegencoder->output[0], MMAL_PARAMETER_JPEG_Q_FACTOR, value) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set %s to %d", opt->long_option, value);
+    UNUSED(opt); UNUSED(value); UNUSED(context);
+    state.user_wants_client = 1;
 }
-static void restart_interval_apply(const struct raspi_config_opt *opt, enum config_context context)
+
+static void help(const struct raspi_config_opt *opt, const char *value, enum config_context context);
+
+// Options that change the picture are up to the frame source
+static void source_apply(const struct raspi_config_opt *opt, enum config_context context)
 {
-    // TODO
-    UNUSED(opt);
-    UNUSED(context);
+    if (state.source && state.source->apply)
+        state.source->apply(opt, context);
 }
-static void fps_apply(const struct raspi_config_opt *opt, enum config_context context)
+static void main_stream_apply(const struct raspi_config_opt *opt, enum config_context context)
 {
-    // TODO
-    UNUSED(opt);
-    UNUSED(context);
+    // Sources get the main stream's size and quality from its config like
+    // the others. Other cameras' main streams keep what --streams says
+    // unless they're given their own.
+    int camera = state.config_camera;
+    if (camera && !state.camera_config[camera][opt - opts].str)
+        return;
+
+    struct stream_config *config = &state.streams[state.camera_main_stream[camera]].config;
+    if (strcmp(opt->env_key, RASPIJPGS_WIDTH) == 0)
+        config->width = config_int(RASPIJPGS_WIDTH);
+    else if (strcmp(opt->env_key, RASPIJPGS_HEIGHT) == 0)
+        config->height = config_int(RASPIJPGS_HEIGHT);
+    else
+        config->quality = config_int(RASPIJPGS_QUALITY);
+    source_apply(opt, context);
 }
 static void count_apply(const struct raspi_config_opt *opt, enum config_context context)
 {
-    state.count = strtol(getenv(opt->env_key), NULL, 0);
+    UNUSED(context);
+    state.count = config_int(opt->env_key);
 }
 
 static struct raspi_config_opt opts[] =
 {
     // long_option  short   env_key                  help                                                    default
-    {"width",       "w",    RASPIJPGS_WIDTH,        "Set image width <size>",                               "320",      default_set, width_apply},
-    {"height",      "h",    RASPIJPGS_HEIGHT,       "Set image height <size> (0 = calculate from width",    "0",        default_set, height_apply},
-    {"annotation",  "a",    RASPIJPGS_ANNOTATION,   "Annotate the video frames with this text",             "",         default_set, annotation_apply},
-    {"anno_background", "ab", RASPIJPGS_ANNO_BACKGROUND, "Turn on a black background behind the annotation", "off",     default_set, anno_background_apply},
-    {"sharpness",   "sh",   RASPIJPGS_SHARPNESS,    "Set image sharpness (-100 to 100)",                    "0",        default_set, sharpness_apply},
-    {"contrast",    "co",   RASPIJPGS_CONTRAST,     "Set image contrast (-100 to 100)",                     "0",        default_set, contrast_apply},
-    {"brightness",  "br",   RASPIJPGS_BRIGHTNESS,   "Set image brightness (0 to 100)",                      "50",       default_set, brightness_apply},
-    {"saturation",  "sa",   RASPIJPGS_SATURATION,   "Set image saturation (-100 to 100)",                   "0",        default_set, saturation_apply},
-    {"ISO",         "ISO",  RASPIJPGS_ISO,          "Set capture ISO (100 to 800)",                         "0",        default_set, ISO_apply},
-    {"vstab",       "vs",   RASPIJPGS_VSTAB,        "Turn on video stabilisation",                          "off",      default_set, vstab_apply},
-    {"ev",          "ev",   RASPIJPGS_EV,           "Set EV compensation (-10 to 10)",                      "0",        default_set, ev_apply},
-    {"exposure",    "ex",   RASPIJPGS_EXPOSURE,     "Set exposure mode",                                    "auto",     default_set, exposure_apply},
-    {"fps",         0,      RASPIJPGS_FPS,          "Limit the frame rate (0 = auto)",                      "0",        default_set, fps_apply},
-    {"awb",         "awb",  RASPIJPGS_AWB,          "Set Automatic White Balance (AWB) mode",               "auto",     default_set, awb_apply},
-    {"imxfx",       "ifx",  RASPIJPGS_IMXFX,        "Set image effect",                                     "none",     default_set, imxfx_apply},
-    {"colfx",       "cfx",  RASPIJPGS_COLFX,        "Set colour effect <U:V>",                              "",         default_set, colfx_apply},
-    {"mode",        "md",   RASPIJPGS_SENSOR_MODE,  "Set sensor mode (0 to 7)",                             "0",        default_set, sensor_mode_apply},
-    {"metering",    "mm",   RASPIJPGS_METERING,     "Set metering mode",                                    "average",  default_set, metering_apply},
-    {"rotation",    "rot",  RASPIJPGS_ROTATION,     "Set image rotation (0-359)",                           "0",        default_set, rotation_apply},
-    {"hflip",       "hf",   RASPIJPGS_HFLIP,        "Set horizontal flip",                                  "off",      default_set, flip_apply},
-    {"vflip",       "vf",   RASPIJPGS_VFLIP,        "Set vertical flip",                                    "off",      default_set, flip_apply},
-    {"roi",         "roi",  RASPIJPGS_ROI,          "Set region of interest (x,y,w,d as normalised coordinates [0.0-1.0])", "0:0:1:1", default_set, roi_apply},
-    {"shutter",     "ss",   RASPIJPGS_SHUTTER,      "Set shutter speed",                                    "0",        default_set, shutter_apply},
-    {"quality",     "q",    RASPIJPGS_QUALITY,      "Set the JPEG quality (0-100)",                         "15",       default_set, quality_apply},
-    {"restart_interval", "rs", RASPIJPGS_RESTART_INTERVAL, "Set the JPEG restart interval (default of 0 for none)", "0", default_set, restart_interval_apply},
+    {"width",       "w",    RASPIJPGS_WIDTH,        "Set image width <size>",                               "320",      default_set, main_stream_apply},
+    {"height",      "h",    RASPIJPGS_HEIGHT,       "Set image height <size> (0 = calculate from width",    "0",        default_set, main_stream_apply},
+    {"mode",        "md",   RASPIJPGS_SENSOR_MODE,  "Set sensor mode (0 to 7)",                             "0",        default_set, source_apply},
+    {"fps",         0,      RASPIJPGS_FPS,          "Limit the frame rate (0 = auto)",                      "0",        default_set, source_apply},
+    {"annotation",  "a",    RASPIJPGS_ANNOTATION,   "Annotate the video frames with this text",             "",         default_set, source_apply},
+    {"anno_background", "ab", RASPIJPGS_ANNO_BACKGROUND, "Turn on a black background behind the annotation", "off",     default_set, source_apply},
+    {"sharpness",   "sh",   RASPIJPGS_SHARPNESS,    "Set image sharpness (-100 to 100)",                    "0",        default_set, source_apply},
+    {"contrast",    "co",   RASPIJPGS_CONTRAST,     "Set image contrast (-100 to 100)",                     "0",        default_set, source_apply},
+    {"brightness",  "br",   RASPIJPGS_BRIGHTNESS,   "Set image brightness (0 to 100)",                      "50",       default_set, source_apply},
+    {"saturation",  "sa",   RASPIJPGS_SATURATION,   "Set image saturation (-100 to 100)",                   "0",        default_set, source_apply},
+    {"ISO",         "ISO",  RASPIJPGS_ISO,          "Set capture ISO (100 to 800)",                         "0",        default_set, source_apply},
+    {"vstab",       "vs",   RASPIJPGS_VSTAB,        "Turn on video stabilisation",                          "off",      default_set, source_apply},
+    {"ev",          "ev",   RASPIJPGS_EV,           "Set EV compensation (-10 to 10)",                      "0",        default_set, source_apply},
+    {"exposure",    "ex",   RASPIJPGS_EXPOSURE,     "Set exposure mode",                                    "auto",     default_set, source_apply},
+    {"awb",         "awb",  RASPIJPGS_AWB,          "Set Automatic White Balance (AWB) mode",               "auto",     default_set, source_apply},
+    {"imxfx",       "ifx",  RASPIJPGS_IMXFX,        "Set image effect",                                     "none",     default_set, source_apply},
+    {"colfx",       "cfx",  RASPIJPGS_COLFX,        "Set colour effect <U:V>",                              "",         default_set, source_apply},
+    {"metering",    "mm",   RASPIJPGS_METERING,     "Set metering mode",                                    "average",  default_set, source_apply},
+    {"rotation",    "rot",  RASPIJPGS_ROTATION,     "Set image rotation (0-359)",                           "0",        default_set, source_apply},
+    {"hflip",       "hf",   RASPIJPGS_HFLIP,        "Set horizontal flip",                                  "off",      default_set, source_apply},
+    {"vflip",       "vf",   RASPIJPGS_VFLIP,        "Set vertical flip",                                    "off",      default_set, source_apply},
+    {"roi",         "roi",  RASPIJPGS_ROI,          "Set region of interest (x,y,w,d as normalised coordinates [0.0-1.0])", "0:0:1:1", default_set, source_apply},
+    {"shutter",     "ss",   RASPIJPGS_SHUTTER,      "Set shutter speed",                                    "0",        default_set, source_apply},
+    {"quality",     "q",    RASPIJPGS_QUALITY,      "Set the JPEG quality (0-100)",                         "15",       default_set, main_stream_apply},
+    {"target_rate", 0,      RASPIJPGS_TARGET_RATE,  "Adjust the JPEG quality to average this many bytes/second per stream (0 = off)", "0", default_set, source_apply},
+    {"max_frame_size", 0,   RASPIJPGS_MAX_FRAME_SIZE, "Adjust the JPEG quality to keep frames under this many bytes (0 = off)", "0", default_set, source_apply},
+    {"quality_min", 0,      RASPIJPGS_QUALITY_MIN,  "Lowest JPEG quality when adjusting it",                "5",        default_set, source_apply},
+    {"quality_max", 0,      RASPIJPGS_QUALITY_MAX,  "Highest JPEG quality when adjusting it",               "95",       default_set, source_apply},
+    {"h264_bitrate", 0,     RASPIJPGS_H264_BITRATE, "Bits/second for H.264 streams",                        "10000000", default_set, 0},
+    {"h264_intra_period", 0, RASPIJPGS_H264_INTRA_PERIOD, "Frames between H.264 keyframes",                 "60",       default_set, 0},
+    {"restart_interval", "rs", RASPIJPGS_RESTART_INTERVAL, "Set the JPEG restart interval (default of 0 for none)", "0", default_set, source_apply},
     {"socket",      0,      RASPIJPGS_SOCKET,       "Specify the socket filename for communication",        "/tmp/raspijpgs_socket", default_set, 0},
     {"output",      "o",    RASPIJPGS_OUTPUT,       "Specify an output filename or '-' for stdout",         "",         default_set, 0},
+    {"output_queue", 0,     RASPIJPGS_OUTPUT_QUEUE, "Frames to hold when the output can't keep up before dropping the oldest", "4", default_set, 0},
     {"count",       0,      RASPIJPGS_COUNT,        "How many frames to capture before quiting (-1 = no limit)", "-1",  default_set, count_apply},
     {"lockfile",    0,      RASPIJPGS_LOCKFILE,     "Specify a lock filename to prevent multiple runs",     "/tmp/raspijpgs_lock", default_set, 0},
+    {"http_port",   0,      RASPIJPGS_HTTP_PORT,    "Serve MJPEG over HTTP on this TCP port (0 = off)",     "0",        default_set, 0},
+    {"shm_size",    0,      RASPIJPGS_SHM_SIZE,     "Size of the shared memory frame ring for local clients (0 = off)", "8388608", default_set, 0},
+    {"lease",       0,      RASPIJPGS_LEASE,        "Seconds before a silent client is dropped (0 = never)", "5",      default_set, 0},
+    {"streams",     0,      RASPIJPGS_STREAMS,      "Extra streams as name:width[xheight][:quality[:fps[:jpeg|h264[:camera]]]],...", "", default_set, 0},
+    {"record",      0,      RASPIJPGS_RECORD,       "Record to segment files in this directory",            "",         default_set, 0},
+    {"record_stream", 0,    RASPIJPGS_RECORD_STREAM, "Which stream to record",                              "main",     default_set, 0},
+    {"segment_seconds", 0,  RASPIJPGS_SEGMENT_SECONDS, "Start a new recording segment after this many seconds", "60",   default_set, 0},
+    {"segment_size", 0,     RASPIJPGS_SEGMENT_SIZE, "Start a new recording segment before this many bytes (0 = no limit)", "0", default_set, 0},
+    {"record_max_size", 0,  RASPIJPGS_RECORD_MAX_SIZE, "Delete the oldest segments to stay under this many bytes (0 = keep all)", "0", default_set, 0},
+    {"pre_event",   0,      RASPIJPGS_PRE_EVENT,    "Seconds of frames before a trigger to record",          "5",        default_set, 0},
+    {"post_event",  0,      RASPIJPGS_POST_EVENT,   "Seconds to record after a trigger (0 = record everything)", "0",   default_set, 0},
+    {"pre_event_size", 0,   RASPIJPGS_PRE_EVENT_SIZE, "Most bytes of frames to hold for before a trigger",   "16777216", default_set, 0},
+    {"motion",      0,      RASPIJPGS_MOTION,       "Percent of the picture that has to change to count as motion (0 = off)", "0", default_set, 0},
+    {"motion_hold", 0,      RASPIJPGS_MOTION_HOLD,  "Seconds that motion lasts after the picture stops changing", "2", default_set, 0},
+    {"motion_gate", 0,      RASPIJPGS_MOTION_GATE,  "Only send frames while there's motion",                "off",      default_set, 0},
+    {"motion_idle_fps", 0,  RASPIJPGS_MOTION_IDLE_FPS, "Frame rate without motion when gated (0 = none)",   "0",        default_set, 0},
+    {"zerocopy",    0,      RASPIJPGS_ZEROCOPY,     "Spare encoder buffers for sending frames without copying (0 = off)", "0", default_set, 0},
+    {"io_threads",  0,      RASPIJPGS_IO_THREADS,   "Threads for sending to clients and writing --output (0 = main loop)", "0", default_set, 0},
+    {"io_uring",    0,      RASPIJPGS_IO_URING,     "Send each frame to clients and --output in one system call if the kernel has io_uring", "off", default_set, 0},
+#ifndef RASPIJPGS_NO_MMAL
+    {"source",      0,      RASPIJPGS_SOURCE,       "Where frames come from (camera, synthetic, replay)",   "camera",   default_set, 0},
+#else
+    {"source",      0,      RASPIJPGS_SOURCE,       "Where frames come from (synthetic, replay)",           "synthetic", default_set, 0},
+#endif
+    {"replay",      0,      RASPIJPGS_REPLAY,       "Capture file for the replay source (cat or header framing)", "",  default_set, 0},
+    {"synthetic_size", 0,   RASPIJPGS_SYNTHETIC_SIZE, "Pad synthetic JPEGs to this many bytes (0 = no padding)", "0",  default_set, 0},
 
     // options that can't be overridden using environment variables
     {"config",      "c",    0,                       "Specify a config file to read for options",            0,          config_set, 0},
-    {"framing",     "fr",   0,                       "Specify the output framing (cat, mime, http, header, replace)", "cat",   framing_set, 0},
+    {"framing",     "fr",   0,                       "Specify the output framing (cat, mime, http, header, packet, replace, latest)", "cat",   framing_set, 0},
+    {"transport",   0,      0,                       "How a client receives frames (socket, shm)",           "shm",      transport_set, 0},
+    {"stream",      0,      0,                       "Which stream to receive or output (main or one from --streams)", "main", stream_set, 0},
+    {"max_fps",     0,      0,                       "Limit the frame rate that a client receives (0 = no limit)", "0", max_fps_set, 0},
+    {"motion_events", 0,    0,                       "Have a client print the server's motion scores",       "off",      motion_events_set, 0},
     {"send",        0,      0,                       "Send this parameter on the server (e.g. --send shutter=1000)", 0,  send_set, 0},
     {"server",      0,      0,                       "Run as a server",                                      0,          server_set, 0},
     {"client",      0,      0,                       "Run as a client",                                      0,          client_set, 0},
     {"quit",        0,      0,                       "Tell a server to quit",                                0,          quit_set, 0},
+    {"stats",       0,      0,                       "Ask a server for statistics (e.g. --send stats)",      0,          stats_set, 0},
+    {"trigger",     0,      0,                       "Record an event (e.g. --send trigger)",                0,          trigger_set, 0},
     {"help",        "h",    0,                       "Print this help message",                              0,          help, 0},
     {0,             0,      0,                       0,                                                      0,          0,           0}
 };
@@ -620,6 +884,8 @@ static void help(const struct raspi_config_opt *opt, const char *value, enum con
             "    blur, saturation, colorswap, washedout, posterize, colorpoint,\n"
             "    colorbalance, cartoon\n"
             "Metering (--metering) options: average, spot, backlit, matrix\n"
+            "Camera settings for cameras after the first: --cameraN.option\n"
+            "    (e.g., --camera1.contrast 70). The default is the plain option.\n"
             "Sensor mode (--mode) options:\n"
             "       0   automatic selection\n"
             "       1   1920x1080 (16:9) 1-30 fps\n"
@@ -644,109 +910,338 @@ static int is_short_option(const char *str)
     return strlen(str) >= 2 && str[0] == '-' && str[1] != '-';
 }
 
-static void fillin_defaults()
+// FNV-1a
+static uint32_t config_hash(const char *str)
 {
-    const struct raspi_config_opt *opt;
-    for (opt = opts; opt->long_option; opt++) {
-        if (opt->env_key && opt->default_value) {
-            // The replace option is set to 0, so that anything set in the environment
-            // is an override.
-            if (setenv(opt->env_key, opt->default_value, 0) < 0)
-                err(EXIT_FAILURE, "Error setting %s to %s", opt->env_key, opt->default_value);
-        }
+    uint32_t hash = 2166136261u;
+    while (*str) {
+        hash ^= (uint8_t) *str++;
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    // TODO: To expose framing to the environment or not????
-    if (!state.framing)
-        state.framing = "cat";
+static void config_hash_insert(uint8_t *table, const char *name, int ix)
+{
+    uint32_t slot = config_hash(name);
+    while (table[slot & (CONFIG_HASH_SIZE - 1)])
+        slot++;
+    table[slot & (CONFIG_HASH_SIZE - 1)] = ix + 1;
 }
 
-static void apply_parameters(enum config_context context)
+// Return the index of the option by long option name or env key (-1 = none)
+static int config_hash_find(const uint8_t *table, const char *name, int by_env_key)
 {
-    const struct raspi_config_opt *opt;
-    for (opt = opts; opt->long_option; opt++) {
-        if (opt->apply)
-            opt->apply(opt, context);
+    uint32_t slot = config_hash(name);
+    for (;; slot++) {
+        int ix = table[slot & (CONFIG_HASH_SIZE - 1)];
+        if (!ix)
+            return -1;
+        const struct raspi_config_opt *opt = &opts[ix - 1];
+        if (strcmp(by_env_key ? opt->env_key : opt->long_option, name) == 0)
+            return ix - 1;
     }
 }
 
-static void parse_args(int argc, char *argv[])
+static void config_index()
 {
-    int i;
-    for (i = 1; i < argc; i++) {
-        const struct raspi_config_opt *opt = 0;
-        char *value;
-        if (is_long_option(argv[i])) {
-            char *key = argv[i] + 2; // skip over "--"
-            value = strchr(argv[i], '=');
-            if (value)
-                *value = '\0'; // zap the '=' so that key is trimmed
-            for (opt = opts; opt->long_option; opt++)
-                if (strcmp(opt->long_option, key) == 0)
-                    break;
-            if (!opt->long_option) {
-                warnx("Unknown option '%s'", key);
-                help(0, 0, 0);
-            }
-
-            if (!value && i < argc - 1 && !is_long_option(argv[i + 1]) && !is_short_option(argv[i + 1]))
-                value = argv[++i];
-            if (!value)
-                value = "on"; // if no value, then this is a boolean argument, so set to on
-        } else if (is_short_option(argv[i])) {
-            char *key = argv[i] + 1; // skip over the "-"
-            for (opt = opts; opt->long_option; opt++)
-                if (opt->short_option && strcmp(opt->short_option, key) == 0)
-                    break;
-            if (!opt->long_option) {
-                warnx("Unknown option '%s'", key);
-                help(0, 0, 0);
-            }
+    int count = 0;
+    while (opts[count].long_option)
+        count++;
+    if (count >= CONFIG_HASH_SIZE / 2)
+        errx(EXIT_FAILURE, "Too many options. Increase CONFIG_HASH_SIZE.");
 
-            if (i < argc - 1)
-                value = argv[++i];
-            else
-                value = "on"; // if no value, then this is a boolean argument, so set to on
-        } else {
-            warnx("Unexpected parameter '%s'", argv[i]);
-            help(0, 0, 0);
-        }
+    int i;
+    for (i = 0; i < count; i++) {
+        config_hash_insert(state.config_by_name, opts[i].long_option, i);
+        if (opts[i].env_key)
+            config_hash_insert(state.config_by_key, opts[i].env_key, i);
+    }
 
-        if (opt)
-            opt->set(opt, value, config_context_parse_cmdline);
+    state.config = (struct config_entry *) calloc(count, sizeof(struct config_entry));
+    if (!state.config)
+        err(EXIT_FAILURE, "calloc");
+    for (i = 1; i < MAX_CAMERAS; i++) {
+        state.camera_config[i] = (struct config_entry *) calloc(count, sizeof(struct config_entry));
+        if (!state.camera_config[i])
+            err(EXIT_FAILURE, "calloc");
     }
 }
 
-static void trim_whitespace(char *s)
+static int is_camera_setting(const struct raspi_config_opt *opt)
 {
-    char *left = s;
-    while (*left != 0 && isspace(*left))
-        left++;
-    char *right = s + strlen(s) - 1;
-    while (right >= left && isspace(*right))
-        right--;
+    return opt->apply == source_apply || opt->apply == main_stream_apply;
+}
 
-    int len = right - left + 1;
-    if (len)
-        memmove(s, left, len);
-    s[len] = 0;
+static const struct raspi_config_opt *find_opt(const char *long_option)
+{
+    int ix = config_hash_find(state.config_by_name, long_option, 0);
+    return ix >= 0 ? &opts[ix] : 0;
 }
 
-static void parse_config_line(const char *line, enum config_context context)
+// Like find_opt(), but camera settings can have a cameraN. prefix
+static const struct raspi_config_opt *find_camera_opt(const char *name, int *camera)
 {
-    char *str = strdup(line);
-    // Trim everything after a comment
-    char *comment = strchr(str, '#');
-    if (comment)
-        *comment = '\0';
+    *camera = 0;
+    if (strncmp(name, "camera", 6) != 0 || !isdigit(name[6]))
+        return find_opt(name);
+
+    char *dot;
+    long n = strtol(name + 6, &dot, 10);
+    if (*dot != '.' || n < 1 || n >= MAX_CAMERAS)
+        return 0;
+    const struct raspi_config_opt *opt = find_opt(dot + 1);
+    if (!opt || !is_camera_setting(opt) || opt->set != default_set)
+        return 0;
+    *camera = n;
+    return opt;
+}
+
+static void config_entry_set(struct config_entry *entry, const char *value)
+{
+    free(entry->str);
+    entry->str = strdup(value);
+    if (!entry->str)
+        err(EXIT_FAILURE, "strdup");
+    entry->i = strtoll(value, 0, 0);
+    entry->d = strtod(value, 0);
+}
+
+// Take the values from the environment once everything has been set there
+static void config_init()
+{
+    int i;
+    for (i = 0; opts[i].long_option; i++) {
+        if (opts[i].env_key) {
+            const char *value = getenv(opts[i].env_key);
+            config_entry_set(&state.config[i], value ? value : "");
+        }
+        if (!is_camera_setting(&opts[i]))
+            continue;
+
+        int camera;
+        for (camera = 1; camera < MAX_CAMERAS; camera++) {
+            char key[64];
+            camera_env_key(key, sizeof(key), camera, opts[i].env_key);
+            const char *value = getenv(key);
+            if (value)
+                config_entry_set(&state.camera_config[camera][i], value);
+        }
+    }
+    state.config_ready = 1;
+}
+
+static void config_update(const struct raspi_config_opt *opt, int camera, const char *value)
+{
+    int ix = opt - opts;
+    struct config_entry *entry = camera ? &state.camera_config[camera][ix] : &state.config[ix];
+    entry->sent = 1;
+    if (!value)
+        return;
+
+    // A camera's first setting of its own only counts as a change if it's
+    // different from the one it was following
+    const char *current = entry->str ? entry->str : state.config[ix].str;
+    if (strcmp(current, value) != 0)
+        entry->changed = 1;
+    if (!entry->str || strcmp(entry->str, value) != 0)
+        config_entry_set(entry, value);
+}
+
+void config_select_camera(int camera)
+{
+    state.config_camera = camera;
+}
+
+int config_selected_camera()
+{
+    return state.config_camera;
+}
+
+static void apply_to_camera(const struct raspi_config_opt *opt, int camera, enum config_context context)
+{
+    config_select_camera(camera);
+    opt->apply(opt, context);
+    config_select_camera(0);
+}
+
+// Apply what a client request set in one pass. This goes in the order of
+// opts[] so that, e.g., the sensor mode and frame rate are set before the
+// exposure. Camera settings are only applied if their values changed since
+// each one is a round trip to the camera. Other options are cheap, so
+// they're applied whenever they're sent. A change to a plain camera setting
+// is also applied to the other cameras that don't have their own.
+static void config_commit(enum config_context context)
+{
+    int i;
+    for (i = 0; opts[i].long_option; i++) {
+        struct config_entry *entry = &state.config[i];
+        int camera_setting = is_camera_setting(&opts[i]);
+        int changed = entry->changed;
+        int apply = changed || (entry->sent && !camera_setting);
+        entry->changed = 0;
+        entry->sent = 0;
+        if (apply && opts[i].apply)
+            opts[i].apply(&opts[i], context);
+        if (!camera_setting)
+            continue;
+
+        int camera;
+        for (camera = 1; camera < MAX_CAMERAS; camera++) {
+            struct config_entry *own = &state.camera_config[camera][i];
+            int apply_own = own->changed || (changed && !own->str);
+            own->changed = 0;
+            own->sent = 0;
+            if (apply_own && camera < state.camera_count && opts[i].apply)
+                apply_to_camera(&opts[i], camera, context);
+        }
+    }
+}
+
+static const struct config_entry *config_entry(const char *env_key)
+{
+    int ix = config_hash_find(state.config_by_key, env_key, 1);
+    if (ix < 0 || !state.config_ready)
+        errx(EXIT_FAILURE, "Option %s isn't available", env_key);
+    if (state.config_camera && state.camera_config[state.config_camera][ix].str)
+        return &state.camera_config[state.config_camera][ix];
+    return &state.config[ix];
+}
+
+const char *config_string(const char *env_key)
+{
+    return config_entry(env_key)->str;
+}
+
+int64_t config_int(const char *env_key)
+{
+    return config_entry(env_key)->i;
+}
+
+double config_double(const char *env_key)
+{
+    return config_entry(env_key)->d;
+}
+
+int config_on(const char *env_key)
+{
+    return strcmp(config_entry(env_key)->str, "on") == 0;
+}
+
+static void fillin_defaults()
+{
+    const struct raspi_config_opt *opt;
+    for (opt = opts; opt->long_option; opt++) {
+        if (opt->env_key && opt->default_value) {
+            // The replace option is set to 0, so that anything set in the environment
+            // is an override.
+            if (setenv(opt->env_key, opt->default_value, 0) < 0)
+                err(EXIT_FAILURE, "Error setting %s to %s", opt->env_key, opt->default_value);
+        }
+    }
+
+    // TODO: To expose framing to the environment or not????
+    if (!state.framing)
+        state.framing = "cat";
+    if (!state.transport)
+        state.transport = "shm";
+    if (!state.stream_name)
+        state.stream_name = "main";
+}
+
+static void apply_parameters(enum config_context context)
+{
+    const struct raspi_config_opt *opt;
+    for (opt = opts; opt->long_option; opt++) {
+        if (!opt->apply)
+            continue;
+        opt->apply(opt, context);
+
+        int camera;
+        for (camera = 1; camera < state.camera_count && is_camera_setting(opt); camera++)
+            apply_to_camera(opt, camera, context);
+    }
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    config_index();
+
+    int i;
+    for (i = 1; i < argc; i++) {
+        const struct raspi_config_opt *opt = 0;
+        int camera = 0;
+        char *value;
+        if (is_long_option(argv[i])) {
+            char *key = argv[i] + 2; // skip over "--"
+            value = strchr(argv[i], '=');
+            if (value)
+                *value++ = '\0'; // zap the '=' so that key is trimmed
+            opt = find_camera_opt(key, &camera);
+            if (!opt) {
+                warnx("Unknown option '%s'", key);
+                help(0, 0, 0);
+            }
+
+            if (!value && i < argc - 1 && !is_long_option(argv[i + 1]) && !is_short_option(argv[i + 1]))
+                value = argv[++i];
+            if (!value)
+                value = "on"; // if no value, then this is a boolean argument, so set to on
+        } else if (is_short_option(argv[i])) {
+            char *key = argv[i] + 1; // skip over the "-"
+            for (opt = opts; opt->long_option; opt++)
+                if (opt->short_option && strcmp(opt->short_option, key) == 0)
+                    break;
+            if (!opt->long_option) {
+                warnx("Unknown option '%s'", key);
+                help(0, 0, 0);
+            }
+
+            if (i < argc - 1)
+                value = argv[++i];
+            else
+                value = "on"; // if no value, then this is a boolean argument, so set to on
+        } else {
+            warnx("Unexpected parameter '%s'", argv[i]);
+            help(0, 0, 0);
+        }
+
+        if (camera)
+            setting_set(opt, camera, value, config_context_parse_cmdline);
+        else if (opt)
+            opt->set(opt, value, config_context_parse_cmdline);
+    }
+}
+
+static void trim_whitespace(char *s)
+{
+    char *left = s;
+    while (*left != 0 && isspace(*left))
+        left++;
+    char *right = s + strlen(s) - 1;
+    while (right >= left && isspace(*right))
+        right--;
+
+    int len = right - left + 1;
+    if (len)
+        memmove(s, left, len);
+    s[len] = 0;
+}
+
+// Parse a line in place. Client requests are applied by config_commit()
+// after all of their lines have been parsed.
+static void parse_config_line(char *str, enum config_context context)
+{
+    // Trim everything after a comment
+    char *comment = strchr(str, '#');
+    if (comment)
+        *comment = '\0';
 
     // Trim whitespace off the beginning and end
     trim_whitespace(str);
 
-    if (*str == '\0') {
-        free(str);
+    if (*str == '\0')
         return;
-    }
 
     char *key = str;
     char *value = strchr(str, '=');
@@ -758,484 +1253,2077 @@ static void parse_config_line(const char *line, enum config_context context)
     } else
         value = "on";
 
-    const struct raspi_config_opt *opt;
-    for (opt = opts; opt->long_option; opt++)
-        if (strcmp(opt->long_option, key) == 0)
-            break;
-    if (!opt->long_option) {
+    int camera;
+    const struct raspi_config_opt *opt = find_camera_opt(key, &camera);
+    if (!opt) {
         // Error out if we're parsing a file; otherwise ignore the bad option
         if (context == config_context_file)
             errx(EXIT_FAILURE, "Unknown option '%s' in file '%s'", key, state.config_filename);
-        else {
-            free(str);
-            return;
+        return;
+    }
+
+    switch (context) {
+    case config_context_file:
+    case config_context_client_request:
+        if (camera)
+            setting_set(opt, camera, value, context);
+        else
+            opt->set(opt, value, context);
+        break;
+
+    default:
+        // Ignore
+        break;
+    }
+}
+
+static void load_config_file()
+{
+    if (!state.config_filename)
+        return;
+
+    FILE *fp = fopen(state.config_filename, "r");
+    if (!fp)
+        err(EXIT_FAILURE, "Cannot open '%s'", state.config_filename);
+
+    char line[128];
+    while (fgets(line, sizeof(line), fp))
+        parse_config_line(line, config_context_file);
+
+    fclose(fp);
+}
+
+static void remove_server_lock()
+{
+    unlink(state.lock_filename);
+}
+
+// Return 0 if a server's running; 1 if we are the server now
+static int acquire_server_lock()
+{
+    // This lock isn't meant to protect against race conditions. It's just meant
+    // to provide a better error message if the user accidentally starts up a
+    // second server.
+    const char *lockfile = config_string(RASPIJPGS_LOCKFILE);
+    FILE *fp = fopen(lockfile, "r");
+    if (fp) {
+        char server_pid_str[16];
+        pid_t server_pid;
+
+        // Check that there's a process behind the pid in the lock file.
+        if (fgets(server_pid_str, sizeof(server_pid_str), fp) != NULL &&
+            (server_pid = strtoul(server_pid_str, NULL, 10)) != 0 &&
+            server_pid > 0 &&
+            kill(server_pid, 0) == 0) {
+            // Yes, so we can't be a server.
+            fclose(fp);
+            return 0;
+        }
+
+        fclose(fp);
+    }
+
+    fp = fopen(lockfile, "w");
+    if (!fp)
+        err(EXIT_FAILURE, "Can't open lock file '%s'", lockfile);
+
+    if (fprintf(fp, "%d", getpid()) < 0)
+        err(EXIT_FAILURE, "Can't write to '%s'", lockfile);
+    fclose(fp);
+
+    // Record the name of the lock file that we used so that it
+    // can be removed automatically on termination.
+    state.lock_filename = strdup(lockfile);
+    atexit(remove_server_lock);
+
+    return 1;
+}
+
+static uint32_t hash_string(const char *str)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    while (*str) {
+        hash ^= (uint8_t) *str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static struct subscriber **subscriber_bucket(const char *path)
+{
+    return &state.subscriber_buckets[hash_string(path) & (state.subscriber_bucket_count - 1)];
+}
+
+static void grow_subscriber_table()
+{
+    state.subscriber_alloc = state.subscriber_alloc ? 2 * state.subscriber_alloc : 16;
+    state.subscribers = (struct subscriber **) realloc(state.subscribers, state.subscriber_alloc * sizeof(struct subscriber *));
+    if (!state.subscribers)
+        err(EXIT_FAILURE, "realloc");
+
+    // Keep the hash table at least as big as the array and rehash everyone
+    free(state.subscriber_buckets);
+    state.subscriber_bucket_count = state.subscriber_alloc;
+    state.subscriber_buckets = (struct subscriber **) calloc(state.subscriber_bucket_count, sizeof(struct subscriber *));
+    if (!state.subscriber_buckets)
+        err(EXIT_FAILURE, "calloc");
+
+    int i;
+    for (i = 0; i < state.subscriber_count; i++) {
+        struct subscriber *sub = state.subscribers[i];
+        struct subscriber **bucket = subscriber_bucket(sub->addr.sun_path);
+        sub->hash_next = *bucket;
+        *bucket = sub;
+    }
+}
+
+static struct subscriber *find_client(const struct sockaddr_un *client_addr)
+{
+    if (!state.subscriber_buckets)
+        return 0;
+
+    struct subscriber *sub;
+    for (sub = *subscriber_bucket(client_addr->sun_path); sub; sub = sub->hash_next) {
+        if (strcmp(sub->addr.sun_path, client_addr->sun_path) == 0)
+            return sub;
+    }
+    return 0;
+}
+
+static void renew_lease(struct subscriber *sub)
+{
+    sub->lease_expires_us = monotonic_us() + state.lease_us;
+}
+
+// Add a client or renew its lease if it's already subscribed
+static struct subscriber *add_client(const struct sockaddr_un *client_addr)
+{
+    struct subscriber *sub = find_client(client_addr);
+    if (!sub) {
+        if (state.subscriber_count == state.subscriber_alloc)
+            grow_subscriber_table();
+
+        sub = (struct subscriber *) calloc(1, sizeof(struct subscriber));
+        if (!sub)
+            err(EXIT_FAILURE, "calloc");
+        sub->addr = *client_addr;
+        sub->ring_eventfd = -1;
+
+        sub->index = state.subscriber_count++;
+        state.subscribers[sub->index] = sub;
+        struct subscriber **bucket = subscriber_bucket(sub->addr.sun_path);
+        sub->hash_next = *bucket;
+        *bucket = sub;
+    }
+    renew_lease(sub);
+    return sub;
+}
+
+static void subscriber_dequeue(struct subscriber *sub)
+{
+    frame_unref(sub->queue[sub->queue_head]);
+    sub->queue_head = (sub->queue_head + 1) % SUBSCRIBER_QUEUE_SIZE;
+    if (--sub->queue_count == 0)
+        state.subscribers_backlogged--;
+}
+
+// Remove and free a client. The last client in state.subscribers is moved
+// into its place, so iterate backwards when clients can be removed.
+static void remove_client(struct subscriber *sub)
+{
+    if (sub->ring_eventfd >= 0)
+        close(sub->ring_eventfd);
+    if (sub->sink)
+        io_sink_close(sub->sink);
+    while (sub->queue_count)
+        subscriber_dequeue(sub);
+
+    struct subscriber **link = subscriber_bucket(sub->addr.sun_path);
+    while (*link != sub)
+        link = &(*link)->hash_next;
+    *link = sub->hash_next;
+
+    struct subscriber *last = state.subscribers[--state.subscriber_count];
+    last->index = sub->index;
+    state.subscribers[last->index] = last;
+
+    if (state.requesting_subscriber == sub)
+        state.requesting_subscriber = 0;
+    free(sub);
+}
+
+static void expire_clients()
+{
+    if (state.lease_us <= 0)
+        return;
+
+    int64_t now = monotonic_us();
+    if (now < state.next_lease_check_us)
+        return;
+    state.next_lease_check_us = now + 1000000;
+
+    int i;
+    for (i = state.subscriber_count - 1; i >= 0; i--) {
+        if (state.subscribers[i]->lease_expires_us < now)
+            remove_client(state.subscribers[i]);
+    }
+}
+
+static void remove_all_clients()
+{
+    while (state.subscriber_count)
+        remove_client(state.subscribers[state.subscriber_count - 1]);
+    free(state.subscribers);
+    free(state.subscriber_buckets);
+    state.subscribers = 0;
+    state.subscriber_buckets = 0;
+    state.subscriber_alloc = 0;
+    state.subscriber_bucket_count = 0;
+}
+
+static void *ring_map(int fd, size_t size, int prot)
+{
+    void *addr = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        err(EXIT_FAILURE, "mmap");
+    return addr;
+}
+
+static int ring_create_fd()
+{
+    int fd;
+#ifdef SYS_memfd_create
+    fd = syscall(SYS_memfd_create, "raspijpgs", 1 /* MFD_CLOEXEC */);
+    if (fd >= 0)
+        return fd;
+#endif
+    // Fall back to an unlinked file on tmpfs
+    char path[] = "/dev/shm/raspijpgs-XXXXXX";
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd < 0)
+        err(EXIT_FAILURE, "Can't create shared memory for the frame ring");
+    unlink(path);
+    return fd;
+}
+
+static void ring_create(struct stream *s)
+{
+    s->ring_fd = -1;
+
+    long size = config_int(RASPIJPGS_SHM_SIZE);
+    if (size <= 0)
+        return;
+
+    // Round down to a power of 2 so that positions can wrap at 2^32.
+    uint32_t data_size = 1;
+    while (data_size <= (uint32_t) size / 2 && data_size < 0x40000000)
+        data_size <<= 1;
+
+    s->ring_fd = ring_create_fd();
+    s->ring_mapped_size = sizeof(struct frame_ring) + data_size;
+    if (ftruncate(s->ring_fd, s->ring_mapped_size) < 0)
+        err(EXIT_FAILURE, "Can't size the frame ring");
+
+    s->ring = (struct frame_ring *) ring_map(s->ring_fd, s->ring_mapped_size, PROT_READ | PROT_WRITE);
+    s->ring->magic = FRAME_RING_MAGIC;
+    s->ring->data_size = data_size;
+    s->ring->head_seq = 0;
+    s->ring->reclaim_pos = 0 - data_size;
+    s->ring_write_pos = 0;
+}
+
+static void ring_destroy(struct stream *s)
+{
+    if (s->ring)
+        munmap(s->ring, s->ring_mapped_size);
+    s->ring = 0;
+    if (s->ring_fd >= 0)
+        close(s->ring_fd);
+    s->ring_fd = -1;
+}
+
+// Send the ring for the client's stream and an eventfd for new frame
+// notifications to a client. If this fails, the client keeps receiving
+// frames as datagrams.
+static void ring_attach_subscriber(struct subscriber *sub)
+{
+    const struct stream *s = &state.streams[sub->stream];
+    if (!s->ring || sub->ring_eventfd >= 0)
+        return;
+
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0) {
+        warn("eventfd");
+        return;
+    }
+
+    int fds[2] = {s->ring_fd, efd};
+    char cmsg_buffer[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {"shm", 3};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &sub->addr;
+    msg.msg_namelen = sizeof(struct sockaddr_un);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buffer;
+    msg.msg_controllen = sizeof(cmsg_buffer);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(state.socket_fd, &msg, MSG_DONTWAIT) < 0) {
+        warn("Can't send frame ring to %s", sub->addr.sun_path);
+        close(efd);
+        return;
+    }
+    sub->ring_eventfd = efd;
+}
+
+static void ring_publish(struct stream *s, const struct iovec *iov, int iovcnt, size_t len, int64_t pts_us)
+{
+    struct frame_ring *ring = s->ring;
+    if (len > ring->data_size / 4) {
+        warnx("Frame too large (%d bytes) for the frame ring. Increase shm_size.", (int) len);
+        state.stats.dropped_oversize++;
+        return;
+    }
+
+    // Frames are never split, so skip to the start if this one doesn't fit.
+    uint32_t pos = s->ring_write_pos;
+    uint32_t offset = pos & (ring->data_size - 1);
+    if (offset + len > ring->data_size) {
+        pos += ring->data_size - offset;
+        offset = 0;
+    }
+    uint32_t end = pos + len;
+
+    // Tell readers what's about to be overwritten before touching it.
+    __atomic_store_n(&ring->reclaim_pos, end - ring->data_size, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(&ring->data[offset], iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+
+    uint32_t seq = ring->head_seq + 1;
+    if (seq == 0)
+        seq = 1;
+    struct frame_ring_slot *slot = &ring->slots[seq % FRAME_RING_SLOTS];
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->pos = pos;
+    slot->len = len;
+    slot->pts_us = pts_us;
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head_seq, seq, __ATOMIC_RELEASE);
+
+    s->ring_write_pos = end;
+    state.stats.bytes_shm += len;
+}
+
+static void term_sighandler(int signum)
+{
+    UNUSED(signum);
+    // Capture no more frames.
+    state.count = 0;
+}
+
+static void stats_sighandler(int signum)
+{
+    UNUSED(signum);
+    state.stats_requested = 1;
+}
+
+// Values under LATENCY_SUB_BUCKETS get their own bucket. After that, each
+// power of 2 is split into LATENCY_SUB_BUCKETS buckets.
+static int latency_bucket(int64_t us)
+{
+    if (us < LATENCY_SUB_BUCKETS)
+        return us < 0 ? 0 : (int) us;
+
+    int msb = 63 - __builtin_clzll((uint64_t) us);
+    int sub = (us >> (msb - 2)) & (LATENCY_SUB_BUCKETS - 1);
+    int bucket = (msb - 1) * LATENCY_SUB_BUCKETS + sub;
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+// The smallest value that goes in the bucket after this one
+static int64_t latency_bucket_limit(int bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS)
+        return bucket + 1;
+
+    int msb = bucket / LATENCY_SUB_BUCKETS + 1;
+    int sub = bucket % LATENCY_SUB_BUCKETS;
+    return (int64_t) (LATENCY_SUB_BUCKETS + sub + 1) << (msb - 2);
+}
+
+static void latency_record(enum latency_stage stage, int64_t us)
+{
+    struct latency_histogram *h = &state.latency[stage];
+    if (us < 0)
+        us = 0; // Clocks that don't quite line up
+    h->buckets[latency_bucket(us)]++;
+    h->count++;
+    h->sum_us += us;
+    if (us > h->max_us)
+        h->max_us = us;
+}
+
+// Return an upper bound on the given percentile
+static int64_t latency_percentile(const struct latency_histogram *h, int percent)
+{
+    unsigned long target = (h->count * percent + 99) / 100;
+    unsigned long seen = 0;
+    int i;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target && seen > 0)
+            return latency_bucket_limit(i) < h->max_us ? latency_bucket_limit(i) : h->max_us;
+    }
+    return h->max_us;
+}
+
+// Pass 0 for output_done_us if the frame wasn't for --output
+static void latency_record_frame(const struct frame_timing *timing, int64_t fanout_done_us, int64_t output_done_us)
+{
+    latency_record(latency_stage_sensor, timing->arrival_us - timing->capture_us);
+    latency_record(latency_stage_handoff, timing->processed_us - timing->arrival_us);
+    latency_record(latency_stage_assembly, timing->assembled_us - timing->processed_us);
+    latency_record(latency_stage_fanout, fanout_done_us - timing->assembled_us);
+    if (output_done_us)
+        latency_record(latency_stage_output, output_done_us - fanout_done_us);
+    else
+        output_done_us = fanout_done_us;
+    latency_record(latency_stage_total, output_done_us - timing->capture_us);
+}
+
+static void write_latency_stats(FILE *fp)
+{
+    int i;
+    for (i = 0; i < latency_stage_count; i++) {
+        const struct latency_histogram *h = &state.latency[i];
+        if (h->count == 0)
+            continue;
+        fprintf(fp, "latency %-8s %lu frames, avg %lld us, p50 %lld us, p99 %lld us, max %lld us\n",
+                latency_stage_names[i],
+                h->count,
+                (long long) (h->sum_us / h->count),
+                (long long) latency_percentile(h, 50),
+                (long long) latency_percentile(h, 99),
+                (long long) h->max_us);
+    }
+}
+
+static void write_subscriber_stats(FILE *fp)
+{
+    int i;
+    for (i = 0; i < state.subscriber_count; i++) {
+        const struct subscriber *sub = state.subscribers[i];
+        fprintf(fp, "subscriber %s: %s, %s, backlog %d, %lu sent, %lu dropped, %lu over max_fps\n",
+                sub->addr.sun_path,
+                state.streams[sub->stream].config.name,
+                sub->ring_eventfd >= 0 ? "shm" : "socket",
+                sub->sink ? io_sink_backlog(sub->sink) : sub->queue_count,
+                sub->frames_sent,
+                sub->frames_dropped,
+                sub->frames_skipped);
+    }
+    if (state.http_listen_fd >= 0)
+        fprintf(fp, "http: %d clients\n", state.http_client_count);
+}
+
+// Everything that's known about how the server is doing. This is both the
+// SIGUSR1 output and the reply to the stats command.
+static void write_stream_stats(FILE *fp)
+{
+    int64_t now = monotonic_us();
+    int i;
+    for (i = 0; i < state.stream_count; i++) {
+        const struct stream *s = &state.streams[i];
+
+        // The frame rate is only updated when frames come in
+        double fps = s->current_fps;
+        if (now - s->fps_interval_start_us > 2 * FPS_INTERVAL_US)
+            fps = 0;
+
+        fprintf(fp, "stream %s: %lu frames, %.1f fps, %lu bytes average, %lu over fps cap\n",
+                s->config.name,
+                s->frames,
+                fps,
+                s->frames ? (unsigned long) (s->bytes / s->frames) : 0,
+                s->skipped);
+    }
+}
+
+static void write_stats(FILE *fp)
+{
+    const struct server_stats *stats = &state.stats;
+    const struct frame_pool *pool = &state.frame_pool;
+
+    write_stream_stats(fp);
+    if (motion_enabled())
+        fprintf(fp, "motion: %.1f%% changed, %s, %lu events, %lu images, %lu frames gated\n",
+                state.motion.score,
+                state.motion.active ? "active" : "idle",
+                state.motion.events,
+                state.motion.images,
+                state.motion.gated);
+    fprintf(fp, "dropped: %lu oversize, %lu slow client, %lu pipe full, %lu errors, %lu skipped by http\n",
+            stats->dropped_oversize,
+            stats->dropped_slow_client,
+            stats->dropped_pipe_full,
+            stats->dropped_error,
+            stats->http_skipped);
+    fprintf(fp, "bytes out: %llu socket, %llu shm, %llu http, %llu output\n",
+            stats->bytes_socket,
+            stats->bytes_shm,
+            stats->bytes_http,
+            stats->bytes_output);
+    if (stats->reconfigurations)
+        fprintf(fp, "reconfigurations: %lu, last gap %.1f ms, longest %.1f ms\n",
+                stats->reconfigurations,
+                stats->reconfig_last_gap_us / 1000.0,
+                stats->reconfig_max_gap_us / 1000.0);
+    if (state.output_fd >= 0)
+        fprintf(fp, "output queue: %d frames (peak %d of %d)\n",
+                state.output_queue_count,
+                state.output_queue_peak,
+                state.output_queue_size);
+    write_subscriber_stats(fp);
+    io_workers_print_stats(fp);
+    uring_print_stats(fp);
+    fprintf(fp, "frame pool: %lu gets, %.1f%% hits, %lu allocations, %lu bytes (peak %lu)\n",
+            pool->gets,
+            pool->gets ? 100.0 * pool->hits / pool->gets : 0.0,
+            pool->allocations,
+            (unsigned long) pool->bytes,
+            (unsigned long) pool->peak_bytes);
+    write_latency_stats(fp);
+    recorder_print_stats(fp);
+    if (state.source->print_stats)
+        state.source->print_stats(fp);
+}
+
+// --output is often stdout shared with a shell or pipeline, so it can't be
+// left non-blocking. This is called from the atexit handlers too since
+// err() and errx() exit from anywhere.
+static void output_restore_flags()
+{
+    if (state.output_fd_flags >= 0) {
+        fcntl(state.output_fd, F_SETFL, state.output_fd_flags);
+        state.output_fd_flags = -1;
+    }
+}
+
+// Signals that kill the process skip the atexit handlers. fcntl() is safe
+// to call here, and the signal is raised again with its default action.
+static void output_fatal_sighandler(int signum)
+{
+    if (state.output_fd_flags >= 0)
+        fcntl(state.output_fd, F_SETFL, state.output_fd_flags);
+    raise(signum);
+}
+
+static void cleanup_server()
+{
+    output_restore_flags();
+    close(state.socket_fd);
+    unlink(state.server_addr.sun_path);
+}
+
+// Account for a write to the output. Short writes lose the rest of the frame.
+static void output_written(int count, size_t expected, const char *filename)
+{
+    if (count < 0)
+        err(EXIT_FAILURE, "Error writing to %s", filename);
+
+    state.stats.bytes_output += count;
+    if ((size_t) count != expected) {
+        warnx("Unexpected truncation of JPEG when writing to %s", filename);
+        state.stats.dropped_pipe_full++;
+    }
+}
+
+// --output is non-blocking so that a slow reader never holds up the camera.
+// Frames are written directly when nothing is queued. Whatever doesn't fit is
+// copied to the queue and written when poll says there's room.
+static void output_queue_init()
+{
+    state.output_queue_size = constrain(1, config_int(RASPIJPGS_OUTPUT_QUEUE), 1024);
+    state.output_queue = (struct output_chunk *) calloc(state.output_queue_size, sizeof(struct output_chunk));
+    if (!state.output_queue)
+        err(EXIT_FAILURE, "calloc");
+    state.output_queue_head = 0;
+    state.output_queue_count = 0;
+    state.output_queue_offset = 0;
+    state.output_queue_started = 0;
+    state.output_queue_peak = 0;
+
+    state.output_fd_flags = -1;
+    if (state.output_fd >= 0) {
+        state.output_fd_flags = fcntl(state.output_fd, F_GETFL);
+        if (state.output_fd_flags >= 0)
+            fcntl(state.output_fd, F_SETFL, state.output_fd_flags | O_NONBLOCK);
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = output_fatal_sighandler;
+        action.sa_flags = SA_RESETHAND;
+        static const int fatal_signals[] = {SIGHUP, SIGQUIT, SIGPIPE, SIGABRT, SIGSEGV, SIGBUS};
+        unsigned int i;
+        for (i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); i++)
+            sigaction(fatal_signals[i], &action, NULL);
+    }
+}
+
+static void output_queue_drop_head()
+{
+    free(state.output_queue[state.output_queue_head].data);
+    state.output_queue_head = (state.output_queue_head + 1) % state.output_queue_size;
+    state.output_queue_count--;
+    state.output_queue_offset = 0;
+    state.output_queue_started = 0;
+}
+
+// Write as much of the queue as possible. Returns 1 if it's empty.
+static int output_queue_flush()
+{
+    while (state.output_queue_count > 0) {
+        struct iovec iov[OUTPUT_MAX_IOV];
+        int iovcnt = state.output_queue_count < OUTPUT_MAX_IOV ? state.output_queue_count : OUTPUT_MAX_IOV;
+        int i;
+        for (i = 0; i < iovcnt; i++) {
+            const struct output_chunk *chunk = &state.output_queue[(state.output_queue_head + i) % state.output_queue_size];
+            iov[i].iov_base = chunk->data;
+            iov[i].iov_len = chunk->len;
+        }
+        iov[0].iov_base = (char *) iov[0].iov_base + state.output_queue_offset;
+        iov[0].iov_len -= state.output_queue_offset;
+
+        ssize_t count = writev(state.output_fd, iov, iovcnt);
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return 0;
+            err(EXIT_FAILURE, "Error writing to %s", state.output_filename);
+        }
+        state.stats.bytes_output += count;
+
+        while (count > 0) {
+            size_t left = state.output_queue[state.output_queue_head].len - state.output_queue_offset;
+            if ((size_t) count < left) {
+                state.output_queue_offset += count;
+                state.output_queue_started = 1;
+                break;
+            }
+            count -= left;
+            output_queue_drop_head();
+        }
+    }
+    return 1;
+}
+
+// Queue what's left of a frame after the first skip bytes. When the queue is
+// full, the oldest frame that hasn't been started is dropped.
+static void output_queue_push(const struct iovec *iov, int iovcnt, size_t len, size_t skip)
+{
+    if (state.output_queue_count == state.output_queue_size) {
+        state.stats.dropped_pipe_full++;
+        if (!state.output_queue_started) {
+            output_queue_drop_head();
+        } else if (state.output_queue_size > 1) {
+            // Keep the partly written head and drop the one after it
+            int next = (state.output_queue_head + 1) % state.output_queue_size;
+            free(state.output_queue[next].data);
+            state.output_queue[next] = state.output_queue[state.output_queue_head];
+            state.output_queue_head = next;
+            state.output_queue_count--;
+        } else {
+            return;
+        }
+    }
+
+    struct output_chunk *chunk = &state.output_queue[(state.output_queue_head + state.output_queue_count) % state.output_queue_size];
+    if (skip > 0)
+        state.output_queue_started = 1;
+    chunk->len = len - skip;
+    chunk->data = (char *) malloc(chunk->len);
+    if (!chunk->data)
+        err(EXIT_FAILURE, "malloc");
+    size_t ix = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        memcpy(&chunk->data[ix], (const char *) iov[i].iov_base + skip, iov[i].iov_len - skip);
+        ix += iov[i].iov_len - skip;
+        skip = 0;
+    }
+    state.output_queue_count++;
+    if (state.output_queue_count > state.output_queue_peak)
+        state.output_queue_peak = state.output_queue_count;
+}
+
+// Account for writing a frame to --output and queue whatever didn't fit.
+// error is the errno when count is negative.
+static void output_write_done(const struct iovec *iov, int iovcnt, size_t len, ssize_t count, int error)
+{
+    if (count < 0) {
+        if (error != EAGAIN && error != EINTR) {
+            errno = error;
+            err(EXIT_FAILURE, "Error writing to %s", state.output_filename);
+        }
+        count = 0;
+    }
+    state.stats.bytes_output += count;
+    if ((size_t) count < len)
+        output_queue_push(iov, iovcnt, len, count);
+}
+
+// Write a frame and its framing to --output in one call if possible
+static void output_write(const struct iovec *iov, int iovcnt, size_t len)
+{
+    if (!output_queue_flush()) {
+        output_queue_push(iov, iovcnt, len, 0);
+        return;
+    }
+    ssize_t count = writev(state.output_fd, iov, iovcnt);
+    output_write_done(iov, iovcnt, len, count, errno);
+}
+
+// Finish writing the queue, waiting if necessary, and put the output back
+// the way it was.
+static void output_queue_finish()
+{
+    int was_blocking = state.output_fd_flags >= 0 && !(state.output_fd_flags & O_NONBLOCK);
+    output_restore_flags();
+    if (was_blocking)
+        output_queue_flush();
+    while (state.output_queue_count > 0)
+        output_queue_drop_head();
+    free(state.output_queue);
+    state.output_queue = 0;
+}
+
+// Work out the packet framing flags from the frame itself so that clients
+// don't need to be told. JPEGs are always keyframes. H.264 access units are
+// scanned for their NAL unit types up to the first slice.
+static uint32_t packet_flags(const struct iovec *iov, int iovcnt)
+{
+    const unsigned char *first = (const unsigned char *) iov[0].iov_base;
+    if (iov[0].iov_len >= 2 && first[0] == 0xff && first[1] == 0xd8)
+        return PACKET_FLAG_KEYFRAME;
+
+    uint32_t flags = 0;
+    int zeros = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        const unsigned char *p = (const unsigned char *) iov[i].iov_base;
+        size_t j;
+        for (j = 0; j < iov[i].iov_len; j++) {
+            if (zeros < 0) {
+                // The byte after a start code is the NAL unit header
+                int type = p[j] & 0x1f;
+                if (type == H264_NAL_SPS || type == H264_NAL_PPS)
+                    flags |= PACKET_FLAG_CONFIG;
+                else if (type == H264_NAL_IDR_SLICE)
+                    return flags | PACKET_FLAG_KEYFRAME;
+                else if (type == H264_NAL_SLICE)
+                    return flags;
+                zeros = 0;
+            } else if (p[j] == 0) {
+                zeros++;
+            } else if (p[j] == 1 && zeros >= 2) {
+                zeros = -1;
+            } else {
+                zeros = 0;
+            }
+        }
+    }
+    return flags;
+}
+
+// Size the 'latest' file for slots of at least this size and map it
+static void latest_resize(uint32_t slot_size)
+{
+    if (state.latest) {
+        // Readers in the middle of copying will see this and retry
+        __atomic_store_n(&state.latest->slots[0].generation, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&state.latest->slots[1].generation, 0, __ATOMIC_RELEASE);
+        munmap(state.latest, state.latest_mapped_size);
+    }
+
+    state.latest_mapped_size = LATEST_DATA_OFFSET + 2 * (size_t) slot_size;
+    if (ftruncate(state.output_fd, state.latest_mapped_size) < 0)
+        err(EXIT_FAILURE, "Can't size %s", state.output_filename);
+    state.latest = (struct latest_file *) ring_map(state.output_fd, state.latest_mapped_size, PROT_READ | PROT_WRITE);
+    state.latest->magic = LATEST_MAGIC;
+    __atomic_store_n(&state.latest->slot_size, slot_size, __ATOMIC_RELEASE);
+}
+
+static void latest_publish(const struct iovec *iov, int iovcnt, size_t len, int64_t pts_us)
+{
+    struct latest_file *latest = state.latest;
+    if (len > latest->slot_size) {
+        uint32_t slot_size = latest->slot_size;
+        while (slot_size < len)
+            slot_size *= 2;
+        latest_resize(slot_size);
+        latest = state.latest;
+    }
+
+    uint32_t generation = latest->generation + 1;
+    if (generation == 0)
+        generation = 1;
+    int index = generation & 1;
+    struct latest_slot *slot = &latest->slots[index];
+    __atomic_store_n(&slot->generation, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    char *data = (char *) latest + LATEST_DATA_OFFSET + index * (size_t) latest->slot_size;
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(data, iov[i].iov_base, iov[i].iov_len);
+        data += iov[i].iov_len;
+    }
+    slot->len = len;
+    slot->pts_us = pts_us;
+    __atomic_store_n(&slot->generation, generation, __ATOMIC_RELEASE);
+    __atomic_store_n(&latest->generation, generation, __ATOMIC_RELEASE);
+
+    state.stats.bytes_output += len;
+}
+
+// Make the bytes that go before a frame for the stream framings. Returns
+// the header's length, or -1 if the framing isn't written as a stream (or
+// nothing should be written yet). trailer is set for framings that also
+// have something after the frame.
+static int output_framing(const struct iovec *iov, int iovcnt, int len, int64_t pts_us,
+                          char header[IO_HEADER_MAX], const char **trailer)
+{
+    *trailer = 0;
+    if (strcmp(state.framing, "mime") == 0 ||
+	(state.http_ready_for_images && (strcmp(state.framing, "http") == 0))) {
+        *trailer = mime_boundary;
+        return sprintf(header, mime_multipart_header_format, len);
+    } else if (strcmp(state.framing, "header") == 0) {
+        uint32_t len32 = htonl(len);
+        memcpy(header, &len32, sizeof(len32));
+        return sizeof(len32);
+    } else if (strcmp(state.framing, "packet") == 0) {
+        // Like header, but with the flags and capture time too
+        uint32_t packet[4];
+        packet[0] = htonl(len);
+        packet[1] = htonl(packet_flags(iov, iovcnt));
+        packet[2] = htonl((uint64_t) pts_us >> 32);
+        packet[3] = htonl((uint32_t) pts_us);
+        memcpy(header, packet, sizeof(packet));
+        return sizeof(packet);
+    } else if (strcmp(state.framing, "cat") == 0) {
+        // cat (aka concatenate)
+        return 0;
+    }
+    return -1;
+}
+
+// Put the stream framing around a frame. Returns the number of iovecs in
+// iovs or -1 if the framing isn't written as a stream. header holds the
+// framing's bytes.
+static int output_framed_iov(const struct iovec *iov, int iovcnt, int len, int64_t pts_us,
+                             char header[IO_HEADER_MAX], struct iovec *iovs, size_t *total)
+{
+    const char *trailer;
+    int header_len = output_framing(iov, iovcnt, len, pts_us, header, &trailer);
+    if (header_len < 0)
+        return -1;
+
+    int count = 0;
+    if (header_len) {
+        iovs[count].iov_base = header;
+        iovs[count++].iov_len = header_len;
+    }
+    memcpy(&iovs[count], iov, iovcnt * sizeof(struct iovec));
+    count += iovcnt;
+    *total = header_len + len;
+    if (trailer) {
+        iovs[count].iov_base = (char *) trailer; // silence warning
+        iovs[count++].iov_len = strlen(trailer);
+        *total += strlen(trailer);
+    }
+    return count;
+}
+
+static void output_jpeg_iov(const struct iovec *iov, int iovcnt, int len, int64_t pts_us)
+{
+    if (state.no_output)
+        return;
+
+    if (strcmp(state.framing, "replace") == 0) {
+        // replace the output file with the latest image
+        int fd = open(state.output_tmp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0)
+            err(EXIT_FAILURE, "Can't create %s", state.output_tmp_filename);
+        int count = writev(fd, iov, iovcnt);
+        output_written(count, len, state.output_tmp_filename);
+        close(fd);
+        if (rename(state.output_tmp_filename, state.output_filename) < 0)
+            err(EXIT_FAILURE, "Can't rename %s to %s", state.output_tmp_filename, state.output_filename);
+    } else if (strcmp(state.framing, "latest") == 0) {
+        // Like replace, but without touching the filesystem per frame
+        latest_publish(iov, iovcnt, len, pts_us);
+    } else {
+        char header[IO_HEADER_MAX];
+        struct iovec iovs[FRAME_MAX_SEGMENTS + 2];
+        size_t total;
+        int count = output_framed_iov(iov, iovcnt, len, pts_us, header, iovs, &total);
+        if (count >= 0)
+            output_write(iovs, count, total);
+    }
+}
+
+static void output_io_done(void *owner, enum io_result result, size_t bytes)
+{
+    UNUSED(owner);
+    if (result == io_result_error)
+        errx(EXIT_FAILURE, "Error writing to %s", state.output_filename);
+    state.stats.bytes_output += bytes;
+}
+
+// Server side --output. With --io_threads, the stream framings are written
+// by an I/O thread and frames are dropped if it has output_queue frames
+// that it hasn't gotten to yet. The file framings stay here.
+static void output_submit(const struct iovec *iov, int iovcnt, int len, int64_t pts_us, struct jpeg_frame *frame)
+{
+    char header[IO_HEADER_MAX];
+    const char *trailer;
+    int header_len;
+    if (!state.output_sink || state.no_output ||
+            (header_len = output_framing(iov, iovcnt, len, pts_us, header, &trailer)) < 0) {
+        output_jpeg_iov(iov, iovcnt, len, pts_us);
+        return;
+    }
+    if (!io_sink_submit(state.output_sink, frame, header, header_len, trailer))
+        state.stats.dropped_pipe_full++;
+}
+
+static void output_jpeg(const char *buf, int len, int64_t pts_us)
+{
+    struct iovec iov;
+    iov.iov_base = (char *) buf; // silence warning
+    iov.iov_len = len;
+    output_jpeg_iov(&iov, 1, len, pts_us);
+}
+
+struct jpeg_frame *frame_get(size_t capacity)
+{
+    struct frame_pool *pool = &state.frame_pool;
+    pool->gets++;
+
+    int size_class = 0;
+    while (size_class < FRAME_POOL_CLASSES && ((size_t) 1 << (FRAME_POOL_MIN_SHIFT + size_class)) < capacity)
+        size_class++;
+
+    struct jpeg_frame *frame;
+    if (size_class < FRAME_POOL_CLASSES && pool->free_list[size_class]) {
+        pool->hits++;
+        frame = pool->free_list[size_class];
+        pool->free_list[size_class] = frame->next_free;
+        pool->free_count[size_class]--;
+    } else {
+        if (size_class < FRAME_POOL_CLASSES)
+            capacity = (size_t) 1 << (FRAME_POOL_MIN_SHIFT + size_class);
+        else
+            size_class = -1;
+
+        frame = (struct jpeg_frame *) malloc(sizeof(struct jpeg_frame) + capacity);
+        if (!frame)
+            err(EXIT_FAILURE, "malloc");
+        frame->size_class = size_class;
+        frame->capacity = capacity;
+
+        pool->allocations++;
+        pool->bytes += capacity;
+        if (pool->bytes > pool->peak_bytes)
+            pool->peak_bytes = pool->bytes;
+    }
+
+    frame->refcount = 1;
+    frame->len = 0;
+    frame->next_free = 0;
+    frame->segment_count = 0;
+    return frame;
+}
+
+// Copy a JPEG that's in pieces into a new frame
+struct jpeg_frame *frame_gather(const struct iovec *iov, int iovcnt, size_t capacity)
+{
+    size_t len = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    struct jpeg_frame *frame = frame_get(len > capacity ? len : capacity);
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(&frame->data[frame->len], iov[i].iov_base, iov[i].iov_len);
+        frame->len += iov[i].iov_len;
+    }
+    return frame;
+}
+
+// Return a frame that will hold a source's buffers. These don't need space
+// for data so they aren't pooled. release_segment is called on each buffer
+// when the frame is freed.
+struct jpeg_frame *frame_get_held(void (*release_segment)(void *owner))
+{
+    struct jpeg_frame *frame = (struct jpeg_frame *) malloc(sizeof(struct jpeg_frame));
+    if (!frame)
+        err(EXIT_FAILURE, "malloc");
+    frame->refcount = 1;
+    frame->size_class = -1;
+    frame->len = 0;
+    frame->capacity = 0;
+    frame->next_free = 0;
+    frame->segment_count = 0;
+    frame->release_segment = release_segment;
+    return frame;
+}
+
+// Add a buffer to a held frame. It must have room (see FRAME_MAX_SEGMENTS).
+void frame_hold(struct jpeg_frame *frame, void *owner, const void *data, size_t len)
+{
+    struct frame_segment *segment = &frame->segments[frame->segment_count++];
+    segment->owner = owner;
+    segment->data = data;
+    segment->len = len;
+    frame->len += len;
+}
+
+// Fill in iovs (FRAME_MAX_SEGMENTS long) with where the frame's data is and
+// return how many were used.
+int frame_iov(const struct jpeg_frame *frame, struct iovec *iovs)
+{
+    if (frame->segment_count == 0) {
+        iovs[0].iov_base = (char *) frame->data; // silence warning
+        iovs[0].iov_len = frame->len;
+        return 1;
+    }
+
+    int i;
+    for (i = 0; i < frame->segment_count; i++) {
+        iovs[i].iov_base = (void *) frame->segments[i].data; // silence warning
+        iovs[i].iov_len = frame->segments[i].len;
+    }
+    return frame->segment_count;
+}
+
+struct jpeg_frame *frame_ref(struct jpeg_frame *frame)
+{
+    frame->refcount++;
+    return frame;
+}
+
+void frame_unref(struct jpeg_frame *frame)
+{
+    if (--frame->refcount > 0)
+        return;
+
+    // Give held buffers back to the source to reuse
+    int i;
+    for (i = 0; i < frame->segment_count; i++)
+        frame->release_segment(frame->segments[i].owner);
+
+    struct frame_pool *pool = &state.frame_pool;
+    if (frame->size_class >= 0 && pool->free_count[frame->size_class] < FRAME_POOL_MAX_FREE) {
+        frame->next_free = pool->free_list[frame->size_class];
+        pool->free_list[frame->size_class] = frame;
+        pool->free_count[frame->size_class]++;
+    } else {
+        pool->bytes -= frame->capacity;
+        free(frame);
+    }
+}
+
+// Append data to a frame, moving it to a bigger buffer if necessary. Only
+// call this on frames with one reference that don't hold source buffers.
+void frame_append(struct jpeg_frame **frame, const char *buf, size_t len)
+{
+    struct jpeg_frame *f = *frame;
+    if (f->len + len > f->capacity) {
+        struct jpeg_frame *bigger = frame_get(f->len + len);
+        memcpy(bigger->data, f->data, f->len);
+        bigger->len = f->len;
+        frame_unref(f);
+        *frame = f = bigger;
+    }
+    memcpy(&f->data[f->len], buf, len);
+    f->len += len;
+}
+
+static void frame_pool_destroy()
+{
+    struct frame_pool *pool = &state.frame_pool;
+    int i;
+    for (i = 0; i < FRAME_POOL_CLASSES; i++) {
+        while (pool->free_list[i]) {
+            struct jpeg_frame *frame = pool->free_list[i];
+            pool->free_list[i] = frame->next_free;
+            pool->bytes -= frame->capacity;
+            free(frame);
+        }
+        pool->free_count[i] = 0;
+    }
+}
+
+// Add the part of buf that hasn't been sent yet to an iovec array. skip is the
+// number of bytes already sent and is decremented by what was skipped.
+static void iov_append(struct iovec *iovs, int *iovcnt, const void *buf, size_t len, size_t *skip)
+{
+    if (*skip >= len) {
+        *skip -= len;
+        return;
+    }
+    iovs[*iovcnt].iov_base = (char *) buf + *skip; // silence warning
+    iovs[*iovcnt].iov_len = len - *skip;
+    (*iovcnt)++;
+    *skip = 0;
+}
+
+static int http_client_pending(const struct http_client *c)
+{
+    size_t total = c->out_header_len + c->out_trailer_len;
+    if (c->out_frame)
+        total += c->out_frame->len;
+    return c->out_sent < total;
+}
+
+static void http_client_clear_output(struct http_client *c)
+{
+    free(c->out_header);
+    c->out_header = 0;
+    c->out_header_len = 0;
+    if (c->out_frame)
+        frame_unref(c->out_frame);
+    c->out_frame = 0;
+    c->out_trailer = 0;
+    c->out_trailer_len = 0;
+    c->out_sent = 0;
+}
+
+static void http_client_close(struct http_client *c)
+{
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+    http_client_clear_output(c);
+}
+
+static void http_client_flush(struct http_client *c)
+{
+    while (http_client_pending(c)) {
+        struct iovec iovs[FRAME_MAX_SEGMENTS + 2];
+        int iovcnt = 0;
+        size_t skip = c->out_sent;
+        iov_append(iovs, &iovcnt, c->out_header, c->out_header_len, &skip);
+        if (c->out_frame) {
+            struct iovec frame_iovs[FRAME_MAX_SEGMENTS];
+            int frame_iovcnt = frame_iov(c->out_frame, frame_iovs);
+            int i;
+            for (i = 0; i < frame_iovcnt; i++)
+                iov_append(iovs, &iovcnt, frame_iovs[i].iov_base, frame_iovs[i].iov_len, &skip);
+        }
+        iov_append(iovs, &iovcnt, c->out_trailer, c->out_trailer_len, &skip);
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iovs;
+        msg.msg_iovlen = iovcnt;
+        ssize_t count = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                http_client_close(c);
+
+            // Try again when the socket is writable.
+            return;
+        }
+        c->out_sent += count;
+        state.stats.bytes_http += count;
+    }
+
+    http_client_clear_output(c);
+    if (c->mode == http_client_responding)
+        http_client_close(c);
+}
+
+// Queue a response to the client. The header is freed when sent. The frame is
+// referenced for as long as it takes to send it. The trailer must be static.
+static void http_client_queue(struct http_client *c, char *header, struct jpeg_frame *frame, const char *trailer)
+{
+    http_client_clear_output(c);
+    c->out_header = header;
+    c->out_header_len = header ? strlen(header) : 0;
+    c->out_frame = frame ? frame_ref(frame) : 0;
+    c->out_trailer = trailer;
+    c->out_trailer_len = trailer ? strlen(trailer) : 0;
+    http_client_flush(c);
+}
+
+static void http_client_respond(struct http_client *c, const char *status, const char *headers, struct jpeg_frame *frame)
+{
+    char *header;
+    if (asprintf(&header, "%s%s", status, headers) < 0)
+        err(EXIT_FAILURE, "asprintf");
+    c->mode = http_client_responding;
+    http_client_queue(c, header, frame, 0);
+}
+
+static void http_client_send_snapshot(struct http_client *c, struct jpeg_frame *frame)
+{
+    char content_header[256];
+    sprintf(content_header, http_snapshot_header_format, (int) frame->len);
+    http_client_respond(c, http_ok_response, content_header, frame);
+}
+
+static int http_path_is(const char *path, const char *name)
+{
+    size_t len = strlen(name);
+    return strncmp(path, name, len) == 0 &&
+            (path[len] == ' ' || path[len] == '?');
+}
+
+// Return the stream asked for in the query string (e.g., /video?stream=thumb)
+// or -1 if there's no such stream. The default is the main stream.
+static int http_request_stream(const char *path)
+{
+    const char *end = path + strcspn(path, " ");
+    const char *query = memchr(path, '?', end - path);
+    if (!query)
+        return 0;
+
+    query++;
+    while (query < end) {
+        size_t len = strcspn(query, "& ");
+        if (len > 7 && strncmp(query, "stream=", 7) == 0) {
+            char name[MAX_STREAM_NAME];
+            if (len - 7 >= sizeof(name))
+                return -1;
+            memcpy(name, query + 7, len - 7);
+            name[len - 7] = '\0';
+            return find_stream(name);
+        }
+        query += len;
+        if (*query == '&')
+            query++;
+    }
+    return 0;
+}
+
+static void http_client_handle_request(struct http_client *c)
+{
+    // Respond only to GET requests
+    if (memcmp(c->request, "GET ", 4) != 0) {
+        http_client_respond(c, http_500_response, http_close_response, 0);
+        return;
+    }
+
+    const char *path = &c->request[4];
+    c->stream = http_request_stream(path);
+    if (c->stream < 0 || state.streams[c->stream].config.encoding != stream_encoding_jpeg) {
+        http_client_respond(c, http_404_response, http_close_response, 0);
+    } else if (http_path_is(path, "/") || http_path_is(path, "/index.html")) {
+        // Provide the client with a webpage to load the video
+        http_client_respond(c, http_ok_response, http_index_html_response, 0);
+    } else if (http_path_is(path, "/video")) {
+        char *header;
+        if (asprintf(&header, "%s%s%s", http_ok_response, mime_header, mime_boundary) < 0)
+            err(EXIT_FAILURE, "asprintf");
+        c->mode = http_client_streaming;
+        http_client_queue(c, header, 0, 0);
+    } else if (http_path_is(path, "/snapshot.jpg")) {
+        // Send the most recent frame or wait for the first one
+        struct jpeg_frame *latest_frame = state.streams[c->stream].latest_frame;
+        if (latest_frame)
+            http_client_send_snapshot(c, latest_frame);
+        else
+            c->mode = http_client_waiting_for_snapshot;
+    } else {
+        http_client_respond(c, http_404_response, http_close_response, 0);
+    }
+}
+
+static void http_client_service(struct http_client *c, short revents)
+{
+    if (revents & (POLLERR | POLLNVAL)) {
+        http_client_close(c);
+        return;
+    }
+
+    if (revents & (POLLIN | POLLHUP)) {
+        if (c->mode == http_client_reading_request) {
+            int amount_read = recv(c->fd, &c->request[c->request_ix], MAX_HTTP_REQUEST_SIZE - c->request_ix - 1, 0);
+            if (amount_read <= 0) {
+                if (amount_read == 0 || (errno != EINTR && errno != EAGAIN))
+                    http_client_close(c);
+                return;
+            }
+            c->request_ix += amount_read;
+            c->request[c->request_ix] = '\0';
+
+            if (strstr(c->request, "\r\n\r\n"))
+                http_client_handle_request(c);
+            else if (c->request_ix >= MAX_HTTP_REQUEST_SIZE - 1)
+                http_client_respond(c, http_500_response, http_close_response, 0);
+        } else {
+            // Nothing more is expected from the client, so discard anything
+            // it sends and look for it to close the connection.
+            char discard[256];
+            int amount_read = recv(c->fd, discard, sizeof(discard), 0);
+            if (amount_read == 0 || (amount_read < 0 && errno != EINTR && errno != EAGAIN)) {
+                http_client_close(c);
+                return;
+            }
+        }
+    }
+
+    if (c->fd >= 0 && (revents & POLLOUT))
+        http_client_flush(c);
+}
+
+static void http_server_start()
+{
+    state.http_listen_fd = -1;
+
+    int port = config_int(RASPIJPGS_HTTP_PORT);
+    if (port <= 0)
+        return;
+
+    state.http_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (state.http_listen_fd < 0)
+        err(EXIT_FAILURE, "socket");
+
+    int on = 1;
+    if (setsockopt(state.http_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+        err(EXIT_FAILURE, "setsockopt(SO_REUSEADDR)");
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(state.http_listen_fd, (const struct sockaddr *) &addr, sizeof(addr)) < 0)
+        err(EXIT_FAILURE, "Can't bind to HTTP port %d", port);
+    if (listen(state.http_listen_fd, 16) < 0)
+        err(EXIT_FAILURE, "listen");
+}
+
+static void http_server_accept()
+{
+    for (;;) {
+        int fd = accept4(state.http_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                warn("accept");
+            return;
+        }
+
+        if (state.http_client_count == state.http_client_alloc) {
+            state.http_client_alloc = state.http_client_alloc ? 2 * state.http_client_alloc : 8;
+            state.http_clients = (struct http_client **) realloc(state.http_clients, state.http_client_alloc * sizeof(struct http_client *));
+            if (!state.http_clients)
+                err(EXIT_FAILURE, "realloc");
+        }
+
+        struct http_client *c = (struct http_client *) calloc(1, sizeof(struct http_client));
+        if (!c)
+            err(EXIT_FAILURE, "calloc");
+        c->fd = fd;
+        c->mode = http_client_reading_request;
+        state.http_clients[state.http_client_count++] = c;
+    }
+}
+
+// Fill in the pollfds for the HTTP clients. There must be room for
+// state.http_client_count entries.
+static void http_server_fill_pollfds(struct pollfd *fds)
+{
+    int i;
+    for (i = 0; i < state.http_client_count; i++) {
+        struct http_client *c = state.http_clients[i];
+        fds[i].fd = c->fd;
+        fds[i].events = POLLIN;
+        if (http_client_pending(c))
+            fds[i].events |= POLLOUT;
+        fds[i].revents = 0;
+    }
+}
+
+static void http_server_service(const struct pollfd *fds)
+{
+    int i;
+    for (i = 0; i < state.http_client_count; i++) {
+        if (fds[i].revents && state.http_clients[i]->fd >= 0)
+            http_client_service(state.http_clients[i], fds[i].revents);
+    }
+}
+
+// Free clients that were closed. This is done separately so that clients can
+// be closed from anywhere without disturbing the pollfd indices.
+static void http_server_reap_clients()
+{
+    int i;
+    int j = 0;
+    for (i = 0; i < state.http_client_count; i++) {
+        if (state.http_clients[i]->fd >= 0)
+            state.http_clients[j++] = state.http_clients[i];
+        else
+            free(state.http_clients[i]);
+    }
+    state.http_client_count = j;
+}
+
+static void http_server_stop()
+{
+    int i;
+    for (i = 0; i < state.http_client_count; i++)
+        http_client_close(state.http_clients[i]);
+    http_server_reap_clients();
+    free(state.http_clients);
+    state.http_clients = 0;
+    state.http_client_alloc = 0;
+
+    for (i = 0; i < state.stream_count; i++) {
+        struct stream *s = &state.streams[i];
+        if (s->latest_frame)
+            frame_unref(s->latest_frame);
+        s->latest_frame = 0;
+    }
+
+    if (state.http_listen_fd >= 0)
+        close(state.http_listen_fd);
+    state.http_listen_fd = -1;
+}
+
+static void http_distribute(int stream, struct jpeg_frame *frame)
+{
+    // Clients that are still sending the previous frame skip this one so
+    // that slow clients always get the latest frame and never hold up
+    // anyone else.
+    struct stream *s = &state.streams[stream];
+    if (s->latest_frame)
+        frame_unref(s->latest_frame);
+    s->latest_frame = frame_ref(frame);
+
+    int i;
+    for (i = 0; i < state.http_client_count; i++) {
+        struct http_client *c = state.http_clients[i];
+        if (c->fd < 0 || c->stream != stream)
+            continue;
+
+        if (c->mode == http_client_waiting_for_snapshot) {
+            http_client_send_snapshot(c, frame);
+        } else if (c->mode == http_client_streaming) {
+            if (http_client_pending(c)) {
+                state.stats.http_skipped++;
+                continue;
+            }
+            char *header;
+            if (asprintf(&header, mime_multipart_header_format, (int) frame->len) < 0)
+                err(EXIT_FAILURE, "asprintf");
+            http_client_queue(c, header, frame, mime_boundary);
+        }
+    }
+}
+
+static void subscriber_msg(struct subscriber *sub, const struct iovec *iov, int iovcnt, struct msghdr *msg)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &sub->addr;
+    msg->msg_namelen = sizeof(struct sockaddr_un);
+    msg->msg_iov = (struct iovec *) iov; // silence warning
+    msg->msg_iovlen = iovcnt;
+}
+
+// Account for sending a frame to a datagram client. error is the errno when
+// count is negative. Returns 1 if the frame is done with, 0 if the client's
+// socket is full, and -1 if the client has gone away.
+static int subscriber_sent(struct subscriber *sub, ssize_t count, int error)
+{
+    if (count >= 0) {
+        sub->frames_sent++;
+        state.stats.bytes_socket += count;
+        return 1;
+    }
+
+    switch (error) {
+    case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+    case EWOULDBLOCK:
+#endif
+    case EINTR:
+        return 0;
+
+    case ECONNREFUSED:
+    case ENOENT:
+        return -1;
+
+    case EMSGSIZE:
+        sub->frames_dropped++;
+        state.stats.dropped_oversize++;
+        return 1;
+
+    default:
+        // Anything else only loses this frame
+        sub->frames_dropped++;
+        state.stats.dropped_error++;
+        return 1;
+    }
+}
+
+// Try to send a frame to a datagram client without blocking
+static int subscriber_send(struct subscriber *sub, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    subscriber_msg(sub, iov, iovcnt, &msg);
+    ssize_t count = sendmsg(state.socket_fd, &msg, MSG_DONTWAIT);
+    return subscriber_sent(sub, count, errno);
+}
+
+static void subscriber_enqueue(struct subscriber *sub, struct jpeg_frame *frame)
+{
+    if (sub->queue_count == SUBSCRIBER_QUEUE_SIZE) {
+        // Latest frame wins
+        subscriber_dequeue(sub);
+        sub->frames_dropped++;
+        state.stats.dropped_slow_client++;
+    }
+    sub->queue[(sub->queue_head + sub->queue_count) % SUBSCRIBER_QUEUE_SIZE] = frame_ref(frame);
+    if (sub->queue_count++ == 0)
+        state.subscribers_backlogged++;
+}
+
+// Send as much of a client's queue as its socket will take. Returns -1 if
+// the client was removed.
+static int subscriber_flush(struct subscriber *sub)
+{
+    while (sub->queue_count) {
+        struct iovec iov[FRAME_MAX_SEGMENTS];
+        int iovcnt = frame_iov(sub->queue[sub->queue_head], iov);
+        int rc = subscriber_send(sub, iov, iovcnt);
+        if (rc == 0)
+            return 0;
+        if (rc < 0) {
+            remove_client(sub);
+            return -1;
         }
+        subscriber_dequeue(sub);
     }
+    return 0;
+}
 
-    switch (context) {
-    case config_context_file:
-        opt->set(opt, value, context);
-        break;
+static void subscribers_flush()
+{
+    int i;
+    for (i = state.subscriber_count - 1; i >= 0 && state.subscribers_backlogged; i--) {
+        if (state.subscribers[i]->queue_count)
+            subscriber_flush(state.subscribers[i]);
+    }
+}
 
-    case config_context_client_request:
-        opt->set(opt, value, context);
-        if (opt->apply)
-            opt->apply(opt, context);
-        break;
+// Return a reference counted frame for the JPEG being distributed. If the
+// JPEG isn't already in one, it's copied the first time that it's needed.
+static struct jpeg_frame *frame_for(struct jpeg_frame **frame, const struct iovec *iov, int iovcnt)
+{
+    if (!*frame)
+        *frame = frame_gather(iov, iovcnt, 0);
+    return *frame;
+}
 
+static void subscriber_io_done(void *owner, enum io_result result, size_t bytes)
+{
+    struct subscriber *sub = (struct subscriber *) owner;
+    switch (result) {
+    case io_result_sent:
+        sub->frames_sent++;
+        state.stats.bytes_socket += bytes;
+        break;
+    case io_result_oversize:
+        sub->frames_dropped++;
+        state.stats.dropped_oversize++;
+        break;
+    case io_result_gone:
+        remove_client(sub);
+        break;
     default:
-        // Ignore
+        sub->frames_dropped++;
+        state.stats.dropped_error++;
         break;
     }
-    free(str);
 }
 
-static void load_config_file()
+// Hand a frame to the client's I/O thread. If the client already has
+// SUBSCRIBER_QUEUE_SIZE frames in flight, this one is dropped since the
+// ones ahead of it can't be taken back.
+static void subscriber_submit(struct subscriber *sub, struct jpeg_frame *frame)
 {
-    if (!state.config_filename)
-        return;
+    if (!sub->sink)
+        sub->sink = io_sink_open(state.socket_fd, &sub->addr, SUBSCRIBER_QUEUE_SIZE, subscriber_io_done, sub);
+    if (!io_sink_submit(sub->sink, frame, 0, 0, 0)) {
+        sub->frames_dropped++;
+        state.stats.dropped_slow_client++;
+    }
+}
 
-    FILE *fp = fopen(state.config_filename, "r");
-    if (!fp)
-        err(EXIT_FAILURE, "Cannot open '%s'", state.config_filename);
+// A frame's sends and write that are batched with io_uring. What the
+// operations point to lives here until uring_submit() returns.
+#define FANOUT_OUTPUT 0 // user_data for the --output write. Otherwise, it's the subscriber.
+struct fanout
+{
+    const struct iovec *iov;
+    int iovcnt;
+    struct jpeg_frame **frame;
 
-    char line[128];
-    while (fgets(line, sizeof(line), fp))
-        parse_config_line(line, config_context_file);
+    char header[IO_HEADER_MAX];
+    struct iovec output_iov[FRAME_MAX_SEGMENTS + 2];
+    int output_iovcnt;
+    size_t output_len;
+};
 
-    fclose(fp);
+static void fanout_complete(uint64_t user_data, int result, void *context)
+{
+    struct fanout *fan = (struct fanout *) context;
+    ssize_t count = result < 0 ? -1 : result;
+    if (user_data == FANOUT_OUTPUT) {
+        output_write_done(fan->output_iov, fan->output_iovcnt, fan->output_len, count, -result);
+        return;
+    }
+
+    struct subscriber *sub = (struct subscriber *) (uintptr_t) user_data;
+    int rc = subscriber_sent(sub, count, -result);
+    if (rc == 0)
+        subscriber_enqueue(sub, frame_for(fan->frame, fan->iov, fan->iovcnt));
+    else if (rc < 0)
+        remove_client(sub);
 }
 
-static void remove_server_lock()
+// Subscribers that get removed while the batch is submitted early have all
+// been visited already, so this is safe in distribute_jpeg()'s loop.
+static void fanout_send(struct fanout *fan, struct subscriber *sub)
 {
-    unlink(state.lock_filename);
+    struct msghdr msg;
+    subscriber_msg(sub, fan->iov, fan->iovcnt, &msg);
+    while (!uring_sendmsg(state.socket_fd, &msg, MSG_DONTWAIT, (uintptr_t) sub))
+        uring_submit(fan);
 }
 
-// Return 0 if a server's running; 1 if we are the server now
-static int acquire_server_lock()
+// Returns 0 if the output isn't a stream and should be handled as usual
+static int fanout_output(struct fanout *fan, int len, int64_t pts_us)
 {
-    // This lock isn't meant to protect against race conditions. It's just meant
-    // to provide a better error message if the user accidentally starts up a
-    // second server.
-    const char *lockfile = getenv(RASPIJPGS_LOCKFILE);
-    FILE *fp = fopen(lockfile, "r");
-    if (fp) {
-        char server_pid_str[16];
-        pid_t server_pid;
+    if (state.no_output)
+        return 0;
+    fan->output_iovcnt = output_framed_iov(fan->iov, fan->iovcnt, len, pts_us,
+                                           fan->header, fan->output_iov, &fan->output_len);
+    if (fan->output_iovcnt < 0)
+        return 0;
 
-        // Check that there's a process behind the pid in the lock file.
-        if (fgets(server_pid_str, sizeof(server_pid_str), fp) != NULL &&
-            (server_pid = strtoul(server_pid_str, NULL, 10)) != 0 &&
-            server_pid > 0 &&
-            kill(server_pid, 0) == 0) {
-            // Yes, so we can't be a server.
-            fclose(fp);
-            return 0;
+    if (!output_queue_flush())
+        output_queue_push(fan->output_iov, fan->output_iovcnt, fan->output_len, 0);
+    else {
+        while (!uring_writev(state.output_fd, fan->output_iov, fan->output_iovcnt, FANOUT_OUTPUT))
+            uring_submit(fan);
+    }
+    return 1;
+}
+
+static void distribute_jpeg(int stream, const struct iovec *iov, int iovcnt, size_t len, struct jpeg_frame *held_frame,
+                            const struct frame_timing *timing)
+{
+    // Give back frames that the I/O threads are done with first. This can
+    // remove clients.
+    if (io_workers_enabled())
+        io_workers_reap();
+
+    struct jpeg_frame *frame = held_frame ? frame_ref(held_frame) : 0;
+    struct fanout fan;
+    fan.iov = iov;
+    fan.iovcnt = iovcnt;
+    fan.frame = &frame;
+
+    // Send the JPEG to all of the stream's clients without blocking. Clients
+    // using the frame ring share one copy and only get a wakeup. Clients
+    // whose sockets are full get the frame queued.
+    int ring_published = 0;
+    int i;
+    for (i = state.subscriber_count - 1; i >= 0; i--) {
+        struct subscriber *sub = state.subscribers[i];
+        if (sub->stream != stream)
+            continue;
+        if (!pacer_due(&sub->pacer, timing->capture_us)) {
+            sub->frames_skipped++;
+            continue;
         }
 
-        fclose(fp);
+        if (sub->ring_eventfd >= 0) {
+            if (!ring_published) {
+                ring_publish(&state.streams[stream], iov, iovcnt, len, timing->capture_us);
+                ring_published = 1;
+            }
+            // The wakeup is what sends the frame. The counter only fills up
+            // if the client has stopped reading.
+            uint64_t one = 1;
+            if (write(sub->ring_eventfd, &one, sizeof(one)) >= 0)
+                sub->frames_sent++;
+            else if (errno == EAGAIN)
+                sub->frames_dropped++;
+            else
+                remove_client(sub);
+            continue;
+        }
+
+        if (io_workers_enabled()) {
+            subscriber_submit(sub, frame_for(&frame, iov, iovcnt));
+            continue;
+        }
+
+        // Keep frames in order by sending anything already queued first
+        if (subscriber_flush(sub) < 0)
+            continue;
+
+        if (sub->queue_count == 0) {
+            if (uring_enabled()) {
+                fanout_send(&fan, sub);
+                continue;
+            }
+            int rc = subscriber_send(sub, iov, iovcnt);
+            if (rc > 0)
+                continue;
+            if (rc < 0) {
+                remove_client(sub);
+                continue;
+            }
+        }
+        subscriber_enqueue(sub, frame_for(&frame, iov, iovcnt));
     }
 
-    fp = fopen(lockfile, "w");
-    if (!fp)
-        err(EXIT_FAILURE, "Can't open lock file '%s'", lockfile);
+    // Send it to web browsers
+    if (state.http_listen_fd >= 0)
+        http_distribute(stream, frame_for(&frame, iov, iovcnt));
 
-    if (fprintf(fp, "%d", getpid()) < 0)
-        err(EXIT_FAILURE, "Can't write to '%s'", lockfile);
-    fclose(fp);
+    // Queue it for the recorder's writer thread
+    if (stream == state.record_stream)
+        recorder_record(frame_for(&frame, iov, iovcnt), timing->capture_us,
+                        packet_flags(iov, iovcnt) & PACKET_FLAG_KEYFRAME);
 
-    // Record the name of the lock file that we used so that it
-    // can be removed automatically on termination.
-    state.lock_filename = strdup(lockfile);
-    atexit(remove_server_lock);
+    // With io_uring, the output is written in the same batch as the sends
+    int output_batched = 0;
+    if (stream == state.output_stream && uring_enabled())
+        output_batched = fanout_output(&fan, len, timing->capture_us);
+    uring_submit(&fan);
+    int64_t fanout_done_us = monotonic_us();
 
-    return 1;
+    // Handle it ourselves
+    if (stream == state.output_stream) {
+        if (state.output_sink)
+            output_submit(iov, iovcnt, len, timing->capture_us, frame_for(&frame, iov, iovcnt));
+        else if (!output_batched)
+            output_jpeg_iov(iov, iovcnt, len, timing->capture_us);
+        latency_record_frame(timing, fanout_done_us, monotonic_us());
+    } else
+        latency_record_frame(timing, fanout_done_us, 0);
+
+    if (frame)
+        frame_unref(frame);
+    io_workers_wake();
 }
 
-static void add_client(const struct sockaddr_un *client_addr)
+static void count_frame(struct stream *s, size_t len)
 {
-    int i;
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        if (state.client_addrs[i].sun_family == 0) {
-            state.client_addrs[i] = *client_addr;
-            return;
-        }
+    s->frames++;
+    s->bytes += len;
+
+    int64_t now = monotonic_us();
+    s->fps_interval_frames++;
+    if (now - s->fps_interval_start_us >= FPS_INTERVAL_US) {
+        if (s->fps_interval_start_us)
+            s->current_fps = 1000000.0 * s->fps_interval_frames / (now - s->fps_interval_start_us);
+        s->fps_interval_start_us = now;
+        s->fps_interval_frames = 0;
     }
-    warnx("Reached max number of clients (%d)", MAX_CLIENTS);
 }
 
-static void term_sighandler(int signum)
+static void motion_init()
 {
-    UNUSED(signum);
-    // Capture no more frames.
-    state.count = 0;
+    struct motion_tracker *m = &state.motion;
+    memset(m, 0, sizeof(*m));
+    m->threshold = config_double(RASPIJPGS_MOTION);
+    m->hold_us = (int64_t) (config_double(RASPIJPGS_MOTION_HOLD) * 1000000);
+    m->gate = m->threshold > 0 && config_on(RASPIJPGS_MOTION_GATE);
+    m->idle_fps = config_double(RASPIJPGS_MOTION_IDLE_FPS);
+
+    int i;
+    for (i = 0; i < state.stream_count; i++)
+        pacer_init(&state.streams[i].idle_pacer, m->idle_fps);
+    motion_reset();
 }
 
-static void cleanup_server()
+int motion_enabled()
 {
-    close(state.socket_fd);
-    unlink(state.server_addr.sun_path);
+    return state.motion.threshold > 0;
 }
 
-static void camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+void deliver_luma(const uint8_t *luma, int stride, int64_t capture_us)
 {
-    // This is called from another thread. Don't access any data here.
-    UNUSED(port);
+    struct motion_tracker *m = &state.motion;
+    m->score = motion_score(luma, stride);
+    m->images++;
+    if (m->score >= m->threshold) {
+        if (!m->active)
+            m->events++;
+        m->active = 1;
+        m->last_motion_us = capture_us;
 
-    if (buffer->cmd == MMAL_EVENT_ERROR)
-       errx(EXIT_FAILURE, "No data received from sensor. Check all connections, including the Sunny one on the camera board");
-    else if(buffer->cmd != MMAL_EVENT_PARAMETER_CHANGED)
-        errx(EXIT_FAILURE, "Camera sent invalid data: 0x%08x", buffer->cmd);
+        // Record it if event recording is on
+        recorder_trigger();
+    } else if (m->active && capture_us - m->last_motion_us > m->hold_us) {
+        m->active = 0;
+    }
 
-    mmal_buffer_header_release(buffer);
+    // Tell the clients that asked. Dropping a score is fine since another
+    // comes with the next frame.
+    char message[64];
+    int len = snprintf(message, sizeof(message), "motion\n%lld %.1f %d\n",
+                       (long long) capture_us, m->score, m->active);
+    int i;
+    for (i = 0; i < state.subscriber_count; i++) {
+        const struct subscriber *sub = state.subscribers[i];
+        if (sub->motion_events)
+            sendto(state.socket_fd, message, len, MSG_DONTWAIT,
+                   (const struct sockaddr *) &sub->addr, sizeof(struct sockaddr_un));
+    }
 }
 
-static void output_jpeg(const char *buf, int len)
+// With --motion_gate, frames without motion are dropped or slowed down to
+// --motion_idle_fps.
+static int motion_gated(struct stream *s, int64_t capture_us)
 {
-    if (state.no_output)
-        return;
-
-    if (strcmp(state.framing, "mime") == 0 ||
-	(state.http_ready_for_images && (strcmp(state.framing, "http") == 0))) {
-        char multipart_header[256];
-        int multipart_header_len =
-            sprintf(multipart_header, mime_multipart_header_format, len);
-
-        struct iovec iovs[3];
-        iovs[0].iov_base = multipart_header;
-        iovs[0].iov_len = multipart_header_len;
-        iovs[1].iov_base = (char *) buf; // silence warning
-        iovs[1].iov_len = len;
-        iovs[2].iov_base = (char *) mime_boundary; // silence warning
-        iovs[2].iov_len = strlen(mime_boundary);
-        int count = writev(state.output_fd, iovs, 3);
-        if (count < 0)
-            err(EXIT_FAILURE, "Error writing to %s", state.output_filename);
-        else if (count != iovs[0].iov_len + iovs[1].iov_len + iovs[2].iov_len)
-            warnx("Unexpected truncation of JPEG when writing to %s", state.output_filename);
-    } else if (strcmp(state.framing, "header") == 0) {
-        struct iovec iovs[2];
-        uint32_t len32 = htonl(len);
-        iovs[0].iov_base = &len32;
-        iovs[0].iov_len = sizeof(int32_t);
-        iovs[1].iov_base = (char *) buf; // silence warning
-        iovs[1].iov_len = len;
-        int count = writev(state.output_fd, iovs, 2);
-        if (count < 0)
-            err(EXIT_FAILURE, "Error writing to %s", state.output_filename);
-        else if (count != iovs[0].iov_len + iovs[1].iov_len)
-            warnx("Unexpected truncation of JPEG when writing to %s", state.output_filename);
-    } else if (strcmp(state.framing, "replace") == 0) {
-        // replace the output file with the latest image
-        int fd = open(state.output_tmp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
-        if (fd < 0)
-            err(EXIT_FAILURE, "Can't create %s", state.output_tmp_filename);
-        int count = write(fd, buf, len);
-        if (count < 0)
-            err(EXIT_FAILURE, "Error writing to %s", state.output_tmp_filename);
-        else if (count != len)
-            warnx("Unexpected truncation of JPEG when writing to %s", state.output_tmp_filename);
-        close(fd);
-        if (rename(state.output_tmp_filename, state.output_filename) < 0)
-            err(EXIT_FAILURE, "Can't rename %s to %s", state.output_tmp_filename, state.output_filename);
-    } else if (strcmp(state.framing, "cat") == 0) {
-        // cat (aka concatenate)
-        // TODO - Loop to make sure that everything is written.
-        int count = write(state.output_fd, buf, len);
-        if (count < 0)
-            err(EXIT_FAILURE, "Error writing to %s", state.output_filename);
-        else if (count != len)
-            warnx("Unexpected truncation of JPEG when writing to %s", state.output_filename);
-    }
+    // Motion is only detected on the first camera
+    const struct motion_tracker *m = &state.motion;
+    if (!m->gate || m->active || s->config.camera != 0)
+        return 0;
+    return m->idle_fps <= 0 || !pacer_due(&s->idle_pacer, capture_us);
 }
 
-static void distribute_jpeg(const char *buf, size_t len)
+void deliver_jpeg(int stream, const struct iovec *iov, int iovcnt, size_t len, struct jpeg_frame *frame,
+                  const struct frame_timing *timing)
 {
-    // Send the JPEG to all of our clients
-    size_t i;
-    for (i = 0; i < MAX_CLIENTS; i++) {
-        if (state.client_addrs[i].sun_family) {
-            if (sendto(state.socket_fd, buf, len, 0, &state.client_addrs[i], sizeof(struct sockaddr_un)) < 0) {
-                // If failure, then remove client.
-                state.client_addrs[i].sun_family = 0;
-            }
-        }
+    struct stream *s = &state.streams[stream];
+    if (state.reconfig_started_us && timing->capture_us >= state.reconfig_started_us) {
+        int64_t gap_us = timing->arrival_us - state.reconfig_gap_start_us;
+        state.stats.reconfigurations++;
+        state.stats.reconfig_last_gap_us = gap_us;
+        if (gap_us > state.stats.reconfig_max_gap_us)
+            state.stats.reconfig_max_gap_us = gap_us;
+        state.reconfig_started_us = 0;
     }
+    state.last_delivery_us = timing->arrival_us;
 
-    // Handle it ourselves
-    output_jpeg(buf, len);
+    if (motion_gated(s, timing->capture_us)) {
+        state.motion.gated++;
+        return;
+    }
+    if (!pacer_due(&s->pacer, timing->capture_us)) {
+        s->skipped++;
+        return;
+    }
+
+    count_frame(s, len);
+    distribute_jpeg(stream, iov, iovcnt, len, frame, timing);
+
+    // --count is for the frames that we output
+    if (stream == state.output_stream && state.count > 0)
+        state.count--;
 }
 
-static void recycle_jpegencoder_buffer(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+void source_reconfiguring()
 {
-    mmal_buffer_header_release(buffer);
-
-    if (port->is_enabled) {
-        MMAL_BUFFER_HEADER_T *new_buffer;
+    // Another change before a frame arrives extends the same gap
+    if (!state.reconfig_started_us)
+        state.reconfig_gap_start_us = state.last_delivery_us ? state.last_delivery_us : monotonic_us();
+    state.reconfig_started_us = monotonic_us();
+}
 
-        if (!(new_buffer = mmal_queue_get(state.pool_jpegencoder->queue)) ||
-             mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS)
-            errx(EXIT_FAILURE, "Could not send buffers to port");
-    }
+int source_wants_frames()
+{
+    return state.count != 0;
 }
 
-static void jpegencoder_buffer_callback_impl()
+int frame_timer_create()
 {
-    void *msg[2];
-    if (read(state.mmal_callback_pipe[0], msg, sizeof(msg)) != sizeof(msg))
-        err(EXIT_FAILURE, "read from internal pipe broke");
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        err(EXIT_FAILURE, "timerfd_create");
+    frame_timer_set(fd);
+    return fd;
+}
 
-    MMAL_PORT_T *port = (MMAL_PORT_T *) msg[0];
-    MMAL_BUFFER_HEADER_T *buffer = (MMAL_BUFFER_HEADER_T *) msg[1];
+void frame_timer_set(int fd)
+{
+    double fps = config_double(RASPIJPGS_FPS);
+    if (fps <= 0)
+        fps = 30;
 
-    mmal_buffer_header_mem_lock(buffer);
+    int64_t interval_ns = (int64_t) (1000000000.0 / fps);
+    struct itimerspec its;
+    its.it_interval.tv_sec = interval_ns / 1000000000;
+    its.it_interval.tv_nsec = interval_ns % 1000000000;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(fd, 0, &its, 0) < 0)
+        err(EXIT_FAILURE, "timerfd_settime");
+}
 
-    if (state.socket_buffer_ix == 0 &&
-            (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) &&
-            buffer->length <= MAX_DATA_BUFFER_SIZE) {
-        // Easy case: JPEG all in one buffer
-        distribute_jpeg((const char *) buffer->data, buffer->length);
-    } else {
-        // Hard case: assemble JPEG
-        if (state.socket_buffer_ix + buffer->length > MAX_DATA_BUFFER_SIZE) {
-            if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) {
-                state.socket_buffer_ix = 0;
-            } else if (state.socket_buffer_ix != MAX_DATA_BUFFER_SIZE) {
-                // Warn when frame crosses threshold
-                warnx("Frame too large (%d bytes). Dropping. Adjust MAX_DATA_BUFFER_SIZE.", state.socket_buffer_ix + buffer->length);
-                state.socket_buffer_ix = MAX_DATA_BUFFER_SIZE;
-            }
-        } else {
-            memcpy(&state.socket_buffer[state.socket_buffer_ix], buffer->data, buffer->length);
-            state.socket_buffer_ix += buffer->length;
-            if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) {
-                distribute_jpeg(state.socket_buffer, state.socket_buffer_ix);
-                state.socket_buffer_ix = 0;
-            }
-        }
+uint64_t frame_timer_read(int fd)
+{
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            err(EXIT_FAILURE, "read from frame timer");
+        return 0;
     }
-
-    mmal_buffer_header_mem_unlock(buffer);
-
-    if (state.count >= 0)
-        state.count--;
-
-    //cam_set_annotation();
-
-    recycle_jpegencoder_buffer(port, buffer);
+    return expirations;
 }
 
-static void jpegencoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+static const struct frame_source *find_source(const char *name)
 {
-    // If the buffer contains something, notify our main thread to process it.
-    // If not, recycle it.
-    if (buffer->length) {
-        void *msg[2];
-        msg[0] = port;
-        msg[1] = buffer;
-        if (write(state.mmal_callback_pipe[1], msg, sizeof(msg)) != sizeof(msg))
-            err(EXIT_FAILURE, "write to internal pipe broke");
-    } else {
-        recycle_jpegencoder_buffer(port, buffer);
+    const struct frame_source **source;
+    for (source = sources; *source; source++) {
+        if (strcmp((*source)->name, name) == 0)
+            return *source;
     }
+    errx(EXIT_FAILURE, "Unknown source '%s'. Check help", name);
 }
 
-static void find_sensor_dimensions(int camera_ix, int *imager_width, int *imager_height)
+static int find_stream(const char *name)
 {
-    MMAL_COMPONENT_T *camera_info;
+    int i;
+    for (i = 0; i < state.stream_count; i++) {
+        if (strcmp(state.streams[i].config.name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// The main stream comes from the regular options. Extra streams are listed
+// in --streams as name:width[xheight][:quality[:fps[:encoding[:camera]]]]
+// separated by commas. The first stream listed for each camera after the
+// first is that camera's main stream.
+static void streams_init()
+{
+    struct stream_config *main_config = &state.streams[0].config;
+    strcpy(main_config->name, "main");
+    main_config->encoding = stream_encoding_jpeg;
+    main_config->width = config_int(RASPIJPGS_WIDTH);
+    main_config->height = config_int(RASPIJPGS_HEIGHT);
+    main_config->quality = config_int(RASPIJPGS_QUALITY);
+    main_config->fps = 0; // The source runs at --fps
+    main_config->camera = 0;
+    state.stream_count = 1;
+    state.camera_count = 1;
+    state.camera_main_stream[0] = 0;
+
+    char *defs = strdup(config_string(RASPIJPGS_STREAMS));
+    char *saveptr;
+    char *def;
+    for (def = strtok_r(defs, ",", &saveptr); def; def = strtok_r(0, ",", &saveptr)) {
+        trim_whitespace(def);
+        if (state.stream_count == MAX_STREAMS)
+            errx(EXIT_FAILURE, "Too many streams. The limit is %d", MAX_STREAMS);
+
+        char *fields = strdup(def);
+        char *rest = fields;
+        const char *name = strsep(&rest, ":");
+        const char *size = strsep(&rest, ":");
+        const char *quality = strsep(&rest, ":");
+        const char *fps = strsep(&rest, ":");
+        const char *encoding = strsep(&rest, ":");
+        const char *camera = strsep(&rest, ":");
+
+        struct stream_config *config = &state.streams[state.stream_count].config;
+        config->height = 0;
+        config->encoding = stream_encoding_jpeg;
+        if (encoding && strcmp(encoding, "h264") == 0)
+            config->encoding = stream_encoding_h264;
+        config->camera = camera && *camera ? strtol(camera, 0, 0) : 0;
+        if (*name == '\0' || strlen(name) >= MAX_STREAM_NAME || find_stream(name) >= 0 ||
+                !size || sscanf(size, "%dx%d", &config->width, &config->height) < 1 ||
+                config->width <= 0 || rest ||
+                (encoding && *encoding && strcmp(encoding, "jpeg") != 0 && strcmp(encoding, "h264") != 0) ||
+                config->camera < 0 || config->camera >= MAX_CAMERAS)
+            errx(EXIT_FAILURE, "Invalid stream '%s'. Use name:width[xheight][:quality[:fps[:jpeg|h264[:camera]]]]", def);
+
+        strcpy(config->name, name);
+        config->quality = quality && *quality ? strtol(quality, 0, 0) : main_config->quality;
+        config->fps = fps && *fps ? strtod(fps, 0) : 0;
+        if (config->camera >= state.camera_count) {
+            if (config->camera > state.camera_count)
+                errx(EXIT_FAILURE, "Camera %d needs a stream before camera %d does. Check --streams",
+                     state.camera_count, config->camera);
+            state.camera_main_stream[config->camera] = state.stream_count;
+            state.camera_count++;
+        }
+        state.stream_count++;
+        free(fields);
+    }
+    free(defs);
 
-    // Default to OV5647 full resolution
-    *imager_width = 2592;
-    *imager_height = 1944;
+    int i;
+    for (i = 0; i < state.stream_count; i++)
+        pacer_init(&state.streams[i].pacer, state.streams[i].config.fps);
 
-    // Try to get the camera name and maximum supported resolution
-    MMAL_STATUS_T status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA_INFO, &camera_info);
-    if (status == MMAL_SUCCESS) {
-        MMAL_PARAMETER_CAMERA_INFO_T param;
-        param.hdr.id = MMAL_PARAMETER_CAMERA_INFO;
-        param.hdr.size = sizeof(param)-4;  // Deliberately undersize to check firmware version
-        status = mmal_port_parameter_get(camera_info->control, &param.hdr);
+    state.output_stream = find_stream(state.stream_name);
+    if (state.output_stream < 0)
+        errx(EXIT_FAILURE, "Unknown stream '%s'. Check --streams", state.stream_name);
+    if (state.streams[state.output_stream].config.encoding == stream_encoding_h264 &&
+            strcmp(state.framing, "cat") != 0 &&
+            strcmp(state.framing, "header") != 0 &&
+            strcmp(state.framing, "packet") != 0)
+        errx(EXIT_FAILURE, "H.264 streams can only be output with cat, header or packet framing");
+}
 
-        if (status != MMAL_SUCCESS) {
-            // Running on newer firmware
-            param.hdr.size = sizeof(param);
-            status = mmal_port_parameter_get(camera_info->control, &param.hdr);
-            if (status == MMAL_SUCCESS && param.num_cameras > camera_ix) {
-                // Take the parameters from the first camera listed.
-                *imager_width = param.cameras[camera_ix].max_width;
-                *imager_height = param.cameras[camera_ix].max_height;
-            } else
-                warnx("Cannot read camera info, keeping the defaults for OV5647");
-        } else {
-            // Older firmware
-            // Nothing to do here, keep the defaults for OV5647
-        }
+int stream_count()
+{
+    return state.stream_count;
+}
 
-        mmal_component_destroy(camera_info);
-    } else {
-        warnx("Failed to create camera_info component");
-    }
-}
-
-void start_all()
-{
-    // Find out which Raspberry Camera is attached for the defaults
-    int imager_width;
-    int imager_height;
-    find_sensor_dimensions(0, &imager_width, &imager_height);
-
-    //
-    // create camera
-    //
-    if (mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &state.camera) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not create camera");
-    if (mmal_port_enable(state.camera->control, camera_control_callback) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not enable camera control port");
-
-    int fps100 = lrint(100.0 * strtod(getenv(RASPIJPGS_FPS), 0));
-    int width = strtol(getenv(RASPIJPGS_WIDTH), 0, 0);
-    if (width <= 0)
-        width = 320;
-    else if (width > imager_width)
-        width = imager_width;
-    width = width & ~0xf; // Force to multiple of 16 for JPEG encoder
-    int height = strtol(getenv(RASPIJPGS_HEIGHT), 0, 0);
-    if (height <= 0)
-        height = imager_height * width / imager_width; // Default to the camera's aspect ratio
-    else if (height > imager_height)
-        height = imager_height;
-    height = height & ~0xf;
-
-    // TODO: The fact that this seems to work implies that there's a scaler
-    //       in the camera block and we don't need a resizer??
-    int video_width = width;
-    int video_height = height;
-
-    MMAL_PARAMETER_CAMERA_CONFIG_T cam_config = {
-        {MMAL_PARAMETER_CAMERA_CONFIG, sizeof(cam_config)},
-        .max_stills_w = 0,
-        .max_stills_h = 0,
-        .stills_yuv422 = 0,
-        .one_shot_stills = 0,
-        .max_preview_video_w = imager_width,
-        .max_preview_video_h = imager_height,
-        .num_preview_video_frames = 3,
-        .stills_capture_circular_buffer_height = 0,
-        .fast_preview_resume = 0,
-        .use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RESET_STC
-    };
-    if (mmal_port_parameter_set(state.camera->control, &cam_config.hdr) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Error configuring camera");
-
-    MMAL_ES_FORMAT_T *format = state.camera->output[0]->format;
-    format->es->video.width = video_width;
-    format->es->video.height = video_height;
-    format->es->video.crop.x = 0;
-    format->es->video.crop.y = 0;
-    format->es->video.crop.width = video_width;
-    format->es->video.crop.height = video_height;
-    format->es->video.frame_rate.num = fps100;
-    format->es->video.frame_rate.den = 100;
-    if (mmal_port_format_commit(state.camera->output[0]) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set preview format");
-
-    if (mmal_component_enable(state.camera) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not enable camera");
-
-    //
-    // create jpeg-encoder
-    //
-    MMAL_STATUS_T status = mmal_component_create(MMAL_COMPONENT_DEFAULT_IMAGE_ENCODER, &state.jpegencoder);
-    if (status != MMAL_SUCCESS && status != MMAL_ENOSYS)
-        errx(EXIT_FAILURE, "Could not create image encoder");
-
-    state.jpegencoder->output[0]->format->encoding = MMAL_ENCODING_JPEG;
-    state.jpegencoder->output[0]->buffer_size = state.jpegencoder->output[0]->buffer_size_recommended;
-    if (state.jpegencoder->output[0]->buffer_size < state.jpegencoder->output[0]->buffer_size_min)
-        state.jpegencoder->output[0]->buffer_size = state.jpegencoder->output[0]->buffer_size_min;
-    state.jpegencoder->output[0]->buffer_num = state.jpegencoder->output[0]->buffer_num_recommended;
-    if(state.jpegencoder->output[0]->buffer_num < state.jpegencoder->output[0]->buffer_num_min)
-        state.jpegencoder->output[0]->buffer_num = state.jpegencoder->output[0]->buffer_num_min;
-    if (mmal_port_format_commit(state.jpegencoder->output[0]) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set image format");
-
-    int quality = strtol(getenv(RASPIJPGS_QUALITY), 0, 0);
-    if (mmal_port_parameter_set_uint32(state.jpegencoder->output[0], MMAL_PARAMETER_JPEG_Q_FACTOR, quality) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set jpeg quality to %d", quality);
-
-    // Set the JPEG restart interval
-    int restart_interval = strtol(getenv(RASPIJPGS_RESTART_INTERVAL), 0, 0);
-    if (mmal_port_parameter_set_uint32(state.jpegencoder->output[0], MMAL_PARAMETER_JPEG_RESTART_INTERVAL, restart_interval) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Unable to set JPEG restart interval");
-
-    if (mmal_port_parameter_set_boolean(state.jpegencoder->output[0], MMAL_PARAMETER_EXIF_DISABLE, 1) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not turn off EXIF");
-
-    if (mmal_component_enable(state.jpegencoder) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not enable image encoder");
-    state.pool_jpegencoder = mmal_port_pool_create(state.jpegencoder->output[0], state.jpegencoder->output[0]->buffer_num, state.jpegencoder->output[0]->buffer_size);
-    if (!state.pool_jpegencoder)
-        errx(EXIT_FAILURE, "Could not create image buffer pool");
-
-    //
-    // create image-resizer
-    //
-    status = mmal_component_create("vc.ril.resize", &state.resizer);
-    if (status != MMAL_SUCCESS && status != MMAL_ENOSYS)
-        errx(EXIT_FAILURE, "Could not create image resizer");
-
-    format = state.resizer->output[0]->format;
-    format->es->video.width = width;
-    format->es->video.height = height;
-    format->es->video.crop.x = 0;
-    format->es->video.crop.y = 0;
-    format->es->video.crop.width = width;
-    format->es->video.crop.height = height;
-    format->es->video.frame_rate.num = fps100;
-    format->es->video.frame_rate.den = 1;
-    if (mmal_port_format_commit(state.resizer->output[0]) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not set image resizer output");
-
-    if (mmal_component_enable(state.resizer) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not enable image resizer");
-
-    //
-    // connect
-    //
-    if (mmal_connection_create(&state.con_cam_res, state.camera->output[0], state.resizer->input[0], MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not create connection camera -> resizer");
-    if (mmal_connection_enable(state.con_cam_res) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not enable connection camera -> resizer");
-
-    if (mmal_connection_create(&state.con_res_jpeg, state.resizer->output[0], state.jpegencoder->input[0], MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not create connection resizer -> encoder");
-    if (mmal_connection_enable(state.con_res_jpeg) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not enable connection resizer -> encoder");
-
-    if (mmal_port_enable(state.jpegencoder->output[0], jpegencoder_buffer_callback) != MMAL_SUCCESS)
-        errx(EXIT_FAILURE, "Could not enable jpeg port");
-    int max = mmal_queue_length(state.pool_jpegencoder->queue);
-    int i;
-    for (i = 0; i < max; i++) {
-        MMAL_BUFFER_HEADER_T *jpegbuffer = mmal_queue_get(state.pool_jpegencoder->queue);
-        if (!jpegbuffer)
-            errx(EXIT_FAILURE, "Could not create jpeg buffer header");
-        if (mmal_port_send_buffer(state.jpegencoder->output[0], jpegbuffer) != MMAL_SUCCESS)
-            errx(EXIT_FAILURE, "Could not send buffers to jpeg port");
-    }
+int camera_count()
+{
+    return state.camera_count;
+}
+
+const struct stream_config *stream_config(int stream)
+{
+    return &state.streams[stream].config;
+}
 
+static void start_all()
+{
+    state.source = find_source(config_string(RASPIJPGS_SOURCE));
+    state.source_fd = state.source->start();
+    state.last_source_us = monotonic_us();
 }
 
-void stop_all()
+static void stop_all()
 {
-    mmal_port_disable(state.jpegencoder->output[0]);
-    mmal_connection_destroy(state.con_cam_res);
-    mmal_connection_destroy(state.con_res_jpeg);
-    mmal_port_pool_destroy(state.jpegencoder->output[0], state.pool_jpegencoder);
-    mmal_component_disable(state.jpegencoder);
-    mmal_component_disable(state.camera);
-    mmal_component_destroy(state.jpegencoder);
-    mmal_component_destroy(state.camera);
+    state.source->stop();
 }
 
 static void parse_config_lines(char *lines)
@@ -1249,6 +3337,7 @@ static void parse_config_lines(char *lines)
         parse_config_line(line, config_context_client_request);
         line = line_end + 1;
     } while (line_end);
+    config_commit(config_context_client_request);
 }
 
 static void server_service_client()
@@ -1257,7 +3346,7 @@ static void server_service_client()
     socklen_t from_addr_len = sizeof(struct sockaddr_un);
 
     int bytes_received = recvfrom(state.socket_fd,
-                                  state.socket_buffer, MAX_DATA_BUFFER_SIZE, 0,
+                                  state.socket_buffer, state.socket_buffer_size - 1, 0,
                                   &from_addr, &from_addr_len);
     if (bytes_received < 0) {
         if (errno == EINTR)
@@ -1266,10 +3355,11 @@ static void server_service_client()
         err(EXIT_FAILURE, "recvfrom");
     }
 
-    add_client(&from_addr);
+    state.requesting_subscriber = add_client(&from_addr);
 
     state.socket_buffer[bytes_received] = 0;
     parse_config_lines(state.socket_buffer);
+    state.requesting_subscriber = 0;
 }
 
 static void process_stdin_line_framing()
@@ -1286,6 +3376,7 @@ static void process_stdin_line_framing()
         line = line_end + 1;
         line_end = strchr(line, '\n');
     }
+    config_commit(config_context_client_request);
 
     // Advance the buffer to process any leftovers next time
     int amount_processed = line - state.stdin_buffer;
@@ -1327,8 +3418,10 @@ static void process_stdin_header_framing()
 
 static void write_string(const char *str)
 {
-    if (write(state.output_fd, str, strlen(str)) < 0)
-        err(EXIT_FAILURE, "Error writing to %s", state.output_filename);
+    struct iovec iov;
+    iov.iov_base = (char *) str; // silence warning
+    iov.iov_len = strlen(str);
+    output_write(&iov, 1, iov.iov_len);
 }
 
 static void write_mime_header()
@@ -1391,8 +3484,12 @@ static int server_service_stdin()
 
     // Read in everything on stdin and see what gets processed
     int amount_read = read(STDIN_FILENO, &state.stdin_buffer[state.stdin_buffer_ix], MAX_REQUEST_BUFFER_SIZE - state.stdin_buffer_ix - 1);
-    if (amount_read < 0)
+    if (amount_read < 0) {
+        // stdin may share a non-blocking file description with --output
+        if (errno == EAGAIN || errno == EINTR)
+            return 1;
         err(EXIT_FAILURE, "Error reading stdin");
+    }
 
     // Check if stdin was closed.
     if (amount_read == 0)
@@ -1417,8 +3514,12 @@ static int client_service_stdin()
 {
     // Read in everything on stdin and see what gets processed
     int amount_read = read(STDIN_FILENO, &state.stdin_buffer[state.stdin_buffer_ix], MAX_REQUEST_BUFFER_SIZE - state.stdin_buffer_ix - 1);
-    if (amount_read < 0)
+    if (amount_read < 0) {
+        // stdin may share a non-blocking file description with --output
+        if (errno == EAGAIN || errno == EINTR)
+            return 1;
         err(EXIT_FAILURE, "Error reading stdin");
+    }
 
     // Check if stdin was closed.
     if (amount_read == 0)
@@ -1437,25 +3538,21 @@ static int client_service_stdin()
 }
 
 
-static void server_service_mmal()
-{
-    jpegencoder_buffer_callback_impl();
-}
-
 static void server_loop()
 {
     // Check if the user meant to run as a client and the server is dead
     if (state.sendlist)
         errx(EXIT_FAILURE, "Trying to send a message to a raspijpgs server, but one isn't running.");
 
-    // Init hardware
-    bcm_host_init();
-
-    // Create the file descriptors for getting back to the main thread
-    // from the MMAL callbacks.
-    if (pipe(state.mmal_callback_pipe) < 0)
-        err(EXIT_FAILURE, "pipe");
-
+    streams_init();
+    motion_init();
+    state.record_stream = -1;
+    if (strlen(config_string(RASPIJPGS_RECORD)) > 0) {
+        state.record_stream = find_stream(config_string(RASPIJPGS_RECORD_STREAM));
+        if (state.record_stream < 0)
+            errx(EXIT_FAILURE, "Unknown stream '%s' to record. Check --streams", config_string(RASPIJPGS_RECORD_STREAM));
+        recorder_start(state.record_stream);
+    }
     start_all();
     apply_parameters(config_context_server_start);
 
@@ -1465,148 +3562,415 @@ static void server_loop()
         err(EXIT_FAILURE, "Can't create Unix Domain socket at %s", state.server_addr.sun_path);
     atexit(cleanup_server);
 
+    http_server_start();
+    int i;
+    for (i = 0; i < state.stream_count; i++)
+        ring_create(&state.streams[i]);
+    state.lease_us = (int64_t) (config_double(RASPIJPGS_LEASE) * 1000000);
+
+    output_queue_init();
     write_initial_framing();
+    io_workers_start(config_int(RASPIJPGS_IO_THREADS));
+    if (config_on(RASPIJPGS_IO_URING)) {
+        if (io_workers_enabled())
+            warnx("Not using io_uring since --io_threads is set");
+        else
+            uring_init(fanout_complete);
+    }
+    if (io_workers_enabled() && state.output_fd >= 0 &&
+            strcmp(state.framing, "replace") != 0 && strcmp(state.framing, "latest") != 0)
+        state.output_sink = io_sink_open(state.output_fd, 0, state.output_queue_size, output_io_done, 0);
 
     // Main loop - keep going until we don't want any more JPEGs.
-    struct pollfd fds[3];
-    int fds_count = 2;
-    fds[0].fd = state.mmal_callback_pipe[0];
-    fds[0].events = POLLIN;
-    fds[1].fd = state.socket_fd;
-    fds[1].events = POLLIN;
-
+    // The first 5 pollfds are fixed. HTTP clients come after them. Unused
+    // entries have an fd of -1 so that poll ignores them.
+    struct pollfd *fds = NULL;
+    int fds_alloc = 0;
     if (!isatty(STDIN_FILENO)) {
         // Only allow stdin if not a terminal (e.g., pipe, etc.)
         state.stdin_buffer = (char*) malloc(MAX_REQUEST_BUFFER_SIZE);
-        fds[2].fd = STDIN_FILENO;
-        fds[2].events = POLLIN;
-        fds_count = 3;
     }
     while (state.count != 0) {
-        int ready = poll(fds, fds_count, 2000);
+        int fds_count = 5 + state.http_client_count;
+        if (fds_count > fds_alloc) {
+            fds_alloc = 2 * fds_count;
+            fds = (struct pollfd *) realloc(fds, fds_alloc * sizeof(struct pollfd));
+            if (!fds)
+                err(EXIT_FAILURE, "realloc");
+        }
+        fds[0].fd = state.source_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = state.socket_fd;
+        fds[1].events = POLLIN;
+        fds[2].fd = state.stdin_buffer ? STDIN_FILENO : -1;
+        fds[2].events = POLLIN;
+        fds[3].fd = state.http_listen_fd;
+        fds[3].events = POLLIN;
+        fds[4].fd = state.output_queue_count ? state.output_fd : -1;
+        fds[4].events = POLLOUT;
+        http_server_fill_pollfds(&fds[5]);
+
+        // Wake up periodically to retry clients whose sockets were full and
+        // to give back frames that the I/O threads have finished with.
+        int io_outstanding = io_workers_enabled() ? io_workers_reap() : 0;
+        int ready = poll(fds, fds_count, state.subscribers_backlogged || io_outstanding ? 10 : 1000);
         if (ready < 0) {
             if (errno != EINTR)
                 err(EXIT_FAILURE, "poll");
-        } else if (ready == 0) {
-            // Time out - something is wrong that we're not getting MMAL callbacks
-            errx(EXIT_FAILURE, "MMAL unresponsive. Video stuck?");
-        } else {
-            if (fds[0].revents)
-                server_service_mmal();
+        } else if (ready > 0) {
+            // Service HTTP clients first since the other handlers can close
+            // them or add new ones.
+            http_server_service(&fds[5]);
+            if (fds[3].revents)
+                http_server_accept();
+            if (fds[0].revents) {
+                state.last_source_us = monotonic_us();
+                state.source->service();
+            }
             if (fds[1].revents)
                 server_service_client();
-            if (fds_count == 3 && fds[2].revents) {
+            if (fds[2].revents) {
                 if (server_service_stdin() <= 0)
                     state.count = 0;
             }
+            if (fds[4].revents)
+                output_queue_flush();
+            http_server_reap_clients();
+        }
+
+        subscribers_flush();
+        expire_clients();
+
+        if (state.stats_requested) {
+            state.stats_requested = 0;
+            write_stats(stderr);
         }
+
+        // Something is wrong if the source has stopped producing frames
+        if (state.source->timeout_us &&
+                monotonic_us() - state.last_source_us > state.source->timeout_us)
+            errx(EXIT_FAILURE, "%s source unresponsive. Video stuck?", state.source->name);
     }
 
+    // Drop all frame references before stopping the source since frames
+    // can hold its buffers.
+    http_server_stop();
+    remove_all_clients();
+    if (state.output_sink) {
+        // The I/O thread writes what it has for the output before it exits,
+        // so let it block rather than spin. output_queue_finish() puts the
+        // original flags back.
+        if (state.output_fd_flags >= 0)
+            fcntl(state.output_fd, F_SETFL, state.output_fd_flags & ~O_NONBLOCK);
+        io_sink_close(state.output_sink);
+        state.output_sink = 0;
+    }
+    io_workers_stop();
+    uring_exit();
+    recorder_stop();
+    for (i = 0; i < state.stream_count; i++)
+        ring_destroy(&state.streams[i]);
     stop_all();
-    close(state.mmal_callback_pipe[0]);
-    close(state.mmal_callback_pipe[1]);
+    frame_pool_destroy();
+    output_queue_finish();
     free(state.stdin_buffer);
+    free(fds);
 }
 
 static void cleanup_client()
 {
+    output_restore_flags();
     close(state.socket_fd);
-    unlink(state.client_addrs[0].sun_path);
+    unlink(state.client_addr.sun_path);
+    if (state.ring)
+        munmap(state.ring, state.ring_mapped_size);
+}
+
+static void client_detach_ring()
+{
+    if (!state.ring)
+        return;
+    munmap(state.ring, state.ring_mapped_size);
+    close(state.ring_eventfd);
+    state.ring = 0;
+    state.ring_eventfd = -1;
+}
+
+static void client_attach_ring(int ring_fd, int efd)
+{
+    struct stat st;
+    if (fstat(ring_fd, &st) < 0 || st.st_size < (off_t) sizeof(struct frame_ring)) {
+        close(ring_fd);
+        close(efd);
+        return;
+    }
+
+    // The server sends a new ring when we switch streams
+    client_detach_ring();
+
+    state.ring_mapped_size = st.st_size;
+    state.ring = (struct frame_ring *) ring_map(ring_fd, state.ring_mapped_size, PROT_READ);
+    close(ring_fd);
+    if (state.ring->magic != FRAME_RING_MAGIC ||
+            sizeof(struct frame_ring) + state.ring->data_size != state.ring_mapped_size)
+        errx(EXIT_FAILURE, "Frame ring from server is corrupt");
+
+    // Start with the next frame
+    state.ring_eventfd = efd;
+    state.ring_next_seq = __atomic_load_n(&state.ring->head_seq, __ATOMIC_ACQUIRE) + 1;
+}
+
+static int ring_overwritten(uint32_t pos)
+{
+    return (int32_t) (pos - __atomic_load_n(&state.ring->reclaim_pos, __ATOMIC_ACQUIRE)) < 0;
+}
+
+static void client_service_ring()
+{
+    uint64_t value;
+    if (read(state.ring_eventfd, &value, sizeof(value)) < 0 && errno != EAGAIN && errno != EINTR)
+        err(EXIT_FAILURE, "read from frame ring eventfd");
+
+    const struct frame_ring *ring = state.ring;
+    uint32_t head = __atomic_load_n(&ring->head_seq, __ATOMIC_ACQUIRE);
+    state.last_frame_us = monotonic_us();
+
+    // The server only wakes us at max_fps, but the ring has every frame
+    if (state.max_fps > 0)
+        state.ring_next_seq = head;
+    while (state.count != 0 && (int32_t) (head - state.ring_next_seq) >= 0) {
+        // If we've fallen far behind, skip to the newest frame rather than
+        // racing the server for ones that are about to be overwritten.
+        if (head - state.ring_next_seq >= FRAME_RING_SLOTS / 2)
+            state.ring_next_seq = head;
+
+        const struct frame_ring_slot *slot = &ring->slots[state.ring_next_seq % FRAME_RING_SLOTS];
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        uint32_t pos = slot->pos;
+        uint32_t len = slot->len;
+        int64_t pts_us = slot->pts_us;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq != state.ring_next_seq ||
+                __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq ||
+                ring_overwritten(pos)) {
+            // Lapped by the server
+            state.ring_next_seq++;
+            continue;
+        }
+
+        // Copy the frame out first since the server can overwrite it at any
+        // time, and only use the copy if that didn't happen while copying.
+        uint32_t offset = pos & (ring->data_size - 1);
+        if (len > ring->data_size - offset) {
+            state.ring_next_seq++;
+            continue;
+        }
+        if (len > state.socket_buffer_size) {
+            state.socket_buffer_size = len;
+            state.socket_buffer = (char *) realloc(state.socket_buffer, state.socket_buffer_size);
+            if (!state.socket_buffer)
+                err(EXIT_FAILURE, "realloc");
+        }
+        memcpy(state.socket_buffer, &ring->data[offset], len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        state.ring_next_seq++;
+        if (ring_overwritten(pos)) {
+            warnx("Frame %u was overwritten while being copied. Dropping it.", seq);
+            continue;
+        }
+
+        output_jpeg(state.socket_buffer, len, pts_us);
+        if (state.count > 0)
+            state.count--;
+    }
 }
 
 static void client_service_server()
 {
     struct sockaddr_un from_addr = {0};
-    socklen_t from_addr_len = sizeof(struct sockaddr_un);
+    int fds[2];
+    char cmsg_buffer[CMSG_SPACE(sizeof(fds))];
+
+    // Make sure that the next frame fits no matter how big it is
+    ssize_t next_len = recv(state.socket_fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+    if (next_len > (ssize_t) state.socket_buffer_size) {
+        state.socket_buffer_size = next_len;
+        state.socket_buffer = (char *) realloc(state.socket_buffer, state.socket_buffer_size);
+        if (!state.socket_buffer)
+            err(EXIT_FAILURE, "realloc");
+    }
 
-    int bytes_received = recvfrom(state.socket_fd,
-                                  state.socket_buffer, MAX_DATA_BUFFER_SIZE, 0,
-                                  &from_addr, &from_addr_len);
+    struct iovec iov = {state.socket_buffer, state.socket_buffer_size};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &from_addr;
+    msg.msg_namelen = sizeof(struct sockaddr_un);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buffer;
+    msg.msg_controllen = sizeof(cmsg_buffer);
+
+    int bytes_received = recvmsg(state.socket_fd, &msg, MSG_CMSG_CLOEXEC);
     if (bytes_received < 0) {
         if (errno == EINTR)
             return;
 
-        err(EXIT_FAILURE, "recvfrom");
+        err(EXIT_FAILURE, "recvmsg");
     }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    int got_fds = cmsg &&
+            cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(fds));
+    if (got_fds)
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
     if (from_addr.sun_family != state.server_addr.sun_family ||
         strcmp(from_addr.sun_path, state.server_addr.sun_path) != 0) {
         warnx("Dropping message from unexpected sender %s. Server should be %s",
               from_addr.sun_path,
               state.server_addr.sun_path);
+        if (got_fds) {
+            close(fds[0]);
+            close(fds[1]);
+        }
+        return;
+    }
+
+    if (got_fds) {
+        // The server is offering us the frame ring
+        client_attach_ring(fds[0], fds[1]);
+        return;
+    }
+
+    // Nothing to do for empty datagrams
+    if (bytes_received == 0)
+        return;
+
+    // Reply to --send stats. Keep it out of the way of frames on stdout.
+    if (bytes_received >= 6 && memcmp(state.socket_buffer, "stats\n", 6) == 0) {
+        FILE *fp = state.output_fd == STDOUT_FILENO ? stderr : stdout;
+        fwrite(state.socket_buffer + 6, 1, bytes_received - 6, fp);
+        fflush(fp);
+        state.stats_pending = 0;
+        return;
+    }
+
+    // Motion scores from --motion_events go the same place as stats
+    if (bytes_received >= 7 && memcmp(state.socket_buffer, "motion\n", 7) == 0) {
+        FILE *fp = state.output_fd == STDOUT_FILENO ? stderr : stdout;
+        fwrite(state.socket_buffer + 7, 1, bytes_received - 7, fp);
+        fflush(fp);
         return;
     }
 
-    output_jpeg(state.socket_buffer, bytes_received);
+    // Datagrams don't say when the frame was captured, but it wasn't long ago
+    state.last_frame_us = monotonic_us();
+    output_jpeg(state.socket_buffer, bytes_received, state.last_frame_us);
     if (state.count > 0)
         state.count--;
 }
 
 static void client_loop()
 {
+    // Apply client only options - FIXME
+    state.count = config_int(RASPIJPGS_COUNT);
     if (state.no_output) {
         // If no output, force the number of jpegs to capture to be 0 (no place to store them)
-        setenv(RASPIJPGS_COUNT, "0", 1);
+        state.count = 0;
 
         if (!state.sendlist)
             errx(EXIT_FAILURE, "No sends and no place to store output, so nothing to do.\n"
                                "If you meant to start a server, there's one already running.");
     }
-    // Apply client only options - FIXME
-    state.count = strtol(getenv(RASPIJPGS_COUNT), NULL, 0);
 
     // Create a unix domain socket for messages from the server.
-    state.client_addrs[0].sun_family = AF_UNIX;
-    sprintf(state.client_addrs[0].sun_path, "%s.client.%d", state.server_addr.sun_path, getpid());
-    unlink(state.client_addrs[0].sun_path);
-    if (bind(state.socket_fd, (const struct sockaddr *) &state.client_addrs[0], sizeof(struct sockaddr_un)) < 0)
-        err(EXIT_FAILURE, "Can't create Unix Domain socket at %s", state.client_addrs[0].sun_path);
+    state.client_addr.sun_family = AF_UNIX;
+    sprintf(state.client_addr.sun_path, "%s.client.%d", state.server_addr.sun_path, getpid());
+    unlink(state.client_addr.sun_path);
+    if (bind(state.socket_fd, (const struct sockaddr *) &state.client_addr, sizeof(struct sockaddr_un)) < 0)
+        err(EXIT_FAILURE, "Can't create Unix Domain socket at %s", state.client_addr.sun_path);
     atexit(cleanup_client);
 
     // Send our requests to the server or an empty string to make
-    // contact with the server so that it knows about us.
-    const char *sendlist = state.sendlist;
-    if (!sendlist)
-        sendlist = "";
+    // contact with the server so that it knows about us. If we want
+    // frames, pick the stream before asking for its shared memory ring.
+    char *sendlist;
+    if (state.no_output)
+        sendlist = strdup(state.sendlist ? state.sendlist : "");
+    else if (asprintf(&sendlist, "stream=%s\nmax_fps=%g\nmotion_events=%s\ntransport=%s\n%s",
+                      state.stream_name, state.max_fps, state.motion_events ? "on" : "off",
+                      state.transport, state.sendlist ? state.sendlist : "") < 0)
+        err(EXIT_FAILURE, "asprintf");
     int tosend = strlen(sendlist);
     int sent = sendto(state.socket_fd, sendlist, tosend, 0,
                       (struct sockaddr *) &state.server_addr,
                       sizeof(struct sockaddr_un));
     if (sent != tosend)
         err(EXIT_FAILURE, "Error communicating with server");
+    free(sendlist);
 
+    output_queue_init();
     write_initial_framing();
 
     // Main loop - keep going until we don't want any more JPEGs.
-    struct pollfd fds[2];
-    int fds_count = 1;
+    state.ring_eventfd = -1;
+    struct pollfd fds[4];
     fds[0].fd = state.socket_fd;
     fds[0].events = POLLIN;
+    fds[1].fd = -1;
+    fds[1].events = POLLIN;
     if (!isatty(STDIN_FILENO)) {
         // Only allow stdin if not a terminal (e.g., pipe, etc.)
         state.stdin_buffer = (char*) malloc(MAX_REQUEST_BUFFER_SIZE);
         fds[1].fd = STDIN_FILENO;
-        fds[1].events = POLLIN;
-        fds_count = 2;
     }
-    while (state.count != 0) {
-        int ready = poll(fds, fds_count, 2000);
+    fds[2].events = POLLIN;
+    state.last_frame_us = monotonic_us();
+    int64_t next_heartbeat_us = state.last_frame_us + HEARTBEAT_INTERVAL_US;
+    int64_t server_timeout_us = SERVER_TIMEOUT_US;
+    if (state.max_fps > 0 && 2000000 / state.max_fps > server_timeout_us)
+        server_timeout_us = (int64_t) (2000000 / state.max_fps);
+    while (state.count != 0 || state.stats_pending) {
+        fds[2].fd = state.ring_eventfd;
+        fds[3].fd = state.output_queue_count ? state.output_fd : -1;
+        fds[3].events = POLLOUT;
+
+        int ready = poll(fds, 4, HEARTBEAT_INTERVAL_US / 1000);
         if (ready < 0) {
             if (errno != EINTR)
                 err(EXIT_FAILURE, "poll");
-        } else if (ready == 0) {
-            // If we timeout, then something isn't good with the server.
-            // We should be getting frames like crazy.
-            errx(EXIT_FAILURE, "Server unresponsive");
-        } else {
+        } else if (ready > 0) {
             if (fds[0].revents)
                 client_service_server();
-            if (fds_count == 2 && fds[1].revents) {
+            if (fds[1].revents) {
                 // Service stdin, but quit if the user closes it.
                 if (client_service_stdin() <= 0)
                     state.count = 0;
             }
+            if (fds[2].revents)
+                client_service_ring();
+            if (fds[3].revents)
+                output_queue_flush();
+        }
+
+        // Renew our lease on the server
+        int64_t now = monotonic_us();
+        if (now >= next_heartbeat_us) {
+            if (sendto(state.socket_fd, "", 0, MSG_DONTWAIT,
+                       (struct sockaddr *) &state.server_addr,
+                       sizeof(struct sockaddr_un)) < 0 && errno != EAGAIN)
+                err(EXIT_FAILURE, "Error communicating with server");
+            next_heartbeat_us = now + HEARTBEAT_INTERVAL_US;
         }
+
+        // If we timeout, then something isn't good with the server.
+        // We should be getting frames like crazy.
+        if (now - state.last_frame_us > server_timeout_us)
+            errx(EXIT_FAILURE, "Server unresponsive");
     }
+    output_queue_finish();
 }
 
 int main(int argc, char* argv[])
@@ -1617,23 +3981,28 @@ int main(int argc, char* argv[])
 
     // If anything still isn't set, then fill-in with defaults
     fillin_defaults();
+    config_init();
 
     if (state.user_wants_client && state.user_wants_server)
         errx(EXIT_FAILURE, "Both --client and --server requested");
 
     // Allocate buffers
-    state.socket_buffer = (char *) malloc(MAX_DATA_BUFFER_SIZE);
+    state.socket_buffer_size = MAX_DATA_BUFFER_SIZE;
+    state.socket_buffer = (char *) malloc(state.socket_buffer_size);
     if (!state.socket_buffer)
         err(EXIT_FAILURE, "malloc");
 
     // Create output files if any
-    state.output_filename = getenv(RASPIJPGS_OUTPUT);
+    state.output_fd_flags = -1; // Nothing to restore until output_queue_init()
+    state.output_filename = strdup(config_string(RASPIJPGS_OUTPUT));
+    if (!state.output_filename)
+        err(EXIT_FAILURE, "strdup");
     if (strcmp(state.output_filename, "-") == 0) {
         // stdout
         state.output_fd = STDOUT_FILENO;
 
-        if (strcmp(state.framing, "replace") == 0)
-            errx(EXIT_FAILURE, "Cannot use 'replace' framing with stdout");
+        if (strcmp(state.framing, "replace") == 0 || strcmp(state.framing, "latest") == 0)
+            errx(EXIT_FAILURE, "Cannot use '%s' framing with stdout", state.framing);
     } else if (strlen(state.output_filename) > 0) {
         if (strcmp(state.framing, "replace") == 0) {
             // With 'replace' framing, we create a new file every time and
@@ -1642,6 +4011,15 @@ int main(int argc, char* argv[])
                 err(EXIT_FAILURE, "asprintf");
 
             state.output_fd = -1;
+        } else if (strcmp(state.framing, "latest") == 0) {
+            // Readers may have the file mapped, so reuse it rather than
+            // truncating it.
+            state.output_fd = open(state.output_filename, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+            if (state.output_fd < 0)
+                err(EXIT_FAILURE, "Can't create %s", state.output_filename);
+            state.latest = 0;
+            latest_resize(LATEST_INITIAL_SLOT_SIZE);
+            state.latest->generation = 0;
         } else {
             // For all other framing, we can open the file once
             state.output_fd = open(state.output_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
@@ -1661,6 +4039,11 @@ int main(int argc, char* argv[])
     sigaction(SIGTERM, &action, NULL);
     sigaction(SIGINT, &action, NULL);
 
+    // Print statistics on SIGUSR1
+    action.sa_handler = stats_sighandler;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+
     state.is_server = acquire_server_lock();
     if (state.user_wants_client && state.is_server)
         errx(EXIT_FAILURE, "Server not running");
@@ -1673,7 +4056,7 @@ int main(int argc, char* argv[])
         err(EXIT_FAILURE, "socket");
 
     state.server_addr.sun_family = AF_UNIX;
-    strncpy(state.server_addr.sun_path, getenv(RASPIJPGS_SOCKET), sizeof(state.server_addr.sun_path) - 1);
+    strncpy(state.server_addr.sun_path, config_string(RASPIJPGS_SOCKET), sizeof(state.server_addr.sun_path) - 1);
     state.server_addr.sun_path[sizeof(state.server_addr.sun_path) - 1] = '\0';
 
     if (state.is_server)
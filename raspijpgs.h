@@ -0,0 +1,352 @@
+/*
+Copyright (c) 2015, Frank Hunleth
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * \file raspijpgs.h
+ * Definitions shared between the raspijpgs core and its frame sources.
+ */
+
+#ifndef RASPIJPGS_H
+#define RASPIJPGS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+#define FRAME_MAX_SEGMENTS          16 // Source buffers that a zero-copy frame can hold
+#define MAX_STREAMS                 8  // Each camera's video splitter has 4 outputs
+#define MAX_CAMERAS                 4
+#define MAX_STREAM_NAME             32
+#define MOTION_WIDTH                160 // Size of the images for motion detection
+#define MOTION_HEIGHT               120
+
+#define UNUSED(expr) do { (void)(expr); } while (0)
+
+// Environment config keys
+#define RASPIJPGS_WIDTH             "RASPIJPGS_WIDTH"
+#define RASPIJPGS_HEIGHT            "RASPIJPGS_HEIGHT"
+#define RASPIJPGS_FPS		    "RASPIJPGS_FPS"
+#define RASPIJPGS_ANNOTATION        "RASPIJPGS_ANNOTATION"
+#define RASPIJPGS_ANNO_BACKGROUND   "RASPIJPGS_ANNO_BACKGROUND"
+#define RASPIJPGS_SHARPNESS         "RASPIJPGS_SHARPNESS"
+#define RASPIJPGS_CONTRAST          "RASPIJPGS_CONTRAST"
+#define RASPIJPGS_BRIGHTNESS        "RASPIJPGS_BRIGHTNESS"
+#define RASPIJPGS_SATURATION        "RASPIJPGS_SATURATION"
+#define RASPIJPGS_ISO               "RASPIJPGS_ISO"
+#define RASPIJPGS_VSTAB             "RASPIJPGS_VSTAB"
+#define RASPIJPGS_EV                "RASPIJPGS_EV"
+#define RASPIJPGS_EXPOSURE          "RASPIJPGS_EXPOSURE"
+#define RASPIJPGS_AWB               "RASPIJPGS_AWB"
+#define RASPIJPGS_IMXFX             "RASPIJPGS_IMXFX"
+#define RASPIJPGS_COLFX             "RASPIJPGS_COLFX"
+#define RASPIJPGS_SENSOR_MODE       "RASPIJPGS_SENSOR_MODE"
+#define RASPIJPGS_METERING          "RASPIJPGS_METERING"
+#define RASPIJPGS_ROTATION          "RASPIJPGS_ROTATION"
+#define RASPIJPGS_HFLIP             "RASPIJPGS_HFLIP"
+#define RASPIJPGS_VFLIP             "RASPIJPGS_VFLIP"
+#define RASPIJPGS_ROI               "RASPIJPGS_ROI"
+#define RASPIJPGS_SHUTTER           "RASPIJPGS_SHUTTER"
+#define RASPIJPGS_QUALITY           "RASPIJPGS_QUALITY"
+#define RASPIJPGS_RESTART_INTERVAL  "RASPIJPGS_RESTART_INTERVAL"
+#define RASPIJPGS_TARGET_RATE       "RASPIJPGS_TARGET_RATE"
+#define RASPIJPGS_MAX_FRAME_SIZE    "RASPIJPGS_MAX_FRAME_SIZE"
+#define RASPIJPGS_QUALITY_MIN       "RASPIJPGS_QUALITY_MIN"
+#define RASPIJPGS_QUALITY_MAX       "RASPIJPGS_QUALITY_MAX"
+#define RASPIJPGS_H264_BITRATE      "RASPIJPGS_H264_BITRATE"
+#define RASPIJPGS_H264_INTRA_PERIOD "RASPIJPGS_H264_INTRA_PERIOD"
+#define RASPIJPGS_SOCKET            "RASPIJPGS_SOCKET"
+#define RASPIJPGS_OUTPUT            "RASPIJPGS_OUTPUT"
+#define RASPIJPGS_OUTPUT_QUEUE      "RASPIJPGS_OUTPUT_QUEUE"
+#define RASPIJPGS_COUNT             "RASPIJPGS_COUNT"
+#define RASPIJPGS_LOCKFILE          "RASPIJPGS_LOCKFILE"
+#define RASPIJPGS_HTTP_PORT         "RASPIJPGS_HTTP_PORT"
+#define RASPIJPGS_SHM_SIZE          "RASPIJPGS_SHM_SIZE"
+#define RASPIJPGS_LEASE             "RASPIJPGS_LEASE"
+#define RASPIJPGS_ZEROCOPY          "RASPIJPGS_ZEROCOPY"
+#define RASPIJPGS_IO_THREADS        "RASPIJPGS_IO_THREADS"
+#define RASPIJPGS_IO_URING          "RASPIJPGS_IO_URING"
+#define RASPIJPGS_SOURCE            "RASPIJPGS_SOURCE"
+#define RASPIJPGS_REPLAY            "RASPIJPGS_REPLAY"
+#define RASPIJPGS_SYNTHETIC_SIZE    "RASPIJPGS_SYNTHETIC_SIZE"
+#define RASPIJPGS_STREAMS           "RASPIJPGS_STREAMS"
+#define RASPIJPGS_RECORD            "RASPIJPGS_RECORD"
+#define RASPIJPGS_RECORD_STREAM     "RASPIJPGS_RECORD_STREAM"
+#define RASPIJPGS_SEGMENT_SECONDS   "RASPIJPGS_SEGMENT_SECONDS"
+#define RASPIJPGS_SEGMENT_SIZE      "RASPIJPGS_SEGMENT_SIZE"
+#define RASPIJPGS_RECORD_MAX_SIZE   "RASPIJPGS_RECORD_MAX_SIZE"
+#define RASPIJPGS_PRE_EVENT         "RASPIJPGS_PRE_EVENT"
+#define RASPIJPGS_POST_EVENT        "RASPIJPGS_POST_EVENT"
+#define RASPIJPGS_PRE_EVENT_SIZE    "RASPIJPGS_PRE_EVENT_SIZE"
+#define RASPIJPGS_MOTION            "RASPIJPGS_MOTION"
+#define RASPIJPGS_MOTION_HOLD       "RASPIJPGS_MOTION_HOLD"
+#define RASPIJPGS_MOTION_GATE       "RASPIJPGS_MOTION_GATE"
+#define RASPIJPGS_MOTION_IDLE_FPS   "RASPIJPGS_MOTION_IDLE_FPS"
+
+enum config_context {
+    config_context_parse_cmdline,
+    config_context_file,
+    config_context_server_start,
+    config_context_client_request
+};
+
+struct raspi_config_opt
+{
+    const char *long_option;
+    const char *short_option;
+    const char *env_key;
+    const char *help;
+
+    const char *default_value;
+
+    // Record the value (called as options are set)
+    // Set replace=0 to only set the value if it hasn't been set already.
+    void (*set)(const struct raspi_config_opt *, const char *value, enum config_context context);
+
+    // Apply the option (called on every option)
+    void (*apply)(const struct raspi_config_opt *, enum config_context context);
+};
+
+// Option values by their RASPIJPGS_* key. The environment, commandline and
+// config file are read once at startup. After that, client requests update
+// these typed copies and only options whose values changed get applied.
+const char *config_string(const char *env_key);
+int64_t config_int(const char *env_key);
+double config_double(const char *env_key);
+int config_on(const char *env_key); // Boolean options are "on" or "off"
+
+// Cameras after the first have their own settings. They're set with a
+// cameraN. prefix (e.g., camera1.contrast=70 or RASPIJPGS_CAMERA1_CONTRAST)
+// and fall back to the plain option otherwise. The config_*() functions read
+// the selected camera's settings. When a setting is applied, its camera is
+// selected.
+int camera_count(void);
+void config_select_camera(int camera);
+int config_selected_camera(void);
+
+// JPEGs that need to outlive the buffer that they came in are copied into a
+// reference counted frame. Take a reference with frame_ref() and give it
+// back with frame_unref(). Frames come from a pool of buffers in power of 2
+// size classes so that they can be reused.
+//
+// A frame can also hold the buffers that a source produced the JPEG in
+// (e.g., MMAL encoder buffers) and give them back to the source when the
+// last reference goes away. Use frame_iov() to get at the data of either
+// kind of frame.
+struct frame_segment
+{
+    void *owner;
+    const void *data;
+    size_t len;
+};
+
+struct jpeg_frame
+{
+    int refcount;
+    int size_class;         // -1 if too big to be pooled
+    size_t len;
+    size_t capacity;
+    struct jpeg_frame *next_free;
+
+    int segment_count;      // 0 if the JPEG is in data[]
+    struct frame_segment segments[FRAME_MAX_SEGMENTS];
+    void (*release_segment)(void *owner);
+    char data[];
+};
+
+struct jpeg_frame *frame_get(size_t capacity);
+struct jpeg_frame *frame_gather(const struct iovec *iov, int iovcnt, size_t capacity);
+struct jpeg_frame *frame_get_held(void (*release_segment)(void *owner));
+void frame_hold(struct jpeg_frame *frame, void *owner, const void *data, size_t len);
+struct jpeg_frame *frame_ref(struct jpeg_frame *frame);
+void frame_unref(struct jpeg_frame *frame);
+void frame_append(struct jpeg_frame **frame, const char *buf, size_t len);
+int frame_iov(const struct jpeg_frame *frame, struct iovec *iovs);
+
+// When a frame got to each step on its way through the source. Times are
+// from monotonic_us(). Sources that don't know when the frame was captured
+// use the time that they got it.
+struct frame_timing
+{
+    int64_t capture_us;     // When the sensor captured the frame
+    int64_t arrival_us;     // When the first of the JPEG came out of the encoder
+    int64_t processed_us;   // When the main loop started on it
+    int64_t assembled_us;   // When the whole JPEG was ready
+};
+
+// A source produces one or more streams of JPEGs at different sizes and
+// qualities. Stream 0 is "main" and comes from --width, --height and
+// --quality. The others come from --streams. Clients pick one by name.
+//
+// Streams can also be H.264. Their frames are Annex-B access units (start
+// codes included) with the SPS and PPS repeated before every keyframe.
+enum stream_encoding {
+    stream_encoding_jpeg,
+    stream_encoding_h264
+};
+
+struct stream_config
+{
+    char name[MAX_STREAM_NAME];
+    enum stream_encoding encoding;
+    int width;
+    int height;             // 0 = calculate from width
+    int quality;            // JPEG only
+    double fps;             // Frames beyond this rate are dropped (0 = no limit)
+    int camera;
+};
+
+int stream_count(void);
+const struct stream_config *stream_config(int stream);
+
+// Frame sources produce the JPEGs that the server distributes. A source
+// gives the main loop a file descriptor to poll and produces frames from
+// service() by calling deliver_jpeg().
+struct frame_source
+{
+    const char *name;
+
+    // Something is wrong if service() isn't called at least this often
+    // (0 = don't check)
+    int64_t timeout_us;
+
+    // Start capturing and return the file descriptor to poll for frames
+    int (*start)(void);
+
+    // Called when the file descriptor is readable
+    void (*service)(void);
+
+    // Stop capturing. No frames that the source delivered are referenced by
+    // the time this is called.
+    void (*stop)(void);
+
+    // Apply an option that affects the source (optional)
+    void (*apply)(const struct raspi_config_opt *opt, enum config_context context);
+
+    // Print statistics (optional)
+    void (*print_stats)(FILE *fp);
+};
+
+#ifndef RASPIJPGS_NO_MMAL
+extern const struct frame_source mmal_source;
+#endif
+extern const struct frame_source synthetic_source;
+extern const struct frame_source replay_source;
+
+// Send a JPEG to everyone on a stream. If the JPEG is in a reference counted
+// frame, pass it so that clients that need to hold onto it can take a
+// reference. Otherwise iov only needs to be valid for this call. The timing
+// is added to the latency statistics.
+void deliver_jpeg(int stream, const struct iovec *iov, int iovcnt, size_t len, struct jpeg_frame *frame,
+                  const struct frame_timing *timing);
+
+// Sources call this when they start changing their output for a new
+// --width, --height, --fps or --mode. The gap between the last frame before
+// it and the first one captured after it is reported in the stats.
+void source_reconfiguring(void);
+
+// Record a stream to segment files in the --record directory from a writer
+// thread (see recorder.c). The recorder takes a reference to each frame and
+// gives it back on a later call once the frame has been written. With
+// --post_event, only frames around calls to recorder_trigger() are written.
+void recorder_start(int stream);
+void recorder_record(struct jpeg_frame *frame, int64_t pts_us, int keyframe);
+int recorder_trigger(void); // Returns 0 if event recording isn't on
+void recorder_stop(void);
+void recorder_print_stats(FILE *fp);
+
+// Write frames to subscribers and --output from a pool of --io_threads
+// threads (see io_workers.c). Each sink is served by one thread so its
+// frames stay in order. A sink is a datagram client when addr is given and
+// a file descriptor otherwise. io_sink_submit() returns 0 when the sink
+// already has backlog frames in flight. The thread takes the frame's
+// reference, and it's given back and done() is called from
+// io_workers_reap() on the main thread.
+#define IO_HEADER_MAX 128
+struct sockaddr_un;
+struct io_sink;
+enum io_result {
+    io_result_sent,
+    io_result_oversize,
+    io_result_error,
+    io_result_gone,     // The datagram client's socket is gone
+    io_result_closed    // The sink was closed before the frame was written
+};
+typedef void (*io_done_fn)(void *owner, enum io_result result, size_t bytes);
+void io_workers_start(int threads);
+int io_workers_enabled(void);
+struct io_sink *io_sink_open(int fd, const struct sockaddr_un *addr, int backlog, io_done_fn done, void *owner);
+int io_sink_submit(struct io_sink *sink, struct jpeg_frame *frame, const void *header, size_t header_len,
+                   const char *trailer);
+int io_sink_backlog(const struct io_sink *sink);
+void io_sink_close(struct io_sink *sink);
+void io_workers_wake(void);
+int io_workers_reap(void); // Returns how many frames are still in flight
+void io_workers_stop(void);
+void io_workers_print_stats(FILE *fp);
+
+// Batch the main loop's sends and writes for a frame into one system call
+// with io_uring (see uring.c). Operations are queued with uring_sendmsg()
+// and uring_writev(), which return 0 when the batch is full, and
+// uring_submit() runs them and calls complete() with each result (bytes or
+// -errno). uring_init() returns 0 if io_uring can't be used.
+struct msghdr;
+typedef void (*uring_complete_fn)(uint64_t user_data, int result, void *context);
+int uring_init(uring_complete_fn complete);
+int uring_enabled(void);
+int uring_sendmsg(int fd, const struct msghdr *msg, int flags, uint64_t user_data);
+int uring_writev(int fd, const struct iovec *iov, int iovcnt, uint64_t user_data);
+void uring_submit(void *context);
+void uring_exit(void);
+void uring_print_stats(FILE *fp);
+
+// Sources that can make a MOTION_WIDTH x MOTION_HEIGHT grayscale image of
+// each frame pass it to deliver_luma() before delivering the frame's JPEGs
+// when motion_enabled(). The motion score decides whether the JPEGs are
+// sent when --motion_gate is on.
+int motion_enabled(void);
+void deliver_luma(const uint8_t *luma, int stride, int64_t capture_us);
+
+// Frame differencing for motion detection (see motion.c). Returns the
+// percentage of the image that changed since the last call.
+double motion_score(const uint8_t *luma, int stride);
+void motion_reset(void);
+
+// Returns 0 once no more frames are wanted (e.g., --count was reached)
+int source_wants_frames(void);
+
+// For sources that make frames on a timer. The timer fires at the --fps
+// rate (30 fps if 0). Reading returns how many times it fired. Setting it
+// again picks up a new --fps.
+int frame_timer_create(void);
+void frame_timer_set(int fd);
+uint64_t frame_timer_read(int fd);
+
+int constrain(int minimum, int value, int maximum);
+int64_t monotonic_us(void);
+
+#endif // RASPIJPGS_H
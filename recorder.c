@@ -0,0 +1,598 @@
+/*
+Copyright (c) 2015, Frank Hunleth
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * \file recorder.c
+ * Records a stream to a directory of segment files. The main loop only
+ * queues references to frames. A writer thread does the file I/O so that a
+ * slow SD card can't hold up the camera or the clients. Segments are named
+ * after when they were started, preallocated and rotated by duration or
+ * size. The oldest ones are deleted to keep the total under a limit.
+ *
+ * With --post_event, only events are recorded. The last --pre_event seconds
+ * of frames are held in the queue without being written. A trigger releases
+ * them to the writer along with everything until --post_event seconds after
+ * the last trigger. Each event goes in its own file.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "raspijpgs.h"
+
+#define RECORDER_QUEUE_FRAMES   64 // Frames waiting for the writer before dropping
+#define RECORDER_QUEUE_BYTES    (16 * 1024 * 1024)
+#define PRE_EVENT_MAX_FPS       120 // For sizing the queue to hold --pre_event seconds
+#define PRE_EVENT_MAX_FRAMES    8192
+#define RECORDER_BATCH_IOVS     256 // Most pieces written with one writev()
+#define SEGMENT_NAME_LEN        32
+
+// Entries without a frame end the current segment
+struct recorder_entry
+{
+    struct jpeg_frame *frame;
+    int64_t pts_us;
+    int keyframe;
+    int skip;                   // Trimmed from the pre-event frames, so don't write
+};
+
+struct segment
+{
+    char name[SEGMENT_NAME_LEN];
+    off_t size;
+};
+
+struct recorder_state
+{
+    int stream;                 // -1 when not recording
+    char *dir;
+    const char *extension;
+    int64_t segment_us;
+    off_t segment_size;         // 0 = no limit
+    off_t max_size;             // 0 = keep everything
+    int64_t pre_event_us;
+    int64_t post_event_us;      // 0 = record everything
+    size_t pre_event_size;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+
+    // The queue is a ring. Entries from reclaim to written have been
+    // written and are waiting for the main thread to unreference them.
+    // Entries from written to release are waiting for the writer. Entries
+    // from release to head are the pre-event frames. release and written
+    // are protected by lock.
+    struct recorder_entry *queue;
+    unsigned int queue_size;    // Power of 2
+    unsigned int max_pre_event_frames;
+    unsigned int head;
+    unsigned int release;
+    unsigned int written;
+    unsigned int reclaim;       // Main thread only
+    size_t queued_bytes;        // Main thread only
+    size_t pre_event_bytes;     // Main thread only
+    int need_keyframe;          // Main thread only
+    int64_t event_end_us;       // Main thread only (0 = no event)
+    int stopping;
+
+    // Writer thread only
+    int fd;
+    int64_t segment_start_us;
+    off_t segment_written;
+    off_t last_segment_size;
+    struct segment *segments;   // Oldest first. The last is the open one.
+    int segment_count;
+    int segment_alloc;
+    off_t total_size;           // Of the closed segments
+
+    // Statistics
+    unsigned long frames;
+    unsigned long long bytes;
+    unsigned long dropped;
+    unsigned long errors;
+    unsigned long segments_started;
+    unsigned long segments_deleted;
+    unsigned long events;
+    unsigned int max_depth;
+};
+
+static struct recorder_state state = {.stream = -1, .fd = -1};
+
+// Segment names sort by when they were started, e.g. 20150610-142501-250.mjpg
+static int segment_filter(const struct dirent *d)
+{
+    int n = 0;
+    sscanf(d->d_name, "%*8[0-9]-%*6[0-9]-%*3[0-9].%n", &n);
+    return n == 20 &&
+            (strcmp(&d->d_name[n], "mjpg") == 0 || strcmp(&d->d_name[n], "h264") == 0);
+}
+
+static struct segment *segment_add(const char *name, off_t size)
+{
+    if (state.segment_count == state.segment_alloc) {
+        state.segment_alloc = state.segment_alloc ? 2 * state.segment_alloc : 64;
+        state.segments = (struct segment *) realloc(state.segments, state.segment_alloc * sizeof(struct segment));
+        if (!state.segments)
+            err(EXIT_FAILURE, "realloc");
+    }
+    struct segment *seg = &state.segments[state.segment_count++];
+    snprintf(seg->name, sizeof(seg->name), "%s", name);
+    seg->size = size;
+    return seg;
+}
+
+// Pick up segments from earlier runs so that they count against the limit
+static void segments_scan()
+{
+    struct dirent **list;
+    int count = scandir(state.dir, &list, segment_filter, alphasort);
+    if (count < 0)
+        err(EXIT_FAILURE, "Can't read recording directory %s", state.dir);
+
+    int i;
+    for (i = 0; i < count; i++) {
+        char path[PATH_MAX];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", state.dir, list[i]->d_name);
+        if (stat(path, &st) == 0) {
+            segment_add(list[i]->d_name, st.st_size);
+            state.total_size += st.st_size;
+        }
+        free(list[i]);
+    }
+    free(list);
+}
+
+// Delete the oldest closed segments until there's room for reserve bytes
+static void segments_prune(off_t reserve)
+{
+    if (state.max_size <= 0)
+        return;
+
+    int removed = 0;
+    while (removed < state.segment_count && state.total_size + reserve > state.max_size) {
+        const struct segment *seg = &state.segments[removed++];
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", state.dir, seg->name);
+        if (unlink(path) < 0 && errno != ENOENT)
+            warn("Can't delete old recording %s", path);
+        state.total_size -= seg->size;
+        __atomic_add_fetch(&state.segments_deleted, 1, __ATOMIC_RELAXED);
+    }
+    state.segment_count -= removed;
+    memmove(state.segments, &state.segments[removed], state.segment_count * sizeof(struct segment));
+}
+
+static void segment_close()
+{
+    if (state.fd < 0)
+        return;
+
+    // Give back any preallocated space that wasn't used and make sure that
+    // the segment survives a power cut.
+    struct stat st;
+    off_t size = state.segment_written;
+    if (fstat(state.fd, &st) == 0)
+        size = st.st_size;
+    if (ftruncate(state.fd, size) < 0)
+        warn("ftruncate");
+    fdatasync(state.fd);
+    close(state.fd);
+    state.fd = -1;
+
+    state.segments[state.segment_count - 1].size = size;
+    state.total_size += size;
+    state.last_segment_size = size;
+}
+
+static void segment_open(int64_t pts_us)
+{
+    // Reserve the space up front so that the file system doesn't have to
+    // find it a bit at a time while frames are waiting.
+    off_t preallocate = state.segment_size > 0 ? state.segment_size : state.last_segment_size;
+    segments_prune(preallocate);
+
+    struct timespec now;
+    struct tm tm;
+    char name[SEGMENT_NAME_LEN];
+    clock_gettime(CLOCK_REALTIME, &now);
+    localtime_r(&now.tv_sec, &tm);
+    size_t len = strftime(name, sizeof(name), "%Y%m%d-%H%M%S", &tm);
+    snprintf(&name[len], sizeof(name) - len, "-%03d.%s", (int) (now.tv_nsec / 1000000), state.extension);
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", state.dir, name);
+    state.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (state.fd < 0) {
+        warn("Can't create recording %s", path);
+        __atomic_add_fetch(&state.errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // Preallocation is only an optimization, so carry on without it
+    if (preallocate > 0)
+        fallocate(state.fd, FALLOC_FL_KEEP_SIZE, 0, preallocate);
+
+    segment_add(name, 0);
+    state.segment_start_us = pts_us;
+    state.segment_written = 0;
+    __atomic_add_fetch(&state.segments_started, 1, __ATOMIC_RELAXED);
+}
+
+static void segment_write(struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0 && state.fd >= 0) {
+        ssize_t count = writev(state.fd, iov, iovcnt);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+
+            // Start over with a new segment at the next keyframe
+            warn("Can't write to recording %s", state.segments[state.segment_count - 1].name);
+            __atomic_add_fetch(&state.errors, 1, __ATOMIC_RELAXED);
+            segment_close();
+            return;
+        }
+        __atomic_add_fetch(&state.bytes, count, __ATOMIC_RELAXED);
+
+        // Skip past what was written
+        while (iovcnt > 0 && (size_t) count >= iov->iov_len) {
+            count -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + count;
+            iov->iov_len -= count;
+        }
+    }
+}
+
+// A segment ends at the first keyframe after it's long or big enough so
+// that every segment can be played by itself.
+static int segment_due(const struct recorder_entry *entry)
+{
+    if (!entry->keyframe)
+        return 0;
+    return entry->pts_us - state.segment_start_us >= state.segment_us ||
+            (state.segment_size > 0 && state.segment_written + (off_t) entry->frame->len > state.segment_size);
+}
+
+// Write queue entries from start to end in as few writev() calls as
+// possible
+static void write_entries(unsigned int start, unsigned int end)
+{
+    struct iovec iovs[RECORDER_BATCH_IOVS];
+    int iovcnt = 0;
+    unsigned int i;
+    for (i = start; i != end; i++) {
+        const struct recorder_entry *entry = &state.queue[i & (state.queue_size - 1)];
+        if (entry->skip)
+            continue;
+        if (!entry->frame) {
+            // End of an event
+            segment_write(iovs, iovcnt);
+            iovcnt = 0;
+            segment_close();
+            continue;
+        }
+        if (state.fd >= 0 && segment_due(entry)) {
+            segment_write(iovs, iovcnt);
+            iovcnt = 0;
+            segment_close();
+        }
+        if (state.fd < 0) {
+            if (!entry->keyframe)
+                continue;
+            segment_open(entry->pts_us);
+            if (state.fd < 0)
+                continue;
+        }
+
+        if (iovcnt + FRAME_MAX_SEGMENTS > RECORDER_BATCH_IOVS) {
+            segment_write(iovs, iovcnt);
+            iovcnt = 0;
+        }
+        iovcnt += frame_iov(entry->frame, &iovs[iovcnt]);
+        state.segment_written += entry->frame->len;
+        __atomic_add_fetch(&state.frames, 1, __ATOMIC_RELAXED);
+    }
+    segment_write(iovs, iovcnt);
+}
+
+static void *recorder_thread(void *arg)
+{
+    UNUSED(arg);
+
+    pthread_mutex_lock(&state.lock);
+    for (;;) {
+        while (state.written == state.release && !state.stopping)
+            pthread_cond_wait(&state.wakeup, &state.lock);
+        if (state.written == state.release)
+            break;
+
+        // The main thread doesn't touch entries until they're written
+        unsigned int start = state.written;
+        unsigned int end = state.release;
+        pthread_mutex_unlock(&state.lock);
+
+        write_entries(start, end);
+
+        pthread_mutex_lock(&state.lock);
+        state.written = end;
+    }
+    pthread_mutex_unlock(&state.lock);
+
+    segment_close();
+    return 0;
+}
+
+// Give back the frames that the writer is done with
+static void recorder_reclaim()
+{
+    pthread_mutex_lock(&state.lock);
+    unsigned int written = state.written;
+    pthread_mutex_unlock(&state.lock);
+
+    while (state.reclaim != written) {
+        struct recorder_entry *entry = &state.queue[state.reclaim & (state.queue_size - 1)];
+        if (entry->frame) {
+            state.queued_bytes -= entry->frame->len;
+            frame_unref(entry->frame);
+            entry->frame = 0;
+        }
+        state.reclaim++;
+    }
+}
+
+// Hand entries up to head to the writer. Called with the lock held.
+static void release_all()
+{
+    state.release = state.head;
+    state.pre_event_bytes = 0;
+    pthread_cond_signal(&state.wakeup);
+}
+
+// Let go of the oldest pre-event frames until they fit the limits. The
+// first one that's kept has to be a keyframe for the event to play.
+static void trim_pre_event(int64_t pts_us)
+{
+    pthread_mutex_lock(&state.lock);
+    int trimmed = 0;
+    while (state.release != state.head) {
+        struct recorder_entry *entry = &state.queue[state.release & (state.queue_size - 1)];
+        if (!(trimmed && !entry->keyframe) &&
+                pts_us - entry->pts_us <= state.pre_event_us &&
+                state.pre_event_bytes <= state.pre_event_size &&
+                state.head - state.release <= state.max_pre_event_frames)
+            break;
+
+        entry->skip = 1;
+        state.pre_event_bytes -= entry->frame->len;
+        state.release++;
+        trimmed = 1;
+    }
+    if (trimmed)
+        pthread_cond_signal(&state.wakeup);
+    pthread_mutex_unlock(&state.lock);
+}
+
+// Add an entry to the queue. Called with the lock held.
+static void queue_push(struct jpeg_frame *frame, int64_t pts_us, int keyframe)
+{
+    struct recorder_entry *entry = &state.queue[state.head & (state.queue_size - 1)];
+    entry->frame = frame ? frame_ref(frame) : 0;
+    entry->pts_us = pts_us;
+    entry->keyframe = keyframe;
+    entry->skip = 0;
+    state.head++;
+}
+
+void recorder_start(int stream)
+{
+    const struct stream_config *config = stream_config(stream);
+    // The writer thread uses this, so don't share the option's string
+    state.dir = strdup(config_string(RASPIJPGS_RECORD));
+    if (!state.dir)
+        err(EXIT_FAILURE, "strdup");
+    state.extension = config->encoding == stream_encoding_h264 ? "h264" : "mjpg";
+    state.segment_us = (int64_t) (config_double(RASPIJPGS_SEGMENT_SECONDS) * 1000000);
+    state.segment_size = config_int(RASPIJPGS_SEGMENT_SIZE);
+    state.max_size = config_int(RASPIJPGS_RECORD_MAX_SIZE);
+    state.pre_event_us = (int64_t) (config_double(RASPIJPGS_PRE_EVENT) * 1000000);
+    state.post_event_us = (int64_t) (config_double(RASPIJPGS_POST_EVENT) * 1000000);
+    state.pre_event_size = config_int(RASPIJPGS_PRE_EVENT_SIZE);
+    if (state.segment_us <= 0)
+        errx(EXIT_FAILURE, "Segments must be longer than 0 seconds");
+
+    // The queue has room for the pre-event frames on top of the ones
+    // waiting for the writer.
+    state.max_pre_event_frames = 0;
+    if (state.post_event_us > 0) {
+        double frames = (double) state.pre_event_us * PRE_EVENT_MAX_FPS / 1000000;
+        state.max_pre_event_frames = frames < PRE_EVENT_MAX_FRAMES ? (unsigned int) frames : PRE_EVENT_MAX_FRAMES;
+    }
+    state.queue_size = 1;
+    while (state.queue_size < RECORDER_QUEUE_FRAMES + state.max_pre_event_frames + 1)
+        state.queue_size <<= 1;
+    state.queue = (struct recorder_entry *) calloc(state.queue_size, sizeof(struct recorder_entry));
+    if (!state.queue)
+        err(EXIT_FAILURE, "calloc");
+
+    if (mkdir(state.dir, 0777) < 0 && errno != EEXIST)
+        err(EXIT_FAILURE, "Can't create recording directory %s", state.dir);
+    segments_scan();
+
+    state.head = state.release = state.written = state.reclaim = 0;
+    state.queued_bytes = 0;
+    state.pre_event_bytes = 0;
+    state.event_end_us = 0;
+    state.need_keyframe = 1;
+    state.stopping = 0;
+    pthread_mutex_init(&state.lock, 0);
+    pthread_cond_init(&state.wakeup, 0);
+
+    // Leave signals to the main thread
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rc = pthread_create(&state.thread, 0, recorder_thread, 0);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    if (rc != 0)
+        errx(EXIT_FAILURE, "Can't start the recorder thread: %s", strerror(rc));
+
+    state.stream = stream;
+}
+
+void recorder_record(struct jpeg_frame *frame, int64_t pts_us, int keyframe)
+{
+    recorder_reclaim();
+    if (state.post_event_us > 0) {
+        trim_pre_event(pts_us);
+        if (state.event_end_us && pts_us > state.event_end_us) {
+            // The event is over, so close its file and start collecting
+            // pre-event frames again.
+            pthread_mutex_lock(&state.lock);
+            if (state.head - state.reclaim < state.queue_size) {
+                queue_push(0, pts_us, 0);
+                release_all();
+                state.event_end_us = 0;
+            }
+            pthread_mutex_unlock(&state.lock);
+        }
+    }
+
+    // Drop frames rather than wait for the disk. After a drop, H.264 has to
+    // wait for a keyframe since the frames in between can't be decoded.
+    pthread_mutex_lock(&state.lock);
+    if (state.head - state.reclaim == state.queue_size ||
+            state.queued_bytes - state.pre_event_bytes + frame->len > RECORDER_QUEUE_BYTES ||
+            (state.need_keyframe && !keyframe)) {
+        state.need_keyframe = 1;
+        state.dropped++;
+        pthread_mutex_unlock(&state.lock);
+        return;
+    }
+    state.need_keyframe = 0;
+
+    queue_push(frame, pts_us, keyframe);
+    state.queued_bytes += frame->len;
+    if (state.post_event_us > 0 && !state.event_end_us)
+        state.pre_event_bytes += frame->len;
+    else
+        release_all();
+    if (state.release - state.written > state.max_depth)
+        state.max_depth = state.release - state.written;
+    pthread_mutex_unlock(&state.lock);
+}
+
+int recorder_trigger()
+{
+    if (state.stream < 0 || state.post_event_us <= 0)
+        return 0;
+
+    // Start an event with the pre-event frames or make the current one
+    // longer.
+    pthread_mutex_lock(&state.lock);
+    if (!state.event_end_us) {
+        state.events++;
+        release_all();
+    }
+    state.event_end_us = monotonic_us() + state.post_event_us;
+    pthread_mutex_unlock(&state.lock);
+    return 1;
+}
+
+void recorder_stop()
+{
+    if (state.stream < 0)
+        return;
+
+    // Let the writer finish what's queued
+    pthread_mutex_lock(&state.lock);
+    state.stopping = 1;
+    pthread_cond_signal(&state.wakeup);
+    pthread_mutex_unlock(&state.lock);
+    pthread_join(state.thread, 0);
+
+    // Pre-event frames that were never written
+    state.written = state.head;
+    recorder_reclaim();
+    free(state.queue);
+    state.queue = 0;
+    pthread_cond_destroy(&state.wakeup);
+    pthread_mutex_destroy(&state.lock);
+    free(state.segments);
+    state.segments = 0;
+    state.segment_count = 0;
+    state.segment_alloc = 0;
+    state.stream = -1;
+    free(state.dir);
+    state.dir = 0;
+}
+
+void recorder_print_stats(FILE *fp)
+{
+    if (state.stream < 0)
+        return;
+
+    pthread_mutex_lock(&state.lock);
+    unsigned int depth = state.release - state.written;
+    unsigned int pre_event_frames = state.head - state.release;
+    pthread_mutex_unlock(&state.lock);
+
+    fprintf(fp, "recording %s: %lu frames, %llu bytes, %lu segments started, %lu deleted, %lu dropped, %lu errors, %u queued (max %u)\n",
+            stream_config(state.stream)->name,
+            __atomic_load_n(&state.frames, __ATOMIC_RELAXED),
+            __atomic_load_n(&state.bytes, __ATOMIC_RELAXED),
+            __atomic_load_n(&state.segments_started, __ATOMIC_RELAXED),
+            __atomic_load_n(&state.segments_deleted, __ATOMIC_RELAXED),
+            state.dropped,
+            __atomic_load_n(&state.errors, __ATOMIC_RELAXED),
+            depth,
+            state.max_depth);
+    if (state.post_event_us > 0)
+        fprintf(fp, "recording events: %lu, %s, %u frames (%lu bytes) before the next one\n",
+                state.events,
+                state.event_end_us ? "recording one now" : "waiting",
+                pre_event_frames,
+                (unsigned long) state.pre_event_bytes);
+}
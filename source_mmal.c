@@ -0,0 +1,1406 @@
+/*
+Copyright (c) 2013, Broadcom Europe Ltd
+Copyright (c) 2013, Silvan Melchior
+Copyright (c) 2013, James Hughes
+Copyright (c) 2015, Frank Hunleth
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/**
+ * \file source_mmal.c
+ * Frame source for the Raspberry Pi camera. Frames come from the camera
+ * through the resizer to the JPEG encoder using MMAL. With more than one
+ * stream, the camera feeds a video splitter and each stream has its own
+ * resizer and encoder. H.264 streams use the video encoder instead. Motion
+ * detection gets another splitter output scaled down to a small YUV image.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "bcm_host.h"
+#include "interface/vcos/vcos.h"
+#include "interface/mmal/mmal.h"
+#include "interface/mmal/mmal_buffer.h"
+#include "interface/mmal/util/mmal_util.h"
+#include "interface/mmal/util/mmal_util_params.h"
+#include "interface/mmal/util/mmal_default_components.h"
+#include "interface/mmal/util/mmal_connection.h"
+#include "interface/mmal/mmal_parameters_camera.h"
+
+#include "raspijpgs.h"
+
+#define MMAL_CALLBACK_QUEUE_SIZE    256 // Power of 2 and more than all of the encoders' buffers
+#define MMAL_TIMEOUT_US             2000000
+#define STC_SYNC_INTERVAL_US        10000000 // How often to line up buffer timestamps with monotonic_us()
+#define QUALITY_AVERAGE_FRAMES      8    // Frames in the moving averages for quality control
+#define QUALITY_DOWN_HOLDOFF        2    // Frames after a quality change before lowering it again
+#define QUALITY_UP_HOLDOFF          15   // Frames after a quality change before raising it
+#define QUALITY_HEADROOM            0.75 // Only raise quality when under this fraction of the budget
+
+// MMAL buffers are handed from the MMAL callback thread to the main loop
+// through a single-producer/single-consumer ring. The eventfd is only
+// signalled when the ring goes from empty to non-empty.
+struct mmal_callback_entry
+{
+    MMAL_PORT_T *port;
+    MMAL_BUFFER_HEADER_T *buffer;
+    int64_t arrival_us;
+};
+
+struct mmal_callback_queue
+{
+    struct mmal_callback_entry entries[MMAL_CALLBACK_QUEUE_SIZE];
+    uint32_t head; // Only written by the MMAL thread
+    uint32_t tail; // Only written by the main loop
+    int eventfd;
+
+    // Statistics
+    uint32_t max_depth;
+    unsigned long buffers;
+    unsigned long wakeups;
+};
+
+// Closed loop JPEG quality control for hitting --target_rate or
+// --max_frame_size. Quality drops quickly when frames are over budget and
+// only creeps back up once they're comfortably under it, so that it doesn't
+// oscillate.
+struct quality_control
+{
+    int quality;                // What the encoder is set to
+    int frames_since_change;
+    double avg_size;            // Moving averages since the last change
+    double avg_interval_us;
+    int64_t last_capture_us;
+    unsigned long changes;
+};
+
+// One camera and its splitter. The splitter is only there if the camera has
+// more than one output.
+struct mmal_camera
+{
+    int index;
+    MMAL_COMPONENT_T *camera;
+    MMAL_COMPONENT_T *splitter;
+    MMAL_CONNECTION_T *con_cam_split;
+    int output_count;       // Streams plus motion detection on camera 0
+    int main_branch;        // The stream that --quality is for
+    int imager_width;
+    int imager_height;
+    int sensor_mode;
+    int reconfigure;        // A client changed the size, frame rate or sensor mode
+
+    // Adaptive quality settings (0 = off)
+    int target_rate;        // Bytes per second
+    int max_frame_size;
+    int quality_min;
+    int quality_max;
+};
+
+// Each stream has a resizer and JPEG or H.264 encoder. The encoder's output
+// port and buffers point back to their branch through their userdata.
+struct mmal_branch
+{
+    int stream;
+    struct mmal_camera *cam;
+    int camera_output;      // Which of the camera's outputs feeds this
+    enum stream_encoding encoding;
+    MMAL_COMPONENT_T *resizer;
+    MMAL_COMPONENT_T *encoder;
+    MMAL_CONNECTION_T *con_in_res;  // From the camera or splitter
+    MMAL_CONNECTION_T *con_res_enc;
+    MMAL_POOL_T *pool_encoder;
+
+    struct jpeg_frame *assembly_frame;  // JPEG being assembled from encoder buffers
+    size_t assembly_size_hint;
+    struct frame_timing assembly_timing;
+    int assembly_timed;                 // Timing is from a picture buffer
+
+    struct quality_control qc;
+
+    // Statistics
+    unsigned long held_frames;     // Frames sent without copying
+    unsigned int held_buffers;     // Encoder buffers currently held by frames
+    unsigned long held_fallbacks;  // Copied since no spare encoder buffers
+};
+
+struct mmal_source_state
+{
+    // MMAL resources. Branches are indexed by stream.
+    struct mmal_camera cameras[MAX_CAMERAS];
+    int camera_count;
+    struct mmal_branch branches[MAX_STREAMS];
+    int branch_count;
+
+    // Motion detection images from camera 0 (only if motion_enabled())
+    MMAL_COMPONENT_T *motion_resizer;
+    MMAL_CONNECTION_T *con_split_motion;
+    MMAL_POOL_T *pool_motion;
+    int motion_output;
+    int zerocopy_buffers;   // Spare encoder buffers per stream for holding frames (0 = copy)
+
+    // Buffer timestamps are from the VideoCore's clock (STC). Adding this
+    // converts them to monotonic_us() time.
+    int64_t stc_offset_us;
+    int64_t next_stc_sync_us;
+
+    // MMAL callback -> main loop
+    struct mmal_callback_queue mmal_callback_queue;
+};
+
+static struct mmal_source_state state = {0};
+
+// Settings are applied to the camera that they're selected for
+static struct mmal_camera *selected_camera()
+{
+    return &state.cameras[config_selected_camera()];
+}
+
+static void rational_param_apply(int mmal_param, const struct raspi_config_opt *opt, enum config_context context)
+{
+    unsigned int value = config_int(opt->env_key);
+    if (value > 100) {
+        if (context == config_context_server_start)
+            errx(EXIT_FAILURE, "%s must be between 0 and 100", opt->long_option);
+        else
+            return;
+    }
+    MMAL_RATIONAL_T mmal_value = {value, 100};
+    MMAL_STATUS_T status = mmal_port_parameter_set_rational(selected_camera()->camera->control, mmal_param, mmal_value);
+    if(status != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+}
+
+static void sharpness_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    rational_param_apply(MMAL_PARAMETER_SHARPNESS, opt, context);
+}
+static void contrast_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    rational_param_apply(MMAL_PARAMETER_CONTRAST, opt, context);
+}
+static void brightness_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    rational_param_apply(MMAL_PARAMETER_BRIGHTNESS, opt, context);
+}
+static void saturation_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    rational_param_apply(MMAL_PARAMETER_SATURATION, opt, context);
+}
+
+static void ISO_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    UNUSED(context);
+    unsigned int value = config_int(opt->env_key);
+    MMAL_STATUS_T status = mmal_port_parameter_set_uint32(selected_camera()->camera->control, MMAL_PARAMETER_ISO, value);
+    if(status != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+}
+static void vstab_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    UNUSED(context);
+    unsigned int value = (config_on(opt->env_key));
+    MMAL_STATUS_T status = mmal_port_parameter_set_uint32(selected_camera()->camera->control, MMAL_PARAMETER_VIDEO_STABILISATION, value);
+    if(status != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+}
+static void ev_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    // TODO
+    UNUSED(opt);
+    UNUSED(context);
+}
+static void exposure_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    MMAL_PARAM_EXPOSUREMODE_T mode;
+    const char *str = config_string(opt->env_key);
+    if(strcmp(str, "off") == 0) mode = MMAL_PARAM_EXPOSUREMODE_OFF;
+    else if(strcmp(str, "auto") == 0) mode = MMAL_PARAM_EXPOSUREMODE_AUTO;
+    else if(strcmp(str, "night") == 0) mode = MMAL_PARAM_EXPOSUREMODE_NIGHT;
+    else if(strcmp(str, "nightpreview") == 0) mode = MMAL_PARAM_EXPOSUREMODE_NIGHTPREVIEW;
+    else if(strcmp(str, "backlight") == 0) mode = MMAL_PARAM_EXPOSUREMODE_BACKLIGHT;
+    else if(strcmp(str, "spotlight") == 0) mode = MMAL_PARAM_EXPOSUREMODE_SPOTLIGHT;
+    else if(strcmp(str, "sports") == 0) mode = MMAL_PARAM_EXPOSUREMODE_SPORTS;
+    else if(strcmp(str, "snow") == 0) mode = MMAL_PARAM_EXPOSUREMODE_SNOW;
+    else if(strcmp(str, "beach") == 0) mode = MMAL_PARAM_EXPOSUREMODE_BEACH;
+    else if(strcmp(str, "verylong") == 0) mode = MMAL_PARAM_EXPOSUREMODE_VERYLONG;
+    else if(strcmp(str, "fixedfps") == 0) mode = MMAL_PARAM_EXPOSUREMODE_FIXEDFPS;
+    else if(strcmp(str, "antishake") == 0) mode = MMAL_PARAM_EXPOSUREMODE_ANTISHAKE;
+    else if(strcmp(str, "fireworks") == 0) mode = MMAL_PARAM_EXPOSUREMODE_FIREWORKS;
+    else {
+        if (context == config_context_server_start)
+            errx(EXIT_FAILURE, "Invalid %s", opt->long_option);
+        else
+            return;
+    }
+
+    MMAL_PARAMETER_EXPOSUREMODE_T param = {{MMAL_PARAMETER_EXPOSURE_MODE,sizeof(param)}, mode};
+    if (mmal_port_parameter_set(selected_camera()->camera->control, &param.hdr) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+}
+static void awb_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    MMAL_PARAM_AWBMODE_T awb_mode;
+    const char *str = config_string(opt->env_key);
+    if(strcmp(str, "off") == 0) awb_mode = MMAL_PARAM_AWBMODE_OFF;
+    else if(strcmp(str, "auto") == 0) awb_mode = MMAL_PARAM_AWBMODE_AUTO;
+    else if(strcmp(str, "sun") == 0) awb_mode = MMAL_PARAM_AWBMODE_SUNLIGHT;
+    else if(strcmp(str, "cloudy") == 0) awb_mode = MMAL_PARAM_AWBMODE_CLOUDY;
+    else if(strcmp(str, "shade") == 0) awb_mode = MMAL_PARAM_AWBMODE_SHADE;
+    else if(strcmp(str, "tungsten") == 0) awb_mode = MMAL_PARAM_AWBMODE_TUNGSTEN;
+    else if(strcmp(str, "fluorescent") == 0) awb_mode = MMAL_PARAM_AWBMODE_FLUORESCENT;
+    else if(strcmp(str, "incandescent") == 0) awb_mode = MMAL_PARAM_AWBMODE_INCANDESCENT;
+    else if(strcmp(str, "flash") == 0) awb_mode = MMAL_PARAM_AWBMODE_FLASH;
+    else if(strcmp(str, "horizon") == 0) awb_mode = MMAL_PARAM_AWBMODE_HORIZON;
+    else {
+        if (context == config_context_server_start)
+            errx(EXIT_FAILURE, "Invalid %s", opt->long_option);
+        else
+            return;
+    }
+    MMAL_PARAMETER_AWBMODE_T param = {{MMAL_PARAMETER_AWB_MODE,sizeof(param)}, awb_mode};
+    if (mmal_port_parameter_set(selected_camera()->camera->control, &param.hdr) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+}
+static void imxfx_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    MMAL_PARAM_IMAGEFX_T imageFX;
+    const char *str = config_string(opt->env_key);
+    if(strcmp(str, "none") == 0) imageFX = MMAL_PARAM_IMAGEFX_NONE;
+    else if(strcmp(str, "negative") == 0) imageFX = MMAL_PARAM_IMAGEFX_NEGATIVE;
+    else if(strcmp(str, "solarise") == 0) imageFX = MMAL_PARAM_IMAGEFX_SOLARIZE;
+    else if(strcmp(str, "solarize") == 0) imageFX = MMAL_PARAM_IMAGEFX_SOLARIZE;
+    else if(strcmp(str, "sketch") == 0) imageFX = MMAL_PARAM_IMAGEFX_SKETCH;
+    else if(strcmp(str, "denoise") == 0) imageFX = MMAL_PARAM_IMAGEFX_DENOISE;
+    else if(strcmp(str, "emboss") == 0) imageFX = MMAL_PARAM_IMAGEFX_EMBOSS;
+    else if(strcmp(str, "oilpaint") == 0) imageFX = MMAL_PARAM_IMAGEFX_OILPAINT;
+    else if(strcmp(str, "hatch") == 0) imageFX = MMAL_PARAM_IMAGEFX_HATCH;
+    else if(strcmp(str, "gpen") == 0) imageFX = MMAL_PARAM_IMAGEFX_GPEN;
+    else if(strcmp(str, "pastel") == 0) imageFX = MMAL_PARAM_IMAGEFX_PASTEL;
+    else if(strcmp(str, "watercolour") == 0) imageFX = MMAL_PARAM_IMAGEFX_WATERCOLOUR;
+    else if(strcmp(str, "watercolor") == 0) imageFX = MMAL_PARAM_IMAGEFX_WATERCOLOUR;
+    else if(strcmp(str, "film") == 0) imageFX = MMAL_PARAM_IMAGEFX_FILM;
+    else if(strcmp(str, "blur") == 0) imageFX = MMAL_PARAM_IMAGEFX_BLUR;
+    else if(strcmp(str, "saturation") == 0) imageFX = MMAL_PARAM_IMAGEFX_SATURATION;
+    else if(strcmp(str, "colourswap") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURSWAP;
+    else if(strcmp(str, "colorswap") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURSWAP;
+    else if(strcmp(str, "washedout") == 0) imageFX = MMAL_PARAM_IMAGEFX_WASHEDOUT;
+    else if(strcmp(str, "posterise") == 0) imageFX = MMAL_PARAM_IMAGEFX_POSTERISE;
+    else if(strcmp(str, "posterize") == 0) imageFX = MMAL_PARAM_IMAGEFX_POSTERISE;
+    else if(strcmp(str, "colourpoint") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURPOINT;
+    else if(strcmp(str, "colorpoint") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURPOINT;
+    else if(strcmp(str, "colourbalance") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURBALANCE;
+    else if(strcmp(str, "colorbalance") == 0) imageFX = MMAL_PARAM_IMAGEFX_COLOURBALANCE;
+    else if(strcmp(str, "cartoon") == 0) imageFX = MMAL_PARAM_IMAGEFX_CARTOON;
+    else {
+        if (context == config_context_server_start)
+            errx(EXIT_FAILURE, "Invalid %s", opt->long_option);
+        else
+            return;
+    }
+    MMAL_PARAMETER_IMAGEFX_T param = {{MMAL_PARAMETER_IMAGE_EFFECT,sizeof(param)}, imageFX};
+    if (mmal_port_parameter_set(selected_camera()->camera->control, &param.hdr) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+}
+static void colfx_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    // Color effect is specified as u:v. Anything else means off.
+    MMAL_PARAMETER_COLOURFX_T param = {{MMAL_PARAMETER_COLOUR_EFFECT,sizeof(param)}, 0, 0, 0};
+    const char *str = config_string(opt->env_key);
+    if (sscanf(str, "%d:%d", &param.u, &param.v) == 2 &&
+            param.u < 256 &&
+            param.v < 256)
+        param.enable = 1;
+    else
+        param.enable = 0;
+    if (mmal_port_parameter_set(selected_camera()->camera->control, &param.hdr) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+}
+static void metering_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    MMAL_PARAM_EXPOSUREMETERINGMODE_T m_mode;
+    const char *str = config_string(opt->env_key);
+    if(strcmp(str, "average") == 0) m_mode = MMAL_PARAM_EXPOSUREMETERINGMODE_AVERAGE;
+    else if(strcmp(str, "spot") == 0) m_mode = MMAL_PARAM_EXPOSUREMETERINGMODE_SPOT;
+    else if(strcmp(str, "backlit") == 0) m_mode = MMAL_PARAM_EXPOSUREMETERINGMODE_BACKLIT;
+    else if(strcmp(str, "matrix") == 0) m_mode = MMAL_PARAM_EXPOSUREMETERINGMODE_MATRIX;
+    else {
+        if (context == config_context_server_start)
+            errx(EXIT_FAILURE, "Invalid %s", opt->long_option);
+        else
+            return;
+    }
+    MMAL_PARAMETER_EXPOSUREMETERINGMODE_T param = {{MMAL_PARAMETER_EXP_METERING_MODE,sizeof(param)}, m_mode};
+    if (mmal_port_parameter_set(selected_camera()->camera->control, &param.hdr) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+}
+static void rotation_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    UNUSED(context);
+    int value = config_int(opt->env_key);
+    if (mmal_port_parameter_set_int32(selected_camera()->camera->output[0], MMAL_PARAMETER_ROTATION, value) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+}
+static void flip_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    UNUSED(context);
+
+    MMAL_PARAMETER_MIRROR_T mirror = {{MMAL_PARAMETER_MIRROR, sizeof(MMAL_PARAMETER_MIRROR_T)}, MMAL_PARAM_MIRROR_NONE};
+    if (config_on(RASPIJPGS_HFLIP))
+        mirror.value = MMAL_PARAM_MIRROR_HORIZONTAL;
+    if (config_on(RASPIJPGS_VFLIP))
+        mirror.value = (mirror.value == MMAL_PARAM_MIRROR_HORIZONTAL ? MMAL_PARAM_MIRROR_BOTH : MMAL_PARAM_MIRROR_VERTICAL);
+
+    if (mmal_port_parameter_set(selected_camera()->camera->output[0], &mirror.hdr) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+}
+static void reconfigure_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    // mmal_start() handles these on startup. Client changes are all done
+    // together once the main loop has handled the frames already queued.
+    UNUSED(opt);
+    if (context == config_context_client_request)
+        selected_camera()->reconfigure = 1;
+}
+static void roi_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    // TODO
+    UNUSED(opt);
+    UNUSED(context);
+}
+static void shutter_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    UNUSED(context);
+    int value = config_int(opt->env_key);
+    if (mmal_port_parameter_set_uint32(selected_camera()->camera->control, MMAL_PARAMETER_SHUTTER_SPEED, value) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set %s", opt->long_option);
+}
+static void set_encoder_quality(struct mmal_branch *branch, int quality)
+{
+    if (mmal_port_parameter_set_uint32(branch->encoder->output[0], MMAL_PARAMETER_JPEG_Q_FACTOR, quality) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set jpeg quality to %d", quality);
+    branch->qc.quality = quality;
+    branch->qc.frames_since_change = 0;
+    branch->qc.avg_size = 0;
+}
+static void quality_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    // --quality is for each camera's main stream. The others are set by
+    // --streams.
+    UNUSED(context);
+    int value = config_int(opt->env_key);
+    set_encoder_quality(&state.branches[selected_camera()->main_branch], constrain(0, value, 100));
+}
+static void adaptive_quality_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    UNUSED(opt);
+    UNUSED(context);
+    struct mmal_camera *cam = selected_camera();
+    cam->target_rate = config_int(RASPIJPGS_TARGET_RATE);
+    cam->max_frame_size = config_int(RASPIJPGS_MAX_FRAME_SIZE);
+    cam->quality_min = constrain(0, config_int(RASPIJPGS_QUALITY_MIN), 100);
+    cam->quality_max = constrain(cam->quality_min, config_int(RASPIJPGS_QUALITY_MAX), 100);
+}
+static void restart_interval_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    // TODO
+    UNUSED(opt);
+    UNUSED(context);
+}
+
+static int adaptive_quality_enabled(const struct mmal_camera *cam)
+{
+    return cam->target_rate > 0 || cam->max_frame_size > 0;
+}
+
+// Called with each JPEG that comes out of a branch's encoder
+static void quality_control_update(struct mmal_branch *branch, size_t len, int64_t capture_us)
+{
+    if (branch->encoding != stream_encoding_jpeg)
+        return;
+
+    struct quality_control *qc = &branch->qc;
+    if (qc->last_capture_us && capture_us > qc->last_capture_us) {
+        double interval_us = capture_us - qc->last_capture_us;
+        if (qc->avg_interval_us == 0)
+            qc->avg_interval_us = interval_us;
+        else
+            qc->avg_interval_us += (interval_us - qc->avg_interval_us) / QUALITY_AVERAGE_FRAMES;
+    }
+    qc->last_capture_us = capture_us;
+    if (qc->avg_size == 0)
+        qc->avg_size = len;
+    else
+        qc->avg_size += (len - qc->avg_size) / QUALITY_AVERAGE_FRAMES;
+    qc->frames_since_change++;
+
+    const struct mmal_camera *cam = branch->cam;
+    if (!adaptive_quality_enabled(cam))
+        return;
+
+    // How much of the budget is being used. Over 1 is over budget. A single
+    // big frame counts against the frame size limit since it's the one that
+    // doesn't fit.
+    double load = 0;
+    if (cam->max_frame_size > 0)
+        load = (len > qc->avg_size ? len : qc->avg_size) / cam->max_frame_size;
+    if (cam->target_rate > 0 && qc->avg_interval_us > 0) {
+        double rate_load = qc->avg_size * 1000000.0 / qc->avg_interval_us / cam->target_rate;
+        if (rate_load > load)
+            load = rate_load;
+    }
+
+    int quality = qc->quality;
+    if (load > 1.0 && qc->frames_since_change >= QUALITY_DOWN_HOLDOFF)
+        quality -= load > 2.0 ? 8 : (load > 1.25 ? 4 : 1);
+    else if (load < QUALITY_HEADROOM && qc->frames_since_change >= QUALITY_UP_HOLDOFF)
+        quality++;
+    quality = constrain(cam->quality_min, quality, cam->quality_max);
+    if (quality != qc->quality) {
+        set_encoder_quality(branch, quality);
+        qc->changes++;
+    }
+}
+
+static void camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    // This is called from another thread. Don't access any data here.
+    UNUSED(port);
+
+    if (buffer->cmd == MMAL_EVENT_ERROR)
+       errx(EXIT_FAILURE, "No data received from sensor. Check all connections, including the Sunny one on the camera board");
+    else if(buffer->cmd != MMAL_EVENT_PARAMETER_CHANGED)
+        errx(EXIT_FAILURE, "Camera sent invalid data: 0x%08x", buffer->cmd);
+
+    mmal_buffer_header_release(buffer);
+}
+
+static struct mmal_branch *port_branch(MMAL_PORT_T *port)
+{
+    return (struct mmal_branch *) port->userdata;
+}
+
+// Write a JPEG that's in pieces (e.g., in several encoder buffers)
+static void send_encoder_buffer(MMAL_PORT_T *port)
+{
+    if (port->is_enabled) {
+        MMAL_BUFFER_HEADER_T *new_buffer;
+
+        if (!(new_buffer = mmal_queue_get(port_branch(port)->pool_encoder->queue)) ||
+             mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not send buffers to port");
+    }
+}
+
+static void recycle_encoder_buffer(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    mmal_buffer_header_release(buffer);
+    send_encoder_buffer(port);
+}
+
+// Called when the last reference to a frame holding this buffer goes away.
+// The buffer goes back to the pool as a spare.
+static void release_encoder_buffer(void *owner)
+{
+    MMAL_BUFFER_HEADER_T *buffer = (MMAL_BUFFER_HEADER_T *) owner;
+    struct mmal_branch *branch = (struct mmal_branch *) buffer->user_data;
+    mmal_buffer_header_mem_unlock(buffer);
+    mmal_buffer_header_release(buffer);
+    branch->held_buffers--;
+}
+
+// In zero-copy mode, encoder buffers are only held if there's a spare to give
+// the encoder in their place so that the encoder never runs short.
+static int can_hold_encoder_buffer(struct mmal_branch *branch)
+{
+    if (!state.zerocopy_buffers)
+        return 0;
+
+    struct jpeg_frame *frame = branch->assembly_frame;
+    if (frame && (frame->segment_count == 0 || frame->segment_count == FRAME_MAX_SEGMENTS))
+        return 0;
+
+    if (mmal_queue_length(branch->pool_encoder->queue) == 0) {
+        branch->held_fallbacks++;
+        return 0;
+    }
+    return 1;
+}
+
+// Return when the frame in the buffer was captured in monotonic_us() time
+static int64_t capture_time(const MMAL_BUFFER_HEADER_T *buffer, int64_t arrival_us)
+{
+    if (buffer->pts == MMAL_TIME_UNKNOWN)
+        return arrival_us;
+
+    // Asking for the STC is a round trip to the VideoCore, so only do it
+    // every so often to track drift. All cameras share the one clock.
+    int64_t now = monotonic_us();
+    if (now >= state.next_stc_sync_us) {
+        uint64_t stc;
+        if (mmal_port_parameter_get_uint64(state.cameras[0].camera->control, MMAL_PARAMETER_SYSTEM_TIME, &stc) == MMAL_SUCCESS)
+            state.stc_offset_us = now - (int64_t) stc;
+        state.next_stc_sync_us = now + STC_SYNC_INTERVAL_US;
+    }
+    return buffer->pts + state.stc_offset_us;
+}
+
+// The H.264 encoder sends the SPS and PPS in a buffer of their own. Keep
+// them with the keyframe that follows so that every frame can be decoded.
+static int frame_complete(const MMAL_BUFFER_HEADER_T *buffer)
+{
+    return (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) &&
+            !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG);
+}
+
+static void encoder_buffer_callback_impl(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer, int64_t arrival_us)
+{
+    struct mmal_branch *branch = port_branch(port);
+    mmal_buffer_header_mem_lock(buffer);
+
+    // The first picture buffer of a frame has the timing for the whole
+    // frame. H.264 headers that come before it don't have a time.
+    if (!branch->assembly_frame || !branch->assembly_timed) {
+        branch->assembly_timing.capture_us = capture_time(buffer, arrival_us);
+        branch->assembly_timing.arrival_us = arrival_us;
+        branch->assembly_timing.processed_us = monotonic_us();
+        branch->assembly_timed = !(buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG);
+    }
+
+    struct iovec iov[FRAME_MAX_SEGMENTS];
+    int held = can_hold_encoder_buffer(branch);
+    if (held) {
+        // Zero-copy case: the frame keeps the buffer until everyone is done
+        if (!branch->assembly_frame)
+            branch->assembly_frame = frame_get_held(release_encoder_buffer);
+        frame_hold(branch->assembly_frame, buffer, buffer->data, buffer->length);
+        branch->held_buffers++;
+    } else if (!branch->assembly_frame && frame_complete(buffer)) {
+        // Easy case: frame all in one buffer
+        iov[0].iov_base = buffer->data;
+        iov[0].iov_len = buffer->length;
+        branch->assembly_timing.assembled_us = branch->assembly_timing.processed_us;
+        quality_control_update(branch, buffer->length, branch->assembly_timing.capture_us);
+        deliver_jpeg(branch->stream, iov, 1, buffer->length, 0, &branch->assembly_timing);
+    } else {
+        // Hard case: assemble the frame. Start with a buffer the size of the
+        // last one so that it usually doesn't need to grow.
+        size_t hint = branch->assembly_size_hint > buffer->length ? branch->assembly_size_hint : buffer->length;
+        if (!branch->assembly_frame) {
+            branch->assembly_frame = frame_get(hint);
+        } else if (branch->assembly_frame->segment_count) {
+            // Ran out of spare encoder buffers part way through, so copy
+            // what's been held so far.
+            struct jpeg_frame *held_frame = branch->assembly_frame;
+            int iovcnt = frame_iov(held_frame, iov);
+            branch->assembly_frame = frame_gather(iov, iovcnt, hint);
+            frame_unref(held_frame);
+        }
+        frame_append(&branch->assembly_frame, (const char *) buffer->data, buffer->length);
+    }
+
+    if (branch->assembly_frame && frame_complete(buffer)) {
+        struct jpeg_frame *frame = branch->assembly_frame;
+        branch->assembly_frame = 0;
+        branch->assembly_size_hint = frame->len;
+        if (frame->segment_count)
+            branch->held_frames++;
+        int iovcnt = frame_iov(frame, iov);
+        branch->assembly_timing.assembled_us = monotonic_us();
+        quality_control_update(branch, frame->len, branch->assembly_timing.capture_us);
+        deliver_jpeg(branch->stream, iov, iovcnt, frame->len, frame, &branch->assembly_timing);
+        frame_unref(frame);
+    }
+
+    //cam_set_annotation();
+
+    if (held) {
+        // Give the encoder a spare in place of the held buffer
+        send_encoder_buffer(port);
+    } else {
+        mmal_buffer_header_mem_unlock(buffer);
+        recycle_encoder_buffer(port, buffer);
+    }
+}
+
+// Pass the Y plane of a motion detection image to raspijpgs and give the
+// buffer back to the resizer
+static void motion_buffer_callback_impl(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer, int64_t arrival_us)
+{
+    int stride = port->format->es->video.width;
+    if (buffer->length >= (uint32_t) (stride * MOTION_HEIGHT)) {
+        mmal_buffer_header_mem_lock(buffer);
+        deliver_luma(buffer->data + buffer->offset, stride, capture_time(buffer, arrival_us));
+        mmal_buffer_header_mem_unlock(buffer);
+    }
+    mmal_buffer_header_release(buffer);
+
+    MMAL_BUFFER_HEADER_T *new_buffer;
+    if (port->is_enabled &&
+        (!(new_buffer = mmal_queue_get(state.pool_motion->queue)) ||
+         mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS))
+        errx(EXIT_FAILURE, "Could not send buffers to motion resizer");
+}
+
+static void mmal_callback_queue_init()
+{
+    struct mmal_callback_queue *q = &state.mmal_callback_queue;
+    memset(q, 0, sizeof(*q));
+    q->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (q->eventfd < 0)
+        err(EXIT_FAILURE, "eventfd");
+}
+
+// Called from the MMAL thread
+static void mmal_callback_queue_push(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer, int64_t arrival_us)
+{
+    struct mmal_callback_queue *q = &state.mmal_callback_queue;
+    uint32_t head = q->head;
+    uint32_t depth = head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if (depth >= MMAL_CALLBACK_QUEUE_SIZE)
+        errx(EXIT_FAILURE, "MMAL callback queue overflow. Increase MMAL_CALLBACK_QUEUE_SIZE.");
+
+    q->entries[head % MMAL_CALLBACK_QUEUE_SIZE].port = port;
+    q->entries[head % MMAL_CALLBACK_QUEUE_SIZE].buffer = buffer;
+    q->entries[head % MMAL_CALLBACK_QUEUE_SIZE].arrival_us = arrival_us;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+    // Only wake up the main loop if it might have seen the queue empty.
+    // The fence pairs with the one in mmal_callback_queue_drain() so that
+    // either we see the updated tail or it sees the new head.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->tail, __ATOMIC_RELAXED) == head) {
+        uint64_t one = 1;
+        if (write(q->eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            err(EXIT_FAILURE, "write to MMAL callback eventfd");
+    }
+}
+
+static void mmal_reconfigure(struct mmal_camera *cam);
+
+// Called from the main loop to process everything that's been queued
+static void mmal_callback_queue_drain()
+{
+    struct mmal_callback_queue *q = &state.mmal_callback_queue;
+    uint64_t value;
+    if (read(q->eventfd, &value, sizeof(value)) < 0 && errno != EAGAIN && errno != EINTR)
+        err(EXIT_FAILURE, "read from MMAL callback eventfd");
+    q->wakeups++;
+
+    uint32_t tail = q->tail;
+    for (;;) {
+        uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if (head == tail)
+            break;
+
+        uint32_t depth = head - tail;
+        if (depth > q->max_depth)
+            q->max_depth = depth;
+
+        while (tail != head && source_wants_frames()) {
+            struct mmal_callback_entry *entry = &q->entries[tail % MMAL_CALLBACK_QUEUE_SIZE];
+            if (state.motion_resizer && entry->port == state.motion_resizer->output[0])
+                motion_buffer_callback_impl(entry->port, entry->buffer, entry->arrival_us);
+            else
+                encoder_buffer_callback_impl(entry->port, entry->buffer, entry->arrival_us);
+            q->buffers++;
+            tail++;
+        }
+
+        __atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        // Leave anything else for the shutdown code if we're done
+        if (!source_wants_frames())
+            break;
+    }
+
+    // The frames that were queued are done, so it's safe to switch now
+    int i;
+    for (i = 0; i < state.camera_count && source_wants_frames(); i++) {
+        if (state.cameras[i].reconfigure)
+            mmal_reconfigure(&state.cameras[i]);
+    }
+}
+
+// Give back any buffers that were queued but not processed. This must be
+// called after the encoder ports are disabled and before their pools are
+// destroyed.
+static void mmal_callback_queue_release()
+{
+    struct mmal_callback_queue *q = &state.mmal_callback_queue;
+    uint32_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    while (q->tail != head) {
+        mmal_buffer_header_release(q->entries[q->tail % MMAL_CALLBACK_QUEUE_SIZE].buffer);
+        q->tail++;
+    }
+}
+
+static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    // If the buffer contains something, queue it for our main thread to
+    // process. If not, recycle it.
+    if (buffer->length)
+        mmal_callback_queue_push(port, buffer, monotonic_us());
+    else
+        recycle_encoder_buffer(port, buffer);
+}
+
+static void motion_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+    mmal_callback_queue_push(port, buffer, monotonic_us());
+}
+
+static void find_sensor_dimensions(int camera_ix, int *imager_width, int *imager_height)
+{
+    MMAL_COMPONENT_T *camera_info;
+
+    // Default to OV5647 full resolution
+    *imager_width = 2592;
+    *imager_height = 1944;
+
+    // Try to get the camera name and maximum supported resolution
+    MMAL_STATUS_T status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA_INFO, &camera_info);
+    if (status == MMAL_SUCCESS) {
+        MMAL_PARAMETER_CAMERA_INFO_T param;
+        param.hdr.id = MMAL_PARAMETER_CAMERA_INFO;
+        param.hdr.size = sizeof(param)-4;  // Deliberately undersize to check firmware version
+        status = mmal_port_parameter_get(camera_info->control, &param.hdr);
+
+        if (status != MMAL_SUCCESS) {
+            // Running on newer firmware
+            param.hdr.size = sizeof(param);
+            status = mmal_port_parameter_get(camera_info->control, &param.hdr);
+            if (status == MMAL_SUCCESS && param.num_cameras > camera_ix) {
+                // Take the parameters from the first camera listed.
+                *imager_width = param.cameras[camera_ix].max_width;
+                *imager_height = param.cameras[camera_ix].max_height;
+            } else
+                warnx("Cannot read camera info, keeping the defaults for OV5647");
+        } else {
+            // Older firmware
+            // Nothing to do here, keep the defaults for OV5647
+        }
+
+        mmal_component_destroy(camera_info);
+    } else {
+        warnx("Failed to create camera_info component");
+    }
+}
+
+// Work out a stream's size. The JPEG encoder needs multiples of 16.
+static void stream_dimensions(const struct stream_config *config, int imager_width, int imager_height,
+                              int *width, int *height)
+{
+    *width = config->width;
+    if (*width <= 0)
+        *width = 320;
+    else if (*width > imager_width)
+        *width = imager_width;
+    *width = *width & ~0xf;
+    *height = config->height;
+    if (*height <= 0)
+        *height = imager_height * *width / imager_width; // Default to the camera's aspect ratio
+    else if (*height > imager_height)
+        *height = imager_height;
+    *height = *height & ~0xf;
+}
+
+// A camera runs at the size of its biggest stream and the resizers scale
+// down from there. Sizes are indexed by stream.
+static void stream_sizes(const struct mmal_camera *cam, int *widths, int *heights, int *video_width, int *video_height)
+{
+    *video_width = 0;
+    *video_height = 0;
+    int i;
+    for (i = 0; i < state.branch_count; i++) {
+        if (state.branches[i].cam != cam)
+            continue;
+        stream_dimensions(stream_config(i), cam->imager_width, cam->imager_height, &widths[i], &heights[i]);
+        if (widths[i] * heights[i] > *video_width * *video_height) {
+            *video_width = widths[i];
+            *video_height = heights[i];
+        }
+    }
+}
+
+// Set a video port's size and frame rate. The caller commits it.
+static void video_format_set(MMAL_PORT_T *port, int width, int height, int fps100)
+{
+    MMAL_VIDEO_FORMAT_T *video = &port->format->es->video;
+    video->width = width;
+    video->height = height;
+    video->crop.x = 0;
+    video->crop.y = 0;
+    video->crop.width = width;
+    video->crop.height = height;
+    video->frame_rate.num = fps100;
+    video->frame_rate.den = 100;
+}
+
+static int video_format_changed(MMAL_PORT_T *port, int width, int height, int fps100)
+{
+    const MMAL_VIDEO_FORMAT_T *video = &port->format->es->video;
+    return video->crop.width != width ||
+           video->crop.height != height ||
+           (int) video->frame_rate.num != fps100;
+}
+
+// Creating a connection copies the output port's format to the input port
+static void connect_ports(MMAL_CONNECTION_T **connection, MMAL_PORT_T *output, MMAL_PORT_T *input, const char *what)
+{
+    if (mmal_connection_create(connection, output, input, MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not create connection %s", what);
+    if (mmal_connection_enable(*connection) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not enable connection %s", what);
+}
+
+static MMAL_PORT_T *camera_output_port(const struct mmal_camera *cam, int output)
+{
+    return cam->splitter ? cam->splitter->output[output] : cam->camera->output[0];
+}
+
+static void splitter_outputs_commit(struct mmal_camera *cam)
+{
+    int i;
+    for (i = 0; i < cam->output_count; i++) {
+        mmal_format_copy(cam->splitter->output[i]->format, cam->splitter->input[0]->format);
+        if (mmal_port_format_commit(cam->splitter->output[i]) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not set video splitter output format");
+    }
+}
+
+static void sensor_mode_set(struct mmal_camera *cam, int mode)
+{
+    if (mmal_port_parameter_set_uint32(cam->camera->control, MMAL_PARAMETER_CAMERA_CUSTOM_SENSOR_CONFIG, mode) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set sensor mode %d", mode);
+    cam->sensor_mode = mode;
+}
+
+static void jpeg_encoder_create(struct mmal_branch *branch, const struct stream_config *config)
+{
+    MMAL_STATUS_T status = mmal_component_create(MMAL_COMPONENT_DEFAULT_IMAGE_ENCODER, &branch->encoder);
+    if (status != MMAL_SUCCESS && status != MMAL_ENOSYS)
+        errx(EXIT_FAILURE, "Could not create image encoder");
+
+    MMAL_PORT_T *output = branch->encoder->output[0];
+    output->format->encoding = MMAL_ENCODING_JPEG;
+    output->buffer_size = output->buffer_size_recommended;
+    if (output->buffer_size < output->buffer_size_min)
+        output->buffer_size = output->buffer_size_min;
+    output->buffer_num = output->buffer_num_recommended;
+    if (output->buffer_num < output->buffer_num_min)
+        output->buffer_num = output->buffer_num_min;
+    if (mmal_port_format_commit(output) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set image format");
+
+    set_encoder_quality(branch, constrain(0, config->quality, 100));
+
+    // Set the JPEG restart interval
+    int restart_interval = config_int(RASPIJPGS_RESTART_INTERVAL);
+    if (mmal_port_parameter_set_uint32(output, MMAL_PARAMETER_JPEG_RESTART_INTERVAL, restart_interval) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Unable to set JPEG restart interval");
+
+    if (mmal_port_parameter_set_boolean(output, MMAL_PARAMETER_EXIF_DISABLE, 1) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not turn off EXIF");
+
+    if (mmal_component_enable(branch->encoder) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not enable image encoder");
+}
+
+// The SPS and PPS are repeated before every keyframe so that clients can
+// start decoding at any of them.
+static void h264_encoder_create(struct mmal_branch *branch)
+{
+    MMAL_STATUS_T status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, &branch->encoder);
+    if (status != MMAL_SUCCESS && status != MMAL_ENOSYS)
+        errx(EXIT_FAILURE, "Could not create video encoder");
+
+    MMAL_PORT_T *output = branch->encoder->output[0];
+    mmal_format_copy(output->format, branch->encoder->input[0]->format);
+    output->format->encoding = MMAL_ENCODING_H264;
+    output->format->bitrate = config_int(RASPIJPGS_H264_BITRATE);
+    output->format->es->video.frame_rate.num = 0; // Follow the input
+    output->format->es->video.frame_rate.den = 1;
+    output->buffer_size = output->buffer_size_recommended;
+    if (output->buffer_size < output->buffer_size_min)
+        output->buffer_size = output->buffer_size_min;
+    output->buffer_num = output->buffer_num_recommended;
+    if (output->buffer_num < output->buffer_num_min)
+        output->buffer_num = output->buffer_num_min;
+    if (mmal_port_format_commit(output) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set video format");
+
+    MMAL_PARAMETER_VIDEO_PROFILE_T profile;
+    profile.hdr.id = MMAL_PARAMETER_PROFILE;
+    profile.hdr.size = sizeof(profile);
+    profile.profile[0].profile = MMAL_VIDEO_PROFILE_H264_HIGH;
+    profile.profile[0].level = MMAL_VIDEO_LEVEL_H264_4;
+    if (mmal_port_parameter_set(output, &profile.hdr) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set H.264 profile");
+
+    int intra_period = config_int(RASPIJPGS_H264_INTRA_PERIOD);
+    if (intra_period > 0 &&
+            mmal_port_parameter_set_uint32(output, MMAL_PARAMETER_INTRAPERIOD, intra_period) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set H.264 intra period");
+
+    if (mmal_port_parameter_set_boolean(output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER, 1) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not turn on inline H.264 headers");
+
+    if (mmal_component_enable(branch->encoder) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not enable video encoder");
+}
+
+// Build the resizer and encoder for a stream and connect it to the camera or
+// a splitter output.
+static void branch_start(struct mmal_branch *branch, MMAL_PORT_T *source_port, int width, int height, int fps100)
+{
+    const struct stream_config *config = stream_config(branch->stream);
+
+    //
+    // create encoder
+    //
+    branch->encoding = config->encoding;
+    if (branch->encoding == stream_encoding_h264)
+        h264_encoder_create(branch);
+    else
+        jpeg_encoder_create(branch, config);
+
+    // In zero-copy mode, the pool has spare buffers to hand the encoder while
+    // frames are holding onto the ones that it filled.
+    MMAL_PORT_T *output = branch->encoder->output[0];
+    branch->pool_encoder = mmal_port_pool_create(output, output->buffer_num + state.zerocopy_buffers, output->buffer_size);
+    if (!branch->pool_encoder)
+        errx(EXIT_FAILURE, "Could not create encoder buffer pool");
+    unsigned int i;
+    for (i = 0; i < branch->pool_encoder->headers_num; i++)
+        branch->pool_encoder->header[i]->user_data = branch;
+
+    //
+    // create image-resizer
+    //
+    MMAL_STATUS_T status = mmal_component_create("vc.ril.resize", &branch->resizer);
+    if (status != MMAL_SUCCESS && status != MMAL_ENOSYS)
+        errx(EXIT_FAILURE, "Could not create image resizer");
+
+    video_format_set(branch->resizer->output[0], width, height, fps100);
+    if (mmal_port_format_commit(branch->resizer->output[0]) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set image resizer output");
+
+    if (mmal_component_enable(branch->resizer) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not enable image resizer");
+
+    //
+    // connect
+    //
+    connect_ports(&branch->con_in_res, source_port, branch->resizer->input[0], "to resizer");
+    connect_ports(&branch->con_res_enc, branch->resizer->output[0], branch->encoder->input[0], "resizer -> encoder");
+
+    output->userdata = (struct MMAL_PORT_USERDATA_T *) branch;
+    if (mmal_port_enable(output, encoder_buffer_callback) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not enable encoder output port");
+    int max = output->buffer_num;
+    int j;
+    for (j = 0; j < max; j++) {
+        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(branch->pool_encoder->queue);
+        if (!buffer)
+            errx(EXIT_FAILURE, "Could not create encoder buffer header");
+        if (mmal_port_send_buffer(output, buffer) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not send buffers to encoder port");
+    }
+}
+
+// Scale the camera's frames down to I420 at the motion detection size. Only
+// the Y plane gets used.
+static void motion_start(MMAL_PORT_T *source_port, int fps100)
+{
+    if (mmal_component_create("vc.ril.resize", &state.motion_resizer) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not create motion resizer");
+
+    MMAL_PORT_T *output = state.motion_resizer->output[0];
+    MMAL_ES_FORMAT_T *format = output->format;
+    format->encoding = MMAL_ENCODING_I420;
+    format->encoding_variant = MMAL_ENCODING_I420;
+    video_format_set(output, MOTION_WIDTH, MOTION_HEIGHT, fps100);
+    if (mmal_port_format_commit(output) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set motion resizer output");
+
+    output->buffer_num = output->buffer_num_recommended;
+    output->buffer_size = output->buffer_size_recommended;
+    state.pool_motion = mmal_port_pool_create(output, output->buffer_num, output->buffer_size);
+    if (!state.pool_motion)
+        errx(EXIT_FAILURE, "Could not create motion buffer pool");
+
+    if (mmal_component_enable(state.motion_resizer) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not enable motion resizer");
+
+    connect_ports(&state.con_split_motion, source_port, state.motion_resizer->input[0], "to motion resizer");
+
+    if (mmal_port_enable(output, motion_buffer_callback) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not enable motion resizer output port");
+    unsigned int i;
+    for (i = 0; i < output->buffer_num; i++) {
+        MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state.pool_motion->queue);
+        if (!buffer || mmal_port_send_buffer(output, buffer) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not send buffers to motion resizer");
+    }
+}
+
+// Start a camera and the branches for its streams. The camera's settings
+// need to be selected.
+static void camera_start(struct mmal_camera *cam)
+{
+    // Find out which Raspberry Camera is attached for the defaults
+    find_sensor_dimensions(cam->index, &cam->imager_width, &cam->imager_height);
+
+    //
+    // create camera
+    //
+    if (mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &cam->camera) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not create camera %d", cam->index);
+    if (mmal_port_parameter_set_uint32(cam->camera->control, MMAL_PARAMETER_CAMERA_NUM, cam->index) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not select camera %d", cam->index);
+    sensor_mode_set(cam, config_int(RASPIJPGS_SENSOR_MODE));
+    if (mmal_port_enable(cam->camera->control, camera_control_callback) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not enable camera control port");
+
+    int fps100 = lrint(100.0 * config_double(RASPIJPGS_FPS));
+    int widths[MAX_STREAMS];
+    int heights[MAX_STREAMS];
+    int video_width;
+    int video_height;
+    stream_sizes(cam, widths, heights, &video_width, &video_height);
+
+    MMAL_PARAMETER_CAMERA_CONFIG_T cam_config = {
+        {MMAL_PARAMETER_CAMERA_CONFIG, sizeof(cam_config)},
+        .max_stills_w = 0,
+        .max_stills_h = 0,
+        .stills_yuv422 = 0,
+        .one_shot_stills = 0,
+        .max_preview_video_w = cam->imager_width,
+        .max_preview_video_h = cam->imager_height,
+        .num_preview_video_frames = 3,
+        .stills_capture_circular_buffer_height = 0,
+        .fast_preview_resume = 0,
+        .use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RESET_STC
+    };
+    if (mmal_port_parameter_set(cam->camera->control, &cam_config.hdr) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Error configuring camera");
+
+    video_format_set(cam->camera->output[0], video_width, video_height, fps100);
+    if (mmal_port_format_commit(cam->camera->output[0]) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not set preview format");
+
+    if (mmal_component_enable(cam->camera) != MMAL_SUCCESS)
+        errx(EXIT_FAILURE, "Could not enable camera");
+
+    //
+    // create video splitter if there's more than one stream or motion
+    // detection is on
+    //
+    cam->splitter = 0;
+    if (cam->output_count > 1) {
+        if (mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_SPLITTER, &cam->splitter) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not create video splitter");
+        if (cam->splitter->output_num < (uint32_t) cam->output_count)
+            errx(EXIT_FAILURE, "Video splitter only has %d outputs", (int) cam->splitter->output_num);
+
+        mmal_format_copy(cam->splitter->input[0]->format, cam->camera->output[0]->format);
+        if (mmal_port_format_commit(cam->splitter->input[0]) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not set video splitter input format");
+        splitter_outputs_commit(cam);
+        if (mmal_component_enable(cam->splitter) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not enable video splitter");
+
+        connect_ports(&cam->con_cam_split, cam->camera->output[0], cam->splitter->input[0], "camera -> splitter");
+    }
+
+    adaptive_quality_apply(0, config_context_server_start);
+    int i;
+    for (i = 0; i < state.branch_count; i++) {
+        struct mmal_branch *branch = &state.branches[i];
+        if (branch->cam == cam)
+            branch_start(branch, camera_output_port(cam, branch->camera_output), widths[i], heights[i], fps100);
+    }
+    if (cam->index == 0 && motion_enabled())
+        motion_start(camera_output_port(cam, state.motion_output), fps100);
+}
+
+static int mmal_start()
+{
+    bcm_host_init();
+
+    // Create the queue for getting back to the main thread from the MMAL
+    // callbacks.
+    mmal_callback_queue_init();
+    state.next_stc_sync_us = 0;
+    state.zerocopy_buffers = constrain(0, config_int(RASPIJPGS_ZEROCOPY), 256);
+
+    // Each camera's streams take its outputs in order. Motion detection
+    // images come from camera 0's last output.
+    state.camera_count = camera_count();
+    state.branch_count = stream_count();
+    int i;
+    for (i = 0; i < state.camera_count; i++) {
+        struct mmal_camera *cam = &state.cameras[i];
+        memset(cam, 0, sizeof(*cam));
+        cam->index = i;
+        cam->main_branch = -1;
+    }
+    for (i = 0; i < state.branch_count; i++) {
+        struct mmal_branch *branch = &state.branches[i];
+        memset(branch, 0, sizeof(*branch));
+        branch->stream = i;
+        branch->cam = &state.cameras[stream_config(i)->camera];
+        branch->camera_output = branch->cam->output_count++;
+        if (branch->cam->main_branch < 0)
+            branch->cam->main_branch = i;
+    }
+    state.motion_resizer = 0;
+    if (motion_enabled())
+        state.motion_output = state.cameras[0].output_count++;
+
+    for (i = 0; i < state.camera_count; i++) {
+        config_select_camera(i);
+        camera_start(&state.cameras[i]);
+    }
+    config_select_camera(0);
+
+    return state.mmal_callback_queue.eventfd;
+}
+
+// Switch a camera to a new size, frame rate or sensor mode without stopping.
+// Only the connections into ports whose formats change are torn down. If
+// the camera's output stays the same, that's just the resizer -> encoder
+// connections of the streams with new sizes. Otherwise, everything between
+// the camera and the resizers is reconnected. Encoder outputs stay enabled
+// throughout, so frames that are in progress finish normally.
+static void mmal_reconfigure(struct mmal_camera *cam)
+{
+    cam->reconfigure = 0;
+
+    config_select_camera(cam->index);
+    int fps100 = lrint(100.0 * config_double(RASPIJPGS_FPS));
+    int sensor_mode = config_int(RASPIJPGS_SENSOR_MODE);
+    config_select_camera(0);
+
+    int widths[MAX_STREAMS];
+    int heights[MAX_STREAMS];
+    int video_width;
+    int video_height;
+    stream_sizes(cam, widths, heights, &video_width, &video_height);
+
+    int camera_changed = sensor_mode != cam->sensor_mode ||
+                         video_format_changed(cam->camera->output[0], video_width, video_height, fps100);
+    int resized[MAX_STREAMS];
+    int any_changed = camera_changed;
+    int i;
+    for (i = 0; i < state.branch_count; i++) {
+        resized[i] = state.branches[i].cam == cam &&
+                     video_format_changed(state.branches[i].resizer->output[0], widths[i], heights[i], fps100);
+        any_changed |= resized[i];
+    }
+    if (!any_changed)
+        return;
+
+    source_reconfiguring();
+
+    int has_motion = cam->index == 0 && state.motion_resizer;
+    if (camera_changed) {
+        for (i = 0; i < state.branch_count; i++) {
+            if (state.branches[i].cam == cam)
+                mmal_connection_destroy(state.branches[i].con_in_res);
+        }
+        if (has_motion)
+            mmal_connection_destroy(state.con_split_motion);
+        if (cam->splitter)
+            mmal_connection_destroy(cam->con_cam_split);
+
+        if (sensor_mode != cam->sensor_mode)
+            sensor_mode_set(cam, sensor_mode);
+        video_format_set(cam->camera->output[0], video_width, video_height, fps100);
+        if (mmal_port_format_commit(cam->camera->output[0]) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not set preview format");
+    }
+
+    for (i = 0; i < state.branch_count; i++) {
+        struct mmal_branch *branch = &state.branches[i];
+        if (!resized[i])
+            continue;
+
+        mmal_connection_destroy(branch->con_res_enc);
+        video_format_set(branch->resizer->output[0], widths[i], heights[i], fps100);
+        if (mmal_port_format_commit(branch->resizer->output[0]) != MMAL_SUCCESS)
+            errx(EXIT_FAILURE, "Could not set image resizer output");
+        connect_ports(&branch->con_res_enc, branch->resizer->output[0], branch->encoder->input[0], "resizer -> encoder");
+    }
+
+    if (camera_changed) {
+        if (cam->splitter) {
+            connect_ports(&cam->con_cam_split, cam->camera->output[0], cam->splitter->input[0], "camera -> splitter");
+            splitter_outputs_commit(cam);
+        }
+        for (i = 0; i < state.branch_count; i++) {
+            struct mmal_branch *branch = &state.branches[i];
+            if (branch->cam == cam)
+                connect_ports(&branch->con_in_res, camera_output_port(cam, branch->camera_output),
+                              branch->resizer->input[0], "to resizer");
+        }
+        if (has_motion)
+            connect_ports(&state.con_split_motion, camera_output_port(cam, state.motion_output),
+                          state.motion_resizer->input[0], "to motion resizer");
+    }
+}
+
+static void mmal_stop()
+{
+    int i;
+    for (i = 0; i < state.branch_count; i++) {
+        struct mmal_branch *branch = &state.branches[i];
+        if (branch->assembly_frame)
+            frame_unref(branch->assembly_frame);
+        branch->assembly_frame = 0;
+        mmal_port_disable(branch->encoder->output[0]);
+    }
+    if (state.motion_resizer)
+        mmal_port_disable(state.motion_resizer->output[0]);
+    mmal_callback_queue_release();
+
+    for (i = 0; i < state.branch_count; i++) {
+        struct mmal_branch *branch = &state.branches[i];
+        mmal_connection_destroy(branch->con_in_res);
+        mmal_connection_destroy(branch->con_res_enc);
+        mmal_port_pool_destroy(branch->encoder->output[0], branch->pool_encoder);
+        mmal_component_disable(branch->encoder);
+        mmal_component_disable(branch->resizer);
+        mmal_component_destroy(branch->encoder);
+        mmal_component_destroy(branch->resizer);
+    }
+    if (state.motion_resizer) {
+        mmal_connection_destroy(state.con_split_motion);
+        mmal_port_pool_destroy(state.motion_resizer->output[0], state.pool_motion);
+        mmal_component_disable(state.motion_resizer);
+        mmal_component_destroy(state.motion_resizer);
+    }
+    for (i = 0; i < state.camera_count; i++) {
+        struct mmal_camera *cam = &state.cameras[i];
+        if (cam->splitter) {
+            mmal_connection_destroy(cam->con_cam_split);
+            mmal_component_disable(cam->splitter);
+            mmal_component_destroy(cam->splitter);
+        }
+        mmal_component_disable(cam->camera);
+        mmal_component_destroy(cam->camera);
+    }
+    close(state.mmal_callback_queue.eventfd);
+}
+
+static const struct
+{
+    const char *env_key;
+    void (*apply)(const struct raspi_config_opt *opt, enum config_context context);
+} mmal_options[] = {
+    {RASPIJPGS_SHARPNESS,       sharpness_apply},
+    {RASPIJPGS_CONTRAST,        contrast_apply},
+    {RASPIJPGS_BRIGHTNESS,      brightness_apply},
+    {RASPIJPGS_SATURATION,      saturation_apply},
+    {RASPIJPGS_ISO,             ISO_apply},
+    {RASPIJPGS_VSTAB,           vstab_apply},
+    {RASPIJPGS_EV,              ev_apply},
+    {RASPIJPGS_EXPOSURE,        exposure_apply},
+    {RASPIJPGS_WIDTH,           reconfigure_apply},
+    {RASPIJPGS_HEIGHT,          reconfigure_apply},
+    {RASPIJPGS_FPS,             reconfigure_apply},
+    {RASPIJPGS_AWB,             awb_apply},
+    {RASPIJPGS_IMXFX,           imxfx_apply},
+    {RASPIJPGS_COLFX,           colfx_apply},
+    {RASPIJPGS_SENSOR_MODE,     reconfigure_apply},
+    {RASPIJPGS_METERING,        metering_apply},
+    {RASPIJPGS_ROTATION,        rotation_apply},
+    {RASPIJPGS_HFLIP,           flip_apply},
+    {RASPIJPGS_VFLIP,           flip_apply},
+    {RASPIJPGS_ROI,             roi_apply},
+    {RASPIJPGS_SHUTTER,         shutter_apply},
+    {RASPIJPGS_QUALITY,         quality_apply},
+    {RASPIJPGS_RESTART_INTERVAL, restart_interval_apply},
+    {RASPIJPGS_TARGET_RATE,     adaptive_quality_apply},
+    {RASPIJPGS_MAX_FRAME_SIZE,  adaptive_quality_apply},
+    {RASPIJPGS_QUALITY_MIN,     adaptive_quality_apply},
+    {RASPIJPGS_QUALITY_MAX,     adaptive_quality_apply},
+    {0,                         0}
+};
+
+static void mmal_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    int i;
+    for (i = 0; mmal_options[i].env_key; i++) {
+        if (strcmp(mmal_options[i].env_key, opt->env_key) == 0) {
+            mmal_options[i].apply(opt, context);
+            return;
+        }
+    }
+}
+
+static void mmal_print_stats(FILE *fp)
+{
+    int i;
+    for (i = 0; i < state.branch_count; i++) {
+        const struct mmal_branch *branch = &state.branches[i];
+        const char *name = stream_config(branch->stream)->name;
+        unsigned int spare = mmal_queue_length(branch->pool_encoder->queue);
+        unsigned int total = branch->pool_encoder->headers_num;
+        fprintf(fp, "%s encoder buffers: %u with encoder or queued, %u held by frames, %u spare (%u total)\n",
+                name, total - spare - branch->held_buffers, branch->held_buffers, spare, total);
+        if (state.zerocopy_buffers)
+            fprintf(fp, "%s zero-copy: %lu frames held, %lu buffers copied\n",
+                    name, branch->held_frames, branch->held_fallbacks);
+        if (adaptive_quality_enabled(branch->cam) && branch->encoding == stream_encoding_jpeg)
+            fprintf(fp, "%s quality: %d, %lu changes, %.0f bytes average since the last change\n",
+                    name, branch->qc.quality, branch->qc.changes, branch->qc.avg_size);
+    }
+
+    const struct mmal_callback_queue *q = &state.mmal_callback_queue;
+    uint32_t queued = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - q->tail;
+    fprintf(fp, "MMAL callback queue: %u queued for main loop, %lu buffers, %lu wakeups, max depth %u\n",
+            queued, q->buffers, q->wakeups, q->max_depth);
+}
+
+const struct frame_source mmal_source = {
+    .name = "camera",
+    .timeout_us = MMAL_TIMEOUT_US,
+    .start = mmal_start,
+    .service = mmal_callback_queue_drain,
+    .stop = mmal_stop,
+    .apply = mmal_apply,
+    .print_stats = mmal_print_stats
+};
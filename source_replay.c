@@ -0,0 +1,210 @@
+/*
+Copyright (c) 2015, Frank Hunleth
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * \file source_replay.c
+ * Frame source that plays back a capture file over and over. The file can
+ * be in cat framing (JPEGs back to back) or header framing (each JPEG
+ * preceded by its length as a 32-bit big endian integer). Frames all go to
+ * the main stream since the capture is only at one size.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "raspijpgs.h"
+
+struct replay_source_state
+{
+    int timer_fd;
+    const uint8_t *data;    // The whole capture file
+    size_t size;
+    size_t pos;             // Where the next frame starts
+    int header_framing;
+};
+
+static struct replay_source_state state = {0};
+
+// Return the length of the JPEG at the start of buf or 0 if it's not a
+// complete JPEG.
+static size_t jpeg_length(const uint8_t *buf, size_t size)
+{
+    if (size < 4 || buf[0] != 0xff || buf[1] != 0xd8)
+        return 0;
+
+    size_t pos = 2;
+    while (pos + 2 <= size) {
+        if (buf[pos] != 0xff)
+            return 0;
+
+        uint8_t marker = buf[pos + 1];
+        if (marker == 0xff) {
+            // Fill byte
+            pos++;
+            continue;
+        }
+        if (marker == 0xd9)
+            return pos + 2; // EOI
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+            // No length
+            pos += 2;
+            continue;
+        }
+
+        if (pos + 4 > size)
+            return 0;
+        pos += 2 + ((buf[pos + 2] << 8) | buf[pos + 3]);
+
+        if (marker == 0xda) {
+            // Skip the entropy coded data after the start of scan. It ends
+            // at the first marker that isn't stuffing or a restart marker.
+            while (pos + 1 < size &&
+                   (buf[pos] != 0xff || buf[pos + 1] == 0 || buf[pos + 1] == 0xff ||
+                    (buf[pos + 1] >= 0xd0 && buf[pos + 1] <= 0xd7)))
+                pos++;
+        }
+    }
+    return 0;
+}
+
+// Find the next frame in the capture file and advance past it. Returns 0 at
+// the end of the file.
+static const uint8_t *replay_next_frame(size_t *len)
+{
+    size_t remaining = state.size - state.pos;
+    const uint8_t *p = state.data + state.pos;
+
+    if (state.header_framing) {
+        if (remaining < 4)
+            return 0;
+        *len = ((size_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+        if (*len > remaining - 4)
+            return 0;
+        state.pos += 4 + *len;
+        return p + 4;
+    } else {
+        *len = jpeg_length(p, remaining);
+        if (*len == 0)
+            return 0;
+        state.pos += *len;
+        return p;
+    }
+}
+
+static void release_nothing(void *owner)
+{
+    // The capture file stays mapped until the source is stopped.
+    UNUSED(owner);
+}
+
+static int replay_start()
+{
+    const char *filename = config_string(RASPIJPGS_REPLAY);
+    if (strlen(filename) == 0)
+        errx(EXIT_FAILURE, "Specify a capture file to replay with --replay");
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        err(EXIT_FAILURE, "Can't open %s", filename);
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        err(EXIT_FAILURE, "fstat %s", filename);
+    if (st.st_size < 4)
+        errx(EXIT_FAILURE, "%s is too small to be a capture file", filename);
+
+    state.size = st.st_size;
+    state.data = (const uint8_t *) mmap(0, state.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (state.data == MAP_FAILED)
+        err(EXIT_FAILURE, "mmap %s", filename);
+    close(fd);
+
+    // Files with cat framing start with a JPEG start of image marker
+    state.header_framing = !(state.data[0] == 0xff && state.data[1] == 0xd8);
+    state.pos = 0;
+
+    size_t len;
+    if (!replay_next_frame(&len))
+        errx(EXIT_FAILURE, "%s doesn't start with a JPEG in cat or header framing", filename);
+    state.pos = 0;
+
+    state.timer_fd = frame_timer_create();
+    return state.timer_fd;
+}
+
+static void replay_service()
+{
+    if (frame_timer_read(state.timer_fd) == 0)
+        return;
+
+    struct frame_timing timing;
+    timing.capture_us = monotonic_us();
+    timing.arrival_us = timing.capture_us;
+    timing.processed_us = timing.capture_us;
+
+    size_t len;
+    const uint8_t *jpeg = replay_next_frame(&len);
+    if (!jpeg) {
+        // Loop back to the beginning. Anything that doesn't parse at the
+        // end (e.g., a capture that was cut off) is skipped.
+        state.pos = 0;
+        jpeg = replay_next_frame(&len);
+    }
+
+    // Frames point right into the mapped file so that they aren't copied
+    // even if a client has to queue them.
+    struct jpeg_frame *frame = frame_get_held(release_nothing);
+    frame_hold(frame, 0, jpeg, len);
+    timing.assembled_us = monotonic_us();
+
+    struct iovec iov[FRAME_MAX_SEGMENTS];
+    int iovcnt = frame_iov(frame, iov);
+    deliver_jpeg(0, iov, iovcnt, len, frame, &timing);
+    frame_unref(frame);
+}
+
+static void replay_stop()
+{
+    close(state.timer_fd);
+    state.timer_fd = -1;
+    munmap((void *) state.data, state.size);
+    state.data = 0;
+}
+
+const struct frame_source replay_source = {
+    .name = "replay",
+    .start = replay_start,
+    .service = replay_service,
+    .stop = replay_stop
+};
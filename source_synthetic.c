@@ -0,0 +1,376 @@
+/*
+Copyright (c) 2015, Frank Hunleth
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * \file source_synthetic.c
+ * Frame source that makes up JPEGs so that raspijpgs can run without a
+ * camera. Each frame is a grayscale image with a bar that moves across it.
+ * Frames can be padded to a fixed size to simulate higher resolutions or
+ * qualities. A comment segment records the frame number and the
+ * CLOCK_MONOTONIC time in microseconds that the frame was made. Every stream
+ * gets a frame at its size. Padding is scaled by area from the main stream.
+ * When motion detection is on, a small copy of the main stream's picture is
+ * passed along too. Changes to --width, --height and --fps take effect at the
+ * next frame.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "raspijpgs.h"
+
+#define SYNTHETIC_BACKGROUND        64  // Gray levels
+#define SYNTHETIC_BAR               200
+#define JPEG_MAX_SEGMENT_PAYLOAD    65533
+
+struct synthetic_stream
+{
+    int width;
+    int height;
+    size_t padded_size;
+};
+
+struct synthetic_source_state
+{
+    int timer_fd;
+    struct synthetic_stream streams[MAX_STREAMS];
+    int stream_count;
+    unsigned int frame_number;
+    int reconfigure;    // A client changed the size or frame rate
+
+    // Huffman codes for DC differences by category
+    uint16_t dc_codes[12];
+    uint8_t dc_code_lengths[12];
+};
+
+static struct synthetic_source_state state = {0};
+
+// The standard luminance DC Huffman table from the JPEG spec (Table K.3)
+static const uint8_t dc_bits[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t dc_values[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+// Every AC coefficient is 0, so the only AC symbol needed is end of block.
+static const uint8_t ac_bits[16] = {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t ac_values[1] = {0x00};
+#define AC_EOB_CODE         0
+#define AC_EOB_CODE_LENGTH  1
+
+struct bit_writer
+{
+    char *out;
+    size_t ix;
+    uint32_t bits;
+    int bit_count;
+};
+
+static void put_bits(struct bit_writer *w, uint32_t value, int count)
+{
+    w->bits = (w->bits << count) | (value & ((1 << count) - 1));
+    w->bit_count += count;
+    while (w->bit_count >= 8) {
+        uint8_t byte = (uint8_t) (w->bits >> (w->bit_count - 8));
+        w->out[w->ix++] = byte;
+        if (byte == 0xff)
+            w->out[w->ix++] = 0; // byte stuffing
+        w->bit_count -= 8;
+    }
+}
+
+static void flush_bits(struct bit_writer *w)
+{
+    // Pad the last byte with 1s
+    if (w->bit_count > 0)
+        put_bits(w, 0x7f, 8 - w->bit_count);
+}
+
+static void put_bytes(struct bit_writer *w, const void *data, size_t len)
+{
+    memcpy(&w->out[w->ix], data, len);
+    w->ix += len;
+}
+
+static void put_marker(struct bit_writer *w, uint8_t marker, size_t payload_len)
+{
+    w->out[w->ix++] = 0xff;
+    w->out[w->ix++] = marker;
+    if (payload_len) {
+        w->out[w->ix++] = (payload_len + 2) >> 8;
+        w->out[w->ix++] = (payload_len + 2) & 0xff;
+    }
+}
+
+static void put_dc_diff(struct bit_writer *w, int diff)
+{
+    int magnitude = diff < 0 ? -diff : diff;
+    int category = 0;
+    while (magnitude >> category)
+        category++;
+
+    put_bits(w, state.dc_codes[category], state.dc_code_lengths[category]);
+    if (category)
+        put_bits(w, diff < 0 ? diff + (1 << category) - 1 : diff, category);
+}
+
+static void make_dc_codes()
+{
+    // Canonical Huffman code assignment (JPEG spec Annex C)
+    uint16_t code = 0;
+    int value_ix = 0;
+    int length;
+    for (length = 1; length <= 16; length++) {
+        int i;
+        for (i = 0; i < dc_bits[length - 1]; i++) {
+            state.dc_codes[dc_values[value_ix]] = code++;
+            state.dc_code_lengths[dc_values[value_ix]] = length;
+            value_ix++;
+        }
+        code <<= 1;
+    }
+}
+
+static size_t synthetic_max_size(const struct synthetic_stream *ss)
+{
+    size_t blocks = (ss->width / 8) * (ss->height / 8);
+
+    // Headers plus a worst case of 3 bytes per block after stuffing
+    size_t size = 1024 + 3 * blocks;
+    return size > ss->padded_size ? size : ss->padded_size;
+}
+
+static struct jpeg_frame *synthetic_make_frame(const struct synthetic_stream *ss, int64_t made_us)
+{
+    struct jpeg_frame *frame = frame_get(synthetic_max_size(ss));
+    struct bit_writer w = {frame->data, 0, 0, 0};
+
+    put_marker(&w, 0xd8, 0); // SOI
+
+    static const uint8_t jfif[] = {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0};
+    put_marker(&w, 0xe0, sizeof(jfif));
+    put_bytes(&w, jfif, sizeof(jfif));
+
+    // The comment has when the frame was made so that the benchmark can
+    // measure latency
+    char comment[64];
+    int comment_len = sprintf(comment, "raspijpgs synthetic frame %u at %lld",
+                              state.frame_number, (long long) made_us);
+    put_marker(&w, 0xfe, comment_len);
+    put_bytes(&w, comment, comment_len);
+    size_t comment_end = w.ix;
+
+    // Quantization table of all 1s so that DC values map directly to
+    // gray levels.
+    put_marker(&w, 0xdb, 65);
+    w.out[w.ix++] = 0;
+    memset(&w.out[w.ix], 1, 64);
+    w.ix += 64;
+
+    uint8_t sof[] = {8, ss->height >> 8, ss->height & 0xff, ss->width >> 8, ss->width & 0xff, 1, 1, 0x11, 0};
+    put_marker(&w, 0xc0, sizeof(sof));
+    put_bytes(&w, sof, sizeof(sof));
+
+    put_marker(&w, 0xc4, 1 + sizeof(dc_bits) + sizeof(dc_values));
+    w.out[w.ix++] = 0x00; // DC table 0
+    put_bytes(&w, dc_bits, sizeof(dc_bits));
+    put_bytes(&w, dc_values, sizeof(dc_values));
+    put_marker(&w, 0xc4, 1 + sizeof(ac_bits) + sizeof(ac_values));
+    w.out[w.ix++] = 0x10; // AC table 0
+    put_bytes(&w, ac_bits, sizeof(ac_bits));
+    put_bytes(&w, ac_values, sizeof(ac_values));
+
+    static const uint8_t sos[] = {1, 1, 0x00, 0, 63, 0};
+    put_marker(&w, 0xda, sizeof(sos));
+    put_bytes(&w, sos, sizeof(sos));
+
+    // Each block is a flat color, so only its DC coefficient is non-zero.
+    int blocks_wide = ss->width / 8;
+    int blocks_high = ss->height / 8;
+    int bar_width = blocks_wide / 8 > 0 ? blocks_wide / 8 : 1;
+    int bar_x = state.frame_number % blocks_wide;
+    int last_dc = 0;
+    int x, y;
+    for (y = 0; y < blocks_high; y++) {
+        for (x = 0; x < blocks_wide; x++) {
+            int level = (x >= bar_x && x < bar_x + bar_width) ? SYNTHETIC_BAR : SYNTHETIC_BACKGROUND;
+            int dc = 8 * (level - 128);
+            put_dc_diff(&w, dc - last_dc);
+            put_bits(&w, AC_EOB_CODE, AC_EOB_CODE_LENGTH);
+            last_dc = dc;
+        }
+    }
+    flush_bits(&w);
+    put_marker(&w, 0xd9, 0); // EOI
+
+    // Pad the frame with comments after the first one
+    if (w.ix + 4 <= ss->padded_size) {
+        size_t padding = ss->padded_size - w.ix;
+        memmove(&w.out[comment_end + padding], &w.out[comment_end], w.ix - comment_end);
+        w.ix = comment_end;
+        while (padding >= 4) {
+            size_t payload = padding - 4;
+            if (payload > JPEG_MAX_SEGMENT_PAYLOAD)
+                payload = JPEG_MAX_SEGMENT_PAYLOAD;
+            // Don't leave a remainder too small for another comment
+            if (padding - payload - 4 > 0 && padding - payload - 4 < 4)
+                payload -= 4;
+            put_marker(&w, 0xfe, payload);
+            memset(&w.out[w.ix], 0, payload);
+            w.ix += payload;
+            padding -= payload + 4;
+        }
+        w.ix = ss->padded_size;
+    }
+
+    frame->len = w.ix;
+    return frame;
+}
+
+// Draw the main stream's picture at the motion detection size
+static void synthetic_make_luma(uint8_t *luma)
+{
+    const struct synthetic_stream *ss = &state.streams[0];
+    int blocks_wide = ss->width / 8;
+    int bar_width = blocks_wide / 8 > 0 ? blocks_wide / 8 : 1;
+    int bar_x = state.frame_number % blocks_wide;
+    int left = bar_x * MOTION_WIDTH / blocks_wide;
+    int right = (bar_x + bar_width) * MOTION_WIDTH / blocks_wide;
+    if (right > MOTION_WIDTH)
+        right = MOTION_WIDTH;
+
+    int y;
+    for (y = 0; y < MOTION_HEIGHT; y++) {
+        uint8_t *row = &luma[y * MOTION_WIDTH];
+        memset(row, SYNTHETIC_BACKGROUND, MOTION_WIDTH);
+        memset(&row[left], SYNTHETIC_BAR, right - left);
+    }
+}
+
+static void synthetic_sizes()
+{
+    size_t main_padded_size = config_int(RASPIJPGS_SYNTHETIC_SIZE);
+    int i;
+    for (i = 0; i < state.stream_count; i++) {
+        const struct stream_config *config = stream_config(i);
+        struct synthetic_stream *ss = &state.streams[i];
+        ss->width = config->width;
+        if (ss->width <= 0)
+            ss->width = 320;
+        ss->width = constrain(16, ss->width & ~0xf, 4096);
+        ss->height = config->height;
+        if (ss->height <= 0)
+            ss->height = ss->width * 3 / 4;
+        ss->height = constrain(16, ss->height & ~0xf, 4096);
+
+        const struct synthetic_stream *main_stream = &state.streams[0];
+        ss->padded_size = (size_t) ((double) main_padded_size * ss->width * ss->height /
+                                    (main_stream->width * main_stream->height));
+    }
+}
+
+static int synthetic_start()
+{
+    state.stream_count = stream_count();
+    int i;
+    for (i = 0; i < state.stream_count; i++) {
+        const struct stream_config *config = stream_config(i);
+        if (config->encoding != stream_encoding_jpeg)
+            errx(EXIT_FAILURE, "The synthetic source only makes JPEG streams. Check '%s' in --streams", config->name);
+    }
+    synthetic_sizes();
+    state.frame_number = 0;
+    state.reconfigure = 0;
+
+    make_dc_codes();
+
+    state.timer_fd = frame_timer_create();
+    return state.timer_fd;
+}
+
+static void synthetic_service()
+{
+    // Frames that are late get dropped like they would be by the camera
+    if (frame_timer_read(state.timer_fd) == 0)
+        return;
+
+    if (state.reconfigure) {
+        source_reconfiguring();
+        synthetic_sizes();
+        frame_timer_set(state.timer_fd);
+        state.reconfigure = 0;
+    }
+
+    struct frame_timing timing;
+    timing.capture_us = monotonic_us();
+    timing.arrival_us = timing.capture_us;
+
+    if (motion_enabled()) {
+        static uint8_t luma[MOTION_WIDTH * MOTION_HEIGHT];
+        synthetic_make_luma(luma);
+        deliver_luma(luma, MOTION_WIDTH, timing.capture_us);
+    }
+
+    int i;
+    for (i = 0; i < state.stream_count && source_wants_frames(); i++) {
+        timing.processed_us = monotonic_us();
+        struct jpeg_frame *frame = synthetic_make_frame(&state.streams[i], timing.capture_us);
+        timing.assembled_us = monotonic_us();
+
+        struct iovec iov[FRAME_MAX_SEGMENTS];
+        int iovcnt = frame_iov(frame, iov);
+        deliver_jpeg(i, iov, iovcnt, frame->len, frame, &timing);
+        frame_unref(frame);
+    }
+    state.frame_number++;
+}
+
+static void synthetic_apply(const struct raspi_config_opt *opt, enum config_context context)
+{
+    // Handle everything that a client sent at once on the next timer tick
+    if (context == config_context_client_request &&
+            (strcmp(opt->env_key, RASPIJPGS_WIDTH) == 0 ||
+             strcmp(opt->env_key, RASPIJPGS_HEIGHT) == 0 ||
+             strcmp(opt->env_key, RASPIJPGS_FPS) == 0))
+        state.reconfigure = 1;
+}
+
+static void synthetic_stop()
+{
+    close(state.timer_fd);
+    state.timer_fd = -1;
+}
+
+const struct frame_source synthetic_source = {
+    .name = "synthetic",
+    .start = synthetic_start,
+    .service = synthetic_service,
+    .stop = synthetic_stop,
+    .apply = synthetic_apply
+};
@@ -0,0 +1,379 @@
+/*
+Copyright (c) 2015, Frank Hunleth
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/**
+ * \file uring.c
+ * Batch the main loop's socket sends and output writes with io_uring so
+ * that a frame costs one system call instead of one per subscriber. This
+ * talks to the kernel directly rather than through liburing. Whether
+ * io_uring can be used is only known at runtime since older kernels and
+ * seccomp filters refuse it. If it can't, or the headers are too old to
+ * build it, uring_init() returns 0 and the callers send and write as usual.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "raspijpgs.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+// Probing for opcodes came after everything else used here
+#if defined(IO_URING_OP_SUPPORTED) && defined(__NR_io_uring_setup)
+#define URING_SUPPORTED 1
+#endif
+
+struct uring_stats
+{
+    unsigned long batches;
+    unsigned long ops;
+    unsigned long syscalls;
+};
+
+#ifdef URING_SUPPORTED
+
+#define URING_ENTRIES 64
+
+// What an operation points to needs to stay put until it completes, so
+// each submission queue entry has its own copy.
+struct uring_slot
+{
+    struct msghdr msg;
+    struct iovec iov[FRAME_MAX_SEGMENTS + 2];
+};
+
+struct uring_state
+{
+    int fd;
+    uring_complete_fn complete;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct uring_slot *slots;
+    unsigned queued;        // Prepared and not submitted
+    unsigned inflight;      // Submitted and not completed
+
+    struct uring_stats stats;
+};
+
+static struct uring_state state = {.fd = -1};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, state.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, state.fd, opcode, arg, nr_args);
+}
+
+static int uring_has_ops()
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *) calloc(1, size);
+    if (!probe)
+        err(EXIT_FAILURE, "calloc");
+
+    int ok = uring_register(IORING_REGISTER_PROBE, probe, 256) == 0 &&
+            probe->last_op >= IORING_OP_SENDMSG &&
+            (probe->ops[IORING_OP_SENDMSG].flags & IO_URING_OP_SUPPORTED) &&
+            (probe->ops[IORING_OP_WRITEV].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+static void uring_unmap()
+{
+    if (state.sqes)
+        munmap(state.sqes, state.sqes_size);
+    if (state.cq_ring && state.cq_ring != state.sq_ring)
+        munmap(state.cq_ring, state.cq_ring_size);
+    if (state.sq_ring)
+        munmap(state.sq_ring, state.sq_ring_size);
+    state.sqes = 0;
+    state.cq_ring = 0;
+    state.sq_ring = 0;
+}
+
+int uring_init(uring_complete_fn complete)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    state.fd = uring_setup(URING_ENTRIES, &p);
+    if (state.fd < 0) {
+        warn("Not using io_uring");
+        return 0;
+    }
+    if (!uring_has_ops()) {
+        warnx("Not using io_uring since this kernel can't send messages with it");
+        uring_exit();
+        return 0;
+    }
+
+    state.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    state.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state.cq_ring_size > state.sq_ring_size)
+            state.sq_ring_size = state.cq_ring_size;
+        state.cq_ring_size = state.sq_ring_size;
+    }
+    state.sq_ring = mmap(0, state.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         state.fd, IORING_OFF_SQ_RING);
+    if (state.sq_ring == MAP_FAILED)
+        err(EXIT_FAILURE, "mmap io_uring submission queue");
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state.cq_ring = state.sq_ring;
+    } else {
+        state.cq_ring = mmap(0, state.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             state.fd, IORING_OFF_CQ_RING);
+        if (state.cq_ring == MAP_FAILED)
+            err(EXIT_FAILURE, "mmap io_uring completion queue");
+    }
+    state.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    state.sqes = (struct io_uring_sqe *) mmap(0, state.sqes_size, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, state.fd, IORING_OFF_SQES);
+    if (state.sqes == MAP_FAILED)
+        err(EXIT_FAILURE, "mmap io_uring entries");
+
+    char *sq = (char *) state.sq_ring;
+    state.sq_head = (unsigned *) (sq + p.sq_off.head);
+    state.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    state.sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    state.sq_array = (unsigned *) (sq + p.sq_off.array);
+    state.sq_entries = p.sq_entries;
+
+    char *cq = (char *) state.cq_ring;
+    state.cq_head = (unsigned *) (cq + p.cq_off.head);
+    state.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    state.cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    state.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    state.slots = (struct uring_slot *) calloc(p.sq_entries, sizeof(struct uring_slot));
+    if (!state.slots)
+        err(EXIT_FAILURE, "calloc");
+    state.complete = complete;
+    state.queued = 0;
+    state.inflight = 0;
+    return 1;
+}
+
+int uring_enabled()
+{
+    return state.fd >= 0;
+}
+
+// Returns the next free entry or 0 if the batch is full
+static struct io_uring_sqe *uring_get_sqe(struct uring_slot **slot)
+{
+    unsigned tail = *state.sq_tail;
+    if (tail - __atomic_load_n(state.sq_head, __ATOMIC_ACQUIRE) >= state.sq_entries)
+        return 0;
+
+    unsigned index = tail & state.sq_mask;
+    struct io_uring_sqe *sqe = &state.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    *slot = &state.slots[index];
+    state.sq_array[index] = index;
+    return sqe;
+}
+
+static void uring_queue_sqe()
+{
+    __atomic_store_n(state.sq_tail, *state.sq_tail + 1, __ATOMIC_RELEASE);
+    state.queued++;
+}
+
+int uring_sendmsg(int fd, const struct msghdr *msg, int flags, uint64_t user_data)
+{
+    struct uring_slot *slot;
+    struct io_uring_sqe *sqe = uring_get_sqe(&slot);
+    if (!sqe || msg->msg_iovlen > FRAME_MAX_SEGMENTS + 2)
+        return 0;
+
+    slot->msg = *msg;
+    memcpy(slot->iov, msg->msg_iov, msg->msg_iovlen * sizeof(struct iovec));
+    slot->msg.msg_iov = slot->iov;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) &slot->msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = user_data;
+    uring_queue_sqe();
+    return 1;
+}
+
+int uring_writev(int fd, const struct iovec *iov, int iovcnt, uint64_t user_data)
+{
+    struct uring_slot *slot;
+    struct io_uring_sqe *sqe = uring_get_sqe(&slot);
+    if (!sqe || iovcnt > FRAME_MAX_SEGMENTS + 2)
+        return 0;
+
+    memcpy(slot->iov, iov, iovcnt * sizeof(struct iovec));
+
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) slot->iov;
+    sqe->len = iovcnt;
+    sqe->off = (uint64_t) -1; // At the file position like writev()
+    sqe->user_data = user_data;
+    uring_queue_sqe();
+    return 1;
+}
+
+// Submit everything that's queued and wait for it all to finish. The
+// sockets and output are non-blocking, so this is usually one system call
+// that does the whole batch.
+void uring_submit(void *context)
+{
+    if (state.queued == 0)
+        return;
+
+    state.stats.batches++;
+    state.stats.ops += state.queued;
+    state.inflight += state.queued;
+    unsigned to_submit = state.queued;
+    state.queued = 0;
+    while (state.inflight) {
+        state.stats.syscalls++;
+        int rc = uring_enter(to_submit, state.inflight, IORING_ENTER_GETEVENTS);
+        if (rc < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                err(EXIT_FAILURE, "io_uring_enter");
+        } else {
+            to_submit -= rc;
+        }
+
+        unsigned head = *state.cq_head;
+        unsigned tail = __atomic_load_n(state.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe cqe = state.cqes[head & state.cq_mask];
+            head++;
+            __atomic_store_n(state.cq_head, head, __ATOMIC_RELEASE);
+            state.inflight--;
+            state.complete(cqe.user_data, cqe.res, context);
+        }
+    }
+}
+
+void uring_exit()
+{
+    if (state.fd < 0)
+        return;
+    uring_unmap();
+    close(state.fd);
+    state.fd = -1;
+    free(state.slots);
+    state.slots = 0;
+}
+
+void uring_print_stats(FILE *fp)
+{
+    if (state.fd < 0)
+        return;
+    fprintf(fp, "io_uring: %lu batches, %.1f operations per batch, %lu system calls\n",
+            state.stats.batches,
+            state.stats.batches ? (double) state.stats.ops / state.stats.batches : 0.0,
+            state.stats.syscalls);
+}
+
+#else
+
+int uring_init(uring_complete_fn complete)
+{
+    UNUSED(complete);
+    warnx("Not using io_uring since it wasn't available when this was built");
+    return 0;
+}
+
+int uring_enabled()
+{
+    return 0;
+}
+
+int uring_sendmsg(int fd, const struct msghdr *msg, int flags, uint64_t user_data)
+{
+    UNUSED(fd); UNUSED(msg); UNUSED(flags); UNUSED(user_data);
+    return 0;
+}
+
+int uring_writev(int fd, const struct iovec *iov, int iovcnt, uint64_t user_data)
+{
+    UNUSED(fd); UNUSED(iov); UNUSED(iovcnt); UNUSED(user_data);
+    return 0;
+}
+
+void uring_submit(void *context)
+{
+    UNUSED(context);
+}
+
+void uring_exit()
+{
+}
+
+void uring_print_stats(FILE *fp)
+{
+    UNUSED(fp);
+}
+
+#endif